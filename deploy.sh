@@ -35,6 +35,7 @@ then
 	cp appliance/ui.sh debian/usr/bin/
 	cp manager/sla-ng-manager debian/usr/bin/sla-ng-manager
 	cp manager/sla-ng-view debian/usr/bin/sla-ng-view
+	cp manager/sla-ng-replay debian/usr/bin/sla-ng-replay
 	cp manager/manager.conf debian/etc/sla-ng
 	cp -r manager/slang debian/usr/lib/python2.6/dist-packages
 	fakeroot dpkg-deb --build debian sla-ng.deb
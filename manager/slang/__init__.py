@@ -1 +1 @@
-__all__ = [ "config", "maintainer", "manager", "probed", "probe", "probestore", "remoteproc" ]
+__all__ = [ "capture", "config", "maintainer", "manager", "probed", "probe", "probestore", "remoteproc" ]
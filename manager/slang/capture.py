@@ -0,0 +1,67 @@
+#! /usr/bin/python
+#
+# capture.py
+#
+# Reads the result captures written by 'probed -C'.
+#
+
+from struct import unpack, calcsize
+
+import probe
+
+#
+# constants
+#
+MAGIC = 0x534c4e4743415054 # "SLNGCAPT"
+VERSION = 1
+
+# struct cap_hdr: magic, version, record size, count, created [ns]
+HEADER_FORMAT = 'QIIqq'
+HEADER_SIZE = calcsize(HEADER_FORMAT)
+
+# struct cap_rec: delivered [ns], followed by a struct res_fifo
+TS_FORMAT = 'q'
+TS_SIZE = calcsize(TS_FORMAT)
+RECORD_SIZE = TS_SIZE + probe.RECORD_SIZE
+
+# records read at a time
+CHUNK = 4096
+
+
+def read(path):
+    """ Read the capture at 'path'.
+
+        Yields a (delivered, Probe) tuple per result, in the order they
+        were given to the FIFO. 'delivered' is in nanoseconds since the
+        epoch, like Probe.created.
+    """
+
+    f = open(path, 'rb')
+    try:
+        hdr = f.read(HEADER_SIZE)
+        if len(hdr) < HEADER_SIZE:
+            raise CaptureError('%s: Not a capture' % path)
+        (magic, version, rec_size, count, created) = unpack(HEADER_FORMAT, hdr)
+        if magic != MAGIC or version != VERSION or rec_size != RECORD_SIZE:
+            raise CaptureError('%s: Not a capture' % path)
+
+        while count > 0:
+            n = min(count, CHUNK)
+            data = f.read(n * RECORD_SIZE)
+            n = len(data) / RECORD_SIZE
+            if n < 1:
+                break
+            for i in xrange(n):
+                rec = data[i * RECORD_SIZE:(i + 1) * RECORD_SIZE]
+                yield (unpack(TS_FORMAT, rec[:TS_SIZE])[0],
+                    probe.from_struct(rec[TS_SIZE:]))
+            count -= n
+
+    finally:
+        f.close()
+
+
+class CaptureError(Exception):
+    """ Exception for unreadable captures.
+    """
+    pass
@@ -56,6 +56,8 @@ class Config:
         """
         if param == 'fifopath':
             return '/tmp/probed.fifo'
+        if param == 'statepath':
+            return '/var/tmp/probed.state'
         if param == 'dbpath':
             return ':memory:'
         if param == 'rpcport':
@@ -72,6 +74,11 @@ class Config:
             return self.lines[3].strip()
         if param == 'interface':
             return self.lines[4].strip()
+        if param == 'capturepath':
+            # optional; capture results for sla-ng-replay
+            if len(self.lines) > 5:
+                return self.lines[5].strip()
+            return ''
         raise ConfigError("Invalid config parameter")
 
 
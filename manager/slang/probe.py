@@ -5,7 +5,7 @@
 # The 'Probe' class which represents a single measurement.
 #
 
-from struct import unpack
+from struct import unpack, calcsize
 import time
 
 #
@@ -18,19 +18,24 @@ STATE_PONGLOSS = 4 # Ready, but timeout, got only TS, lost PONG
 STATE_TIMEOUT = 5  # Ready, but timeout, got neither PONG or TS
 STATE_DUP = 6      # Got a PONG we didn't recognize, DUP?
 
+# struct res_fifo: id, seq, state, dispersion [ns], created [ns], rtt [ns]
+RECORD_FORMAT = 'iiiIqq'
+RECORD_SIZE = calcsize(RECORD_FORMAT)
+
 
 def from_struct(structdata):
     """ Create probe from raw data data.
     """
 
-    d = unpack('iiiiiii', structdata)
+    d = unpack(RECORD_FORMAT, structdata)
 
     clist = (
         d[0],
         d[1],
         d[2],
-        d[3]*1000000000+d[4],
-        d[5]*1000000000+d[6],
+        d[4],
+        d[5],
+        d[3],
     )
 
     return Probe(clist)
@@ -44,6 +49,7 @@ class Probe:
 
     created = None
     rtt = None
+    dispersion = None
     delay_variation = None
     in_order = None
     dups = None
@@ -66,6 +72,7 @@ class Probe:
         self.state = data[2]
         self.created = data[3]
         self.rtt = data[4]
+        self.dispersion = data[5]
         self.in_order = None
         self.delay_variation = None
         self.dups = 0
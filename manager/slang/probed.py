@@ -65,6 +65,8 @@ class Probed(threading.Thread):
         probed_args = ['/usr/bin/probed', '-q']
         probed_args += ['-p', self.config.get('port')]
         probed_args += ['-d', self.config.get('fifopath')]
+        # resume sequence numbers across restarts
+        probed_args += ['-S', self.config.get('statepath')]
         # timestamping type - hardware is default
         tstype = self.config.get('timestamp')
         if tstype == 'kernel':
@@ -79,6 +81,10 @@ class Probed(threading.Thread):
             # interface name to enable timestamping for.
             probed_args += ['-i', self.config.get('interface')]
 
+        # capture results, for sla-ng-replay
+        if len(self.config.get('capturepath')) > 0:
+            probed_args += ['-C', self.config.get('capturepath')]
+
         # config file
         probed_args += ['-f', self.config.get('probed_cfg')]
 
@@ -165,8 +171,8 @@ class Probed(threading.Thread):
                 continue
 
             try:
-                # ~780 probes can be held in fifo buff before pause
-                data = self.fifo.read(28)
+                # ~2000 probes can be held in fifo buff before pause
+                data = self.fifo.read(probe.RECORD_SIZE)
             except Exception, e:
                 self.logger.error('Unable to read from FIFO: %s' % e)
                 time.sleep(1)
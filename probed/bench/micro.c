@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   micro.c
+ * \brief  Micro benchmarks of the per-packet functions of probed
+ *
+ * Times the hot-path primitives one at a time, with inputs captured from
+ * real loopback traffic where it matters (control messages, sockets), and
+ * prints ns/op and allocs/op. Allocations are counted by linking with
+ * -Wl,--wrap=malloc (and calloc/realloc), so only allocations made by
+ * probed's own code are seen, not those inside libc or libxml2.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <sys/select.h>
+#include <netdb.h>
+#include <linux/errqueue.h>
+#include "../probed.h"
+#include "../util.h"
+#include "../net.h"
+#include "../tstamp.h"
+#include "../client.h"
+
+#define BATCH 64 /* packets in flight on loopback per send/recv round */
+
+struct config cfg;
+
+static unsigned long n_alloc = 0;
+static volatile long sink = 0;
+static num_t tx_seq = 0; /* last sequence number sent in session 1 */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	n_alloc++;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	n_alloc++;
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size) {
+	n_alloc++;
+	return __real_realloc(ptr, size);
+}
+
+/**
+ * Book-keeping for one benchmark; time is accumulated between
+ * bench_start() and bench_stop(), so setup work can be left out
+ */
+struct bench {
+	const char *name;
+	long long ns;
+	unsigned long allocs;
+	long iters;
+	struct timespec t0;
+	unsigned long a0;
+};
+
+static void bench_start(struct bench *b) {
+	b->a0 = n_alloc;
+	(void)clock_gettime(CLOCK_MONOTONIC, &b->t0);
+}
+static void bench_stop(struct bench *b, long iters) {
+	struct timespec t1;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+	b->ns += (t1.tv_sec - b->t0.tv_sec) * 1000000000LL +
+		(t1.tv_nsec - b->t0.tv_nsec);
+	b->allocs += n_alloc - b->a0;
+	b->iters += iters;
+}
+static void bench_print(struct bench *b) {
+	if (b->iters < 1) {
+		printf("%-44s %10s\n", b->name, "skipped");
+		return;
+	}
+	printf("%-44s %10ld %10.1f %10.2f\n", b->name, b->iters,
+			(double)b->ns / b->iters, (double)b->allocs / b->iters);
+}
+
+/**
+ * Throw away TX timestamps left on the error queue by plain sendto()
+ */
+static void errqueue_drain(int sock) {
+	char data[DATALEN], control[512];
+	struct msghdr msg;
+	struct iovec iov;
+
+	do {
+		memset(&msg, 0, sizeof msg);
+		iov.iov_base = data;
+		iov.iov_len = sizeof data;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+	} while (recvmsg(sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) >= 0);
+}
+
+/**
+ * Send a PING to ourselves and keep the received message, or its TX
+ * timestamp from the error queue, including control messages, as input
+ * for the cmsg parsers
+ */
+static int capture(int sock, addr_t *self, int errqueue, struct msghdr *msg,
+		struct iovec *iov, char *control, size_t clen) {
+	char data[DATALEN];
+	fd_set fs;
+	struct timeval tv;
+	int tries, ret = -1;
+
+	memset(data, 0, sizeof data);
+	((data_t *)data)->type = TYPE_PING;
+	(void)dscp_set(sock, 46);
+	if (sendto(sock, data, DATALEN, 0, (struct sockaddr *)self,
+				(socklen_t)sizeof *self) < 0)
+		return -1;
+	for (tries = 0; tries < 10 && ret < 0; tries++) {
+		FD_ZERO(&fs);
+		FD_SET(sock, &fs);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		(void)select(sock + 1, &fs, NULL, NULL, &tv);
+		memset(msg, 0, sizeof *msg);
+		iov->iov_base = data;
+		iov->iov_len = DATALEN;
+		msg->msg_iov = iov;
+		msg->msg_iovlen = 1;
+		msg->msg_control = control;
+		msg->msg_controllen = clen;
+		if (recvmsg(sock, msg, MSG_DONTWAIT |
+					(errqueue ? MSG_ERRQUEUE : 0)) >= 0)
+			ret = 0;
+	}
+	msg->msg_iov = NULL;
+	msg->msg_iovlen = 0;
+	(void)dscp_set(sock, 0);
+	errqueue_drain(sock);
+	while (recvfrom(sock, data, sizeof data, MSG_DONTWAIT, NULL, NULL) >= 0);
+	return ret;
+}
+
+/**
+ * The mode-generic parser that tstamp_extract_rx/tx replaced, kept here
+ * as the baseline for the specialized ones
+ */
+static int extract_generic(struct msghdr *msg, ts_t *ts, int tx) {
+	struct cmsghdr *cmsg;
+	struct timespec *t;
+	struct sock_extended_err *err;
+	int ok = 0;
+
+	*ts = 0;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET) {
+			if (cfg.ts != USERLAND &&
+					cmsg->cmsg_type == SO_TIMESTAMPING) {
+				/* systime, hwtimesys, hwtimeraw */
+				t = (struct timespec *)CMSG_DATA(cmsg);
+				if (cfg.ts == HARDWARE) *ts = TS_FROM_TIMESPEC(t[2]);
+				if (cfg.ts == KERNEL) *ts = TS_FROM_TIMESPEC(t[0]);
+				if (!tx) return 0;
+				else ok |= 1;
+				if (ok == 3) return 0;
+			}
+			if (cfg.ts == USERLAND
+					&& cmsg->cmsg_type == SO_TIMESTAMPNS) {
+				t = (struct timespec *)CMSG_DATA(cmsg);
+				*ts = TS_FROM_TIMESPEC(*t);
+				return 0;
+			}
+		}
+		if (tx && cmsg->cmsg_level == IPPROTO_IPV6) {
+			if (cmsg->cmsg_type == IPV6_RECVERR) {
+				err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+				if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+					ok |= 2;
+					if (ok == 3) return 0;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+static void bench_parse(const char *what, const char *mode,
+		struct msghdr *msg, int tx, long n) {
+	struct bench bg = { NULL, 0, 0, 0, {0, 0}, 0 };
+	struct bench bs = { NULL, 0, 0, 0, {0, 0}, 0 };
+	char name_g[64], name_s[64];
+	ts_t ts;
+	long i;
+
+	(void)snprintf(name_g, sizeof name_g, "%s generic (%s)", what, mode);
+	(void)snprintf(name_s, sizeof name_s, "%s specialized (%s)", what, mode);
+	bg.name = name_g;
+	bs.name = name_s;
+	bench_start(&bg);
+	for (i = 0; i < n; i++)
+		sink += extract_generic(msg, &ts, tx);
+	bench_stop(&bg, n);
+	bench_start(&bs);
+	if (tx)
+		for (i = 0; i < n; i++)
+			sink += tstamp_extract_tx(msg, &ts);
+	else
+		for (i = 0; i < n; i++)
+			sink += tstamp_extract_rx(msg, &ts);
+	bench_stop(&bs, n);
+	bench_print(&bg);
+	bench_print(&bs);
+}
+
+/**
+ * Timestamp and DSCP parsing for the current timestamp backend. Hardware
+ * timestamps use the same SO_TIMESTAMPING message as kernel ones, so the
+ * hardware backend is timed on the kernel mode capture too.
+ */
+static void bench_extract(int sock, addr_t *self, long n) {
+	struct bench bd = { NULL, 0, 0, 0, {0, 0}, 0 };
+	const char *mode;
+	char name_d[64];
+	char rx_control[512], tx_control[512];
+	struct msghdr rx_msg, tx_msg;
+	struct iovec rx_iov, tx_iov;
+	uint8_t dscp;
+	long i;
+	int has_tx;
+
+	mode = cfg.ts == KERNEL ? "kernel" : "userland";
+	(void)snprintf(name_d, sizeof name_d, "dscp_extract (%s)", mode);
+	bd.name = name_d;
+	if (capture(sock, self, 0, &rx_msg, &rx_iov, rx_control,
+				sizeof rx_control) < 0) {
+		bench_print(&bd);
+		return;
+	}
+	has_tx = cfg.ts != USERLAND && capture(sock, self, 1, &tx_msg, &tx_iov,
+			tx_control, sizeof tx_control) == 0;
+
+	bench_parse("tstamp rx", mode, &rx_msg, 0, n);
+	if (has_tx)
+		bench_parse("tstamp tx", mode, &tx_msg, 1, n);
+	if (cfg.ts == KERNEL) {
+		cfg.ts = HARDWARE;
+		tstamp_backend_select();
+		bench_parse("tstamp rx", "hardware", &rx_msg, 0, n);
+		if (has_tx)
+			bench_parse("tstamp tx", "hardware", &tx_msg, 1, n);
+		cfg.ts = KERNEL;
+		tstamp_backend_select();
+	}
+
+	bench_start(&bd);
+	for (i = 0; i < n; i++) {
+		sink += dscp_extract(&rx_msg, &dscp);
+		sink += dscp;
+	}
+	bench_stop(&bd, n);
+	bench_print(&bd);
+}
+
+/**
+ * BATCH PINGs are sent to our own socket, then received; the two halves
+ * are timed separately. In kernel mode send_w_ts includes the wait for
+ * the TX timestamp on the error queue.
+ */
+static void bench_sendrecv(int sock, addr_t *self, const char *mode, long n) {
+	struct bench bs = { "send_w_ts", 0, 0, 0, {0, 0}, 0 };
+	struct bench br = { "recv_w_ts", 0, 0, 0, {0, 0}, 0 };
+	char name_s[64], name_r[64];
+	char data[DATALEN];
+	pkt_t pkt;
+	ts_t ts;
+	long i;
+	int j, got;
+
+	(void)snprintf(name_s, sizeof name_s, "send_w_ts loopback (%s)", mode);
+	(void)snprintf(name_r, sizeof name_r, "recv_w_ts loopback (%s)", mode);
+	bs.name = name_s;
+	br.name = name_r;
+	memset(data, 0, sizeof data);
+	((data_t *)data)->type = TYPE_PING;
+	for (i = 0; i < n; i += BATCH) {
+		bench_start(&bs);
+		for (j = 0; j < BATCH; j++) {
+			((data_t *)data)->seq = (num_t)(i + j);
+			if (send_w_ts(sock, self, data, &ts) < 0)
+				break;
+		}
+		bench_stop(&bs, j);
+		bench_start(&br);
+		for (got = 0; got < j; got++)
+			if (recv_w_ts(sock, 0, &pkt) < 0)
+				break;
+		bench_stop(&br, got);
+	}
+	bench_print(&bs);
+	bench_print(&br);
+}
+
+/**
+ * Keep 'depth' PINGs in flight in one session, and time PONG updates of
+ * the oldest one, which is the longest walk of the result list. The
+ * probe never completes, so the depth stays constant.
+ */
+static void bench_res_update(int sock, addr_t *self, int depth, long n) {
+	struct bench b = { NULL, 0, 0, 0, {0, 0}, 0 };
+	char name[64];
+	num_t seq;
+	data_t d;
+	ts_t ts;
+	long i;
+	int j;
+
+	(void)snprintf(name, sizeof name, "client_res_update (depth %d)", depth);
+	b.name = name;
+	seq = tx_seq;
+	for (j = 0; j < depth; j++)
+		client_msess_transmit(sock, ts_monotonic());
+	tx_seq += depth;
+	memset(&d, 0, sizeof d);
+	d.id = 1;
+	d.version = DATA_VERSION;
+	d.type = TYPE_PONG;
+	d.seq = seq + 1;
+	ts = ts_now();
+	bench_start(&b);
+	for (i = 0; i < n; i++)
+		client_res_update(self, &d, &ts, 0);
+	bench_stop(&b, n);
+	bench_print(&b);
+
+	/* complete everything, leaving the session empty */
+	for (j = 0; j < depth; j++) {
+		d.seq = ++seq;
+		d.type = TYPE_PONG;
+		client_res_update(self, &d, &ts, 0);
+		d.type = TYPE_TIME;
+		d.t2 = ts;
+		d.t3 = ts;
+		client_res_update(self, &d, NULL, -1);
+	}
+}
+
+/**
+ * One full probe: PING sent (result inserted), PONG and TIME received,
+ * result written to the FIFO and freed
+ */
+static void bench_res_cycle(int sock, addr_t *self, long n) {
+	struct bench b = { "transmit + PONG + TIME (full probe)", 0, 0, 0,
+		{0, 0}, 0 };
+	data_t d;
+	ts_t ts;
+	long i;
+
+	memset(&d, 0, sizeof d);
+	d.id = 1;
+	d.version = DATA_VERSION;
+	ts = ts_now();
+	d.t2 = ts;
+	d.t3 = ts;
+	bench_start(&b);
+	for (i = 0; i < n; i++) {
+		client_msess_transmit(sock, ts_monotonic());
+		d.seq = ++tx_seq;
+		d.type = TYPE_PONG;
+		client_res_update(self, &d, &ts, 0);
+		d.type = TYPE_TIME;
+		client_res_update(self, &d, NULL, -1);
+		if (i % BATCH == 0)
+			while (recvfrom(sock, &d, 0, MSG_DONTWAIT, NULL, NULL) >= 0);
+	}
+	bench_stop(&b, n);
+	bench_print(&b);
+}
+
+/**
+ * Write results to a FIFO that nobody reads; after the pipe buffer is
+ * full every record goes to the in-memory queue
+ */
+static void bench_write_fifo(long n) {
+	struct bench bf = { "client_write_fifo (reader keeps up)", 0, 0, 0,
+		{0, 0}, 0 };
+	struct bench bb = { "client_write_fifo (backpressure)", 0, 0, 0,
+		{0, 0}, 0 };
+	struct res_fifo r;
+	int pfd[2];
+	long i;
+
+	memset(&r, 0, sizeof r);
+	r.state = 1;
+	cfg.fifo = open("/dev/null", O_WRONLY);
+	bench_start(&bf);
+	for (i = 0; i < n; i++) {
+		r.seq = (uint32_t)i;
+		client_write_fifo(&r);
+	}
+	bench_stop(&bf, n);
+	(void)close(cfg.fifo);
+	bench_print(&bf);
+
+	if (pipe(pfd) < 0 || fcntl(pfd[1], F_SETFL, O_NONBLOCK) < 0)
+		return;
+	cfg.fifo = pfd[1];
+	while (write(pfd[1], &r, sizeof r) > 0);
+	bench_start(&bb);
+	for (i = 0; i < n; i++) {
+		r.seq = (uint32_t)i;
+		client_write_fifo(&r);
+	}
+	bench_stop(&bb, n);
+	bench_print(&bb);
+	(void)close(pfd[0]);
+	(void)close(pfd[1]);
+	cfg.fifo = open("/dev/null", O_WRONLY);
+}
+
+static void help_and_die(void) {
+	p("Usage: probed-micro [-n iterations] [-p port]");
+	p("\t-n num    Iterations of the cheapest benchmarks (default 10000000)");
+	p("\t-p port   Loopback UDP/TCP port to use (default 60667)");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	int arg, s_udp, s_tcp, mode, depths[] = { 1, 10, 100, 1000, 10000 };
+	unsigned int i;
+	long n;
+	char *port;
+	addr_t self;
+	struct addrinfo hints, *res;
+
+	n = 10000000;
+	port = "60667";
+	while ((arg = getopt(argc, argv, "hn:p:")) != -1) {
+		if (arg == (int)'n') n = atol(optarg);
+		else if (arg == (int)'p') port = optarg;
+		else help_and_die();
+	}
+	if (n < 1000)
+		n = 1000;
+	openlog("probed-micro", 0, LOG_USER);
+	(void)setlogmask(LOG_UPTO(LOG_CRIT));
+	cfg.op = DAEMON;
+	cfg.ring = -1;
+	cfg.uring = -1;
+	cfg.handoff = -1;
+	cfg.bulk = -1;
+	cfg.fifo = open("/dev/null", O_WRONLY);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = AI_V4MAPPED;
+	if (getaddrinfo("127.0.0.1", port, &hints, &res) != 0) {
+		p("getaddrinfo failed");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&self, res->ai_addr, sizeof self);
+	freeaddrinfo(res);
+
+	printf("%-44s %10s %10s %10s\n", "benchmark", "iters", "ns/op",
+			"allocs/op");
+	/* socket benchmarks, once per software timestamp mode */
+	for (mode = 0; mode < 2; mode++) {
+		bind_or_die(&s_udp, &s_tcp, port, 0);
+		if (mode == 0)
+			tstamp_mode_userland(s_udp);
+		else
+			tstamp_mode_kernel(s_udp);
+		tstamp_backend_select();
+		bench_extract(s_udp, &self, n / 10);
+		bench_sendrecv(s_udp, &self, mode ? "kernel" : "userland", n / 100);
+		(void)close(s_udp);
+		(void)close(s_tcp);
+	}
+
+	/* result handling, on a userland socket to ourselves */
+	bind_or_die(&s_udp, &s_tcp, port, 0);
+	tstamp_mode_userland(s_udp);
+	tstamp_backend_select();
+	client_init();
+	if (client_msess_add(port, "127.0.0.1", 0, 1, 1) != 0 ||
+			client_msess_gothello(&self) != 0) {
+		p("Unable to set up measurement session");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < sizeof depths / sizeof depths[0]; i++)
+		bench_res_update(s_udp, &self, depths[i], n / 100);
+	bench_res_cycle(s_udp, &self, n / 100);
+	bench_write_fifo(n / 100);
+
+	(void)close(s_udp);
+	(void)close(s_tcp);
+	closelog();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,411 @@
+#! /usr/bin/python
+#
+# probed-bench.py
+#
+# Load generator for probed. Generates a configuration with N measurement
+# sessions, runs probed in daemon mode against a local responder and
+# reads the results from its FIFO, as the manager would. For every N in
+# the sweep, one line is printed with achieved pps, send lateness, error
+# rates, CPU usage and RSS, giving a scaling curve which can be compared
+# between builds.
+#
+# Responders are either probed itself over loopback (the daemon answers
+# its own PINGs), or a separate probed in a network namespace connected
+# with a veth pair (-N, needs root).
+#
+
+from __future__ import print_function
+
+import errno
+import getopt
+import os
+import select
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+#
+# constants
+#
+RECORD_FMT = '=IIIIqq'  # struct res_fifo, see client.h
+RECORD_LEN = struct.calcsize(RECORD_FMT)
+
+STATE_OK = 1
+STATE_DSERROR = 2
+STATE_TSERROR = 3
+STATE_PONGLOSS = 4
+STATE_TIMEOUT = 5
+STATE_DUP = 6
+
+NS_CLIENT = 'slbench-c'
+NS_RESP = 'slbench-r'
+ADDR_CLIENT = '10.199.0.1'
+ADDR_RESP = '10.199.0.2'
+
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+PAGE_KB = os.sysconf('SC_PAGE_SIZE') // 1024
+
+
+def usage():
+    print("Usage: probed-bench.py [-N] [-b probed] [-p port] [-s n[,n...]]")
+    print("                       [-i usec] [-t sec] [-w sec] [-T ts] [-o csv]")
+    print("\t-b path   probed binary (default ./probed)")
+    print("\t-p port   UDP/TCP port (default 60666)")
+    print("\t-s list   Comma separated session counts (default 10,100,500,1000)")
+    print("\t-i usec   Probe interval per session (default 100000)")
+    print("\t-t sec    Measurement time per step (default 10)")
+    print("\t-w sec    Warm-up time per step, results discarded (default 3)")
+    print("\t-T mode   Timestamping: userland or kernel (default userland)")
+    print("\t-N        Put the responder in a network namespace behind veth")
+    print("\t-o path   Also write the results as CSV to path")
+
+
+def run(cmd):
+    """ Run a command, raise on failure.
+    """
+
+    if subprocess.call(cmd, shell=True) != 0:
+        raise BenchError('"%s" failed' % cmd)
+
+
+def netns_setup():
+    """ Create client and responder namespaces joined by a veth pair.
+    """
+
+    netns_teardown()
+    run('ip netns add %s' % NS_CLIENT)
+    run('ip netns add %s' % NS_RESP)
+    run('ip link add slb0 netns %s type veth peer name slb1 netns %s' %
+        (NS_CLIENT, NS_RESP))
+    for ns, dev, addr in ((NS_CLIENT, 'slb0', ADDR_CLIENT),
+                          (NS_RESP, 'slb1', ADDR_RESP)):
+        run('ip -n %s addr add %s/24 dev %s' % (ns, addr, dev))
+        run('ip -n %s link set %s up' % (ns, dev))
+        run('ip -n %s link set lo up' % ns)
+
+
+def netns_teardown():
+    null = open(os.devnull, 'w')
+    for ns in (NS_CLIENT, NS_RESP):
+        subprocess.call(['ip', 'netns', 'del', ns], stderr=null)
+    null.close()
+
+
+def write_config(path, sessions, interval, addr):
+    """ Write a probed.conf with 'sessions' probes towards 'addr'.
+    """
+
+    f = open(path, 'w')
+    f.write('<config>\n')
+    for i in range(sessions):
+        f.write('\t<probe id="%d">\n' % (i + 1))
+        f.write('\t\t<address>%s</address>\n' % addr)
+        f.write('\t\t<dscp>0</dscp>\n')
+        f.write('\t\t<interval>%d</interval>\n' % interval)
+        f.write('\t\t<type>slang</type>\n')
+        f.write('\t</probe>\n')
+    f.write('</config>\n')
+    f.close()
+
+
+def group_usage(pgid):
+    """ Return (cpu seconds, RSS kB) summed over all processes in a group.
+
+        probed forks a send timer and one TCP client per responder, so
+        the whole process group is accounted for.
+    """
+
+    ticks = 0
+    rss = 0
+    for pid in os.listdir('/proc'):
+        if not pid.isdigit():
+            continue
+        try:
+            f = open('/proc/%s/stat' % pid)
+            stat = f.read()
+            f.close()
+        except IOError:
+            continue
+        # comm may contain spaces; fields restart after the last ')'
+        fields = stat[stat.rfind(')') + 2:].split()
+        if int(fields[2]) != pgid:
+            continue
+        ticks += int(fields[11]) + int(fields[12])
+        rss += int(fields[21]) * PAGE_KB
+    return (float(ticks) / CLK_TCK, rss)
+
+
+def percentile(sorted_list, p):
+    if len(sorted_list) < 1:
+        return 0
+    i = int(round(p / 100.0 * (len(sorted_list) - 1)))
+    return sorted_list[i]
+
+
+class Step:
+    """ One point on the scaling curve.
+    """
+
+    def __init__(self, probed, port, sessions, interval, tsmode, netns):
+        self.probed = probed
+        self.port = port
+        self.sessions = sessions
+        self.interval = interval
+        self.tsmode = tsmode
+        self.netns = netns
+        self.dir = tempfile.mkdtemp(prefix='probed-bench.')
+        self.procs = []
+        self.fifo = None
+        self.buf = b''
+        self.created = {}
+        self.states = {}
+        self.received = 0
+
+
+    def spawn(self, args, ns):
+        if ns is not None:
+            args = ['ip', 'netns', 'exec', ns] + args
+        null = open(os.devnull, 'w')
+        p = subprocess.Popen(args, stdout=null, stderr=null,
+            preexec_fn=os.setsid)
+        null.close()
+        self.procs.append(p)
+        return p
+
+
+    def start(self):
+        """ Start responder (if any) and daemon, then open the FIFO.
+        """
+
+        cfgpath = os.path.join(self.dir, 'probed.conf')
+        fifopath = os.path.join(self.dir, 'fifo')
+        ts = ['-k'] if self.tsmode == 'kernel' else ['-u']
+        if self.netns:
+            addr = ADDR_RESP
+            self.spawn([self.probed, '-q', '-s', '-p', self.port] + ts,
+                NS_RESP)
+            time.sleep(0.2)
+        else:
+            addr = '127.0.0.1'
+        write_config(cfgpath, self.sessions, self.interval, addr)
+        self.daemon = self.spawn([self.probed, '-q', '-p', self.port,
+            '-d', fifopath, '-f', cfgpath] + ts,
+            NS_CLIENT if self.netns else None)
+
+        # probed creates the FIFO and blocks until we open it
+        deadline = time.time() + 5
+        while not os.path.exists(fifopath):
+            if time.time() > deadline or self.daemon.poll() is not None:
+                raise BenchError('probed did not create FIFO')
+            time.sleep(0.05)
+        self.fifo = os.open(fifopath, os.O_RDONLY | os.O_NONBLOCK)
+
+
+    def stop(self):
+        for p in self.procs:
+            try:
+                os.killpg(p.pid, signal.SIGTERM)
+            except OSError:
+                pass
+            p.wait()
+        if self.fifo is not None:
+            os.close(self.fifo)
+        shutil.rmtree(self.dir, True)
+
+
+    def drain(self, until, keep):
+        """ Read records from the FIFO until the wall clock reaches 'until'.
+        """
+
+        while True:
+            left = until - time.time()
+            if left <= 0:
+                return
+            if self.daemon.poll() is not None:
+                raise BenchError('probed exited with %d' %
+                    self.daemon.returncode)
+            r, w, x = select.select([self.fifo], [], [], min(left, 0.5))
+            if len(r) == 0:
+                continue
+            try:
+                data = os.read(self.fifo, 65536)
+            except OSError as e:
+                if e.errno == errno.EAGAIN:
+                    continue
+                raise
+            if len(data) == 0:
+                time.sleep(0.01)
+                continue
+            self.buf += data
+            n = len(self.buf) // RECORD_LEN
+            if keep:
+                for i in range(n):
+                    self.record(struct.unpack_from(RECORD_FMT, self.buf,
+                        i * RECORD_LEN))
+            self.buf = self.buf[n * RECORD_LEN:]
+
+
+    def record(self, d):
+        (sid, seq, state, reserved, created, rtt) = d
+        self.received += 1
+        self.states[state] = self.states.get(state, 0) + 1
+        if state == STATE_DUP:
+            return
+        self.created.setdefault(sid, []).append((seq, created))
+
+
+    def lateness(self):
+        """ Per-PING send lateness in microseconds.
+
+            probed does not export its schedule, so the ideal send time of
+            each PING is derived from its sequence number: the earliest
+            PING of a session (relative to its seq) defines the schedule,
+            and every other PING is late by how far it lags behind it.
+        """
+
+        interval_ns = self.interval * 1000
+        late = []
+        for sid in self.created:
+            offs = [c - seq * interval_ns for (seq, c) in self.created[sid]]
+            base = min(offs)
+            late.extend([(o - base) / 1000.0 for o in offs])
+        late.sort()
+        return late
+
+
+    def measure(self, warmup, duration):
+        self.start()
+        try:
+            self.drain(time.time() + warmup, False)
+            cpu0, rss = group_usage(self.daemon.pid)
+            t0 = time.time()
+            end = t0 + duration
+            while time.time() < end:
+                self.drain(min(end, time.time() + 1), True)
+                rss = max(rss, group_usage(self.daemon.pid)[1])
+            elapsed = time.time() - t0
+            cpu1 = group_usage(self.daemon.pid)[0]
+        finally:
+            self.stop()
+
+        late = self.lateness()
+        total = max(self.received, 1)
+        pps = self.received / elapsed
+        cpu = (cpu1 - cpu0) / elapsed
+        return {
+            'sessions': self.sessions,
+            'target_pps': self.sessions * 1000000.0 / self.interval,
+            'pps': pps,
+            'late_p50': percentile(late, 50),
+            'late_p99': percentile(late, 99),
+            'late_max': late[-1] if len(late) > 0 else 0,
+            'ok': 100.0 * self.states.get(STATE_OK, 0) / total,
+            'tserr': 100.0 * self.states.get(STATE_TSERROR, 0) / total,
+            'timeout': 100.0 * (self.states.get(STATE_TIMEOUT, 0) +
+                self.states.get(STATE_PONGLOSS, 0)) / total,
+            'cpu': 100.0 * cpu,
+            'cpu_kpps': 100.0 * cpu / (pps / 1000.0) if pps > 0 else 0,
+            'rss': rss,
+        }
+
+
+COLUMNS = (
+    ('sessions', '%8d', '%8s'),
+    ('target_pps', '%10.0f', '%10s'),
+    ('pps', '%10.0f', '%10s'),
+    ('late_p50', '%9.0f', '%9s'),
+    ('late_p99', '%9.0f', '%9s'),
+    ('late_max', '%9.0f', '%9s'),
+    ('ok', '%7.2f', '%7s'),
+    ('tserr', '%7.2f', '%7s'),
+    ('timeout', '%7.2f', '%7s'),
+    ('cpu', '%7.1f', '%7s'),
+    ('cpu_kpps', '%9.2f', '%9s'),
+    ('rss', '%8d', '%8s'),
+)
+
+
+def main():
+    probed = './probed'
+    port = '60666'
+    sessions = [10, 100, 500, 1000]
+    interval = 100000
+    duration = 10
+    warmup = 3
+    tsmode = 'userland'
+    netns = False
+    csvpath = None
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'hNb:p:s:i:t:w:T:o:')
+    except getopt.GetoptError as e:
+        print(str(e))
+        usage()
+        sys.exit(2)
+    for o, a in opts:
+        if o == '-h':
+            usage()
+            sys.exit(0)
+        elif o == '-N':
+            netns = True
+        elif o == '-b':
+            probed = os.path.abspath(a)
+        elif o == '-p':
+            port = a
+        elif o == '-s':
+            sessions = [int(n) for n in a.split(',')]
+        elif o == '-i':
+            interval = int(a)
+        elif o == '-t':
+            duration = int(a)
+        elif o == '-w':
+            warmup = int(a)
+        elif o == '-T':
+            tsmode = a
+        elif o == '-o':
+            csvpath = a
+    if not os.access(probed, os.X_OK):
+        print("probed binary %s not found" % probed)
+        sys.exit(1)
+
+    print("probed %s, interval %d us, %d s per step (%d s warm-up), %s, %s" %
+        (probed, interval, duration, warmup, tsmode,
+         'veth/netns' if netns else 'loopback'))
+    print(' '.join([h % c for (c, f, h) in COLUMNS]))
+    print("%8s %10s %10s %9s %9s %9s %7s %7s %7s %7s %9s %8s" %
+        ('', 'pps', 'pps', 'us', 'us', 'us', '%', '%', '%', '%core',
+         '%/1kpps', 'kB'))
+
+    csv = open(csvpath, 'w') if csvpath is not None else None
+    if csv is not None:
+        csv.write(','.join([c for (c, f, h) in COLUMNS]) + '\n')
+    if netns:
+        netns_setup()
+    try:
+        for n in sessions:
+            res = Step(probed, port, n, interval, tsmode, netns).measure(
+                warmup, duration)
+            print(' '.join([f % res[c] for (c, f, h) in COLUMNS]))
+            sys.stdout.flush()
+            if csv is not None:
+                csv.write(','.join([str(res[c]) for (c, f, h) in COLUMNS]) +
+                    '\n')
+    finally:
+        if netns:
+            netns_teardown()
+        if csv is not None:
+            csv.close()
+
+
+class BenchError(Exception):
+    """ Exception for errors while running the benchmark.
+    """
+    pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   sim.c
+ * \brief  Deterministic simulation of the measurement engine
+ *
+ * Runs the scheduler, the result matching and the timeout wheel of
+ * client.c, unmodified, against a simulated network and responder, on
+ * a virtual clock; as fast as the engine can go, so that hours of 100k
+ * sessions take minutes, and the same seed gives the same run.
+ *
+ * The engine is cut off from the real world at link time, like the
+ * allocator of probed-micro: -Wl,--wrap makes ts_now() and
+ * ts_monotonic() read the virtual clock and dscp_set() do nothing;
+ * send_train_w_ts is pointed to the variant that sends one by one, and
+ * send_w_ts to sim_send(), which decides the fate of each PING with a seeded PRNG
+ * (loss both ways, latency, jitter, reordering, duplicates, stalled
+ * TIMEs) and queues the PONGs and TIMEs it causes as events.
+ *
+ * As the fate of a PING is known when it is sent, so is its result:
+ * what the engine should report is worked out there and then, and
+ * compared with what it did report, state by state. Any difference is
+ * a bug in the engine (or here), and makes the exit status 1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <netdb.h>
+#include "../probed.h"
+#include "../util.h"
+#include "../net.h"
+#include "../tstamp.h"
+#include "../client.h"
+
+#define SIM_START (1000 * NSEC_PER_SEC) /* virtual monotonic clock at start */
+#define SIM_EPOCH (1300000000LL * NSEC_PER_SEC) /* realtime minus monotonic */
+#define SIM_SERVICE 5000 /* T3 - T2 at the responder [ns] */
+#define SIM_PONG_COPIES 2 /* the PONG, and a duplicate */
+#define SIM_STATES (STATE_DUP + 1)
+
+struct config cfg;
+
+/* An arriving PONG or TIME; in order of 'at', then of 'order' */
+struct sim_ev {
+	ts_t at;
+	unsigned long long order;
+	num_t type;
+	num_t id;
+	num_t seq;
+	ts_t t2;
+	ts_t t3;
+};
+
+static struct {
+	/* Simulated network, see help_and_die() */
+	int sessions;
+	ts_t interval, duration, timeout;
+	ts_t latency, jitter;
+	double loss, reorder, dup, stall;
+	ts_t reorder_delay;
+	unsigned long long seed;
+
+	ts_t now; /* the virtual monotonic clock */
+	addr_t dst; /* the responder */
+	unsigned long long rand;
+	/* Event queue; a binary heap */
+	struct sim_ev *ev;
+	int ev_len, ev_size;
+	unsigned long long ev_order;
+	ts_t last_sweep; /* latest tick a result is due at */
+	/* What sim_send() expects, and what the engine reported */
+	long long expect[SIM_STATES], got[SIM_STATES];
+	long long pings, pongs_reordered, results_reordered;
+	long long rtt_n;
+	double rtt_total;
+	num_t *pong_seq, *res_seq; /* per session, highest seen */
+	unsigned long long digest;
+} sim;
+
+ts_t __wrap_ts_now(void);
+ts_t __wrap_ts_monotonic(void);
+int __wrap_dscp_set(int sock, uint8_t dscp);
+
+ts_t __wrap_ts_now(void) {
+	return sim.now + SIM_EPOCH;
+}
+ts_t __wrap_ts_monotonic(void) {
+	return sim.now;
+}
+int __wrap_dscp_set(/*@unused@*/ int sock, /*@unused@*/ uint8_t dscp) {
+	return 0;
+}
+static void help_and_die(void) {
+	fprintf(stderr, "Deterministic simulation of the probed engine\n\n");
+	fprintf(stderr, "probed-sim [-n sessions] [-i interval] [-d duration] [-t timeout]\n");
+	fprintf(stderr, "           [-l latency] [-j jitter] [-L loss] [-r reorder] [-R delay]\n");
+	fprintf(stderr, "           [-D dup] [-T stall] [-s seed]\n\n");
+	fprintf(stderr, "    -n   Measurement sessions, default 1000\n");
+	fprintf(stderr, "    -i   PING interval per session [ms], default 1000\n");
+	fprintf(stderr, "    -d   Simulated time to send PINGs [s], default 60\n");
+	fprintf(stderr, "    -t   Probe timeout [ms], default %d000\n", TIMEOUT);
+	fprintf(stderr, "    -l   One-way latency [ms], default 10\n");
+	fprintf(stderr, "    -j   Jitter, added to the latency [ms], default 1\n");
+	fprintf(stderr, "    -L   Loss of PINGs and of PONGs, each way [%%], default 1\n");
+	fprintf(stderr, "    -r   PONGs held up by the reorder delay [%%], default 1\n");
+	fprintf(stderr, "    -R   Reorder delay [ms], default 2 intervals\n");
+	fprintf(stderr, "    -D   PONGs duplicated [%%], default 0.1\n");
+	fprintf(stderr, "    -T   TIMEs held up past the timeout, as by a stalled TCP\n");
+	fprintf(stderr, "         connection [%%], default 0.1\n");
+	fprintf(stderr, "    -s   Seed, default 1\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * xorshift64*; the same seed, the same network
+ */
+static unsigned long long sim_rand(void) {
+	sim.rand ^= sim.rand >> 12;
+	sim.rand ^= sim.rand << 25;
+	sim.rand ^= sim.rand >> 27;
+	return sim.rand * 2685821657736338717ULL;
+}
+
+/**
+ * True with probability 'pct' percent
+ */
+static int sim_chance(double pct) {
+	return (double)(sim_rand() >> 11) / 9007199254740992.0 * 100 < pct;
+}
+
+/**
+ * One-way delay of a packet
+ */
+static ts_t sim_owd(void) {
+	if (sim.jitter < 1)
+		return sim.latency;
+	return sim.latency + (ts_t)(sim_rand() % (unsigned long long)sim.jitter);
+}
+
+static int sim_ev_before(struct sim_ev *a, struct sim_ev *b) {
+	return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+/**
+ * Queue an event, arriving at 'at'; returns its place in the order of
+ * events, for sim_send()
+ */
+static struct sim_ev *sim_ev_push(ts_t at, num_t type, data_t *d, ts_t t2,
+		ts_t t3) {
+	struct sim_ev *ev, tmp;
+	int i;
+
+	if (sim.ev_len == sim.ev_size) {
+		sim.ev_size = sim.ev_size > 0 ? sim.ev_size * 2 : 1024;
+		sim.ev = realloc(sim.ev, sizeof *sim.ev * (size_t)sim.ev_size);
+		if (sim.ev == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	i = sim.ev_len++;
+	ev = &sim.ev[i];
+	ev->at = at;
+	ev->order = sim.ev_order++;
+	ev->type = type;
+	ev->id = d->id;
+	ev->seq = d->seq;
+	ev->t2 = t2;
+	ev->t3 = t3;
+	tmp = *ev;
+	while (i > 0 && sim_ev_before(&tmp, &sim.ev[(i - 1) / 2])) {
+		sim.ev[i] = sim.ev[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sim.ev[i] = tmp;
+	return &sim.ev[i];
+}
+
+static void sim_ev_pop(void) {
+	struct sim_ev tmp;
+	int i = 0, c;
+
+	tmp = sim.ev[--sim.ev_len];
+	while ((c = 2 * i + 1) < sim.ev_len) {
+		if (c + 1 < sim.ev_len && sim_ev_before(&sim.ev[c + 1], &sim.ev[c]))
+			c++;
+		if (!sim_ev_before(&sim.ev[c], &tmp))
+			break;
+		sim.ev[i] = sim.ev[c];
+		i = c;
+	}
+	sim.ev[i] = tmp;
+}
+
+/**
+ * Send a PING into the simulated network, with T1 from the virtual
+ * clock; the send_w_ts of the engine
+ *
+ * The PING may be lost, or reach the responder after a one-way delay;
+ * if so, the responder answers with a PONG, which may be lost, held up
+ * or duplicated, and a TIME, which always arrives, but may be stalled.
+ * The result the engine should report is worked out from the arrivals
+ * here: SUCCESS if both the PONG and the TIME arrive by the tick that
+ * sweeps the probe away (client_res_clear_timeouts()), or else what it
+ * has by then; and a DUP for each PONG that arrives after that.
+ */
+static int sim_send(/*@unused@*/ int sock, /*@unused@*/ addr_t *addr,
+		char *data, ts_t *ts) {
+	struct {
+		ts_t at;
+		unsigned long long order;
+	} pong[SIM_PONG_COPIES], first, time, done;
+	data_t *d = (data_t *)data;
+	struct sim_ev *ev;
+	ts_t sweep, t2, t3;
+	int i, n_pong = 0, state;
+
+	*ts = __wrap_ts_now();
+	sim.pings++;
+	/* The tick the probe is swept away at, if not done by then */
+	sweep = (sim.now + sim.timeout + TIMEOUT_INTERVAL - 1) / TIMEOUT_INTERVAL *
+		TIMEOUT_INTERVAL;
+	sim.last_sweep = MAX(sim.last_sweep, sweep);
+	if (sim_chance(sim.loss)) {
+		sim.expect[STATE_TIMEOUT]++;
+		return 0;
+	}
+	t2 = sim.now + sim_owd();
+	t3 = t2 + SIM_SERVICE;
+	for (i = 0; i < SIM_PONG_COPIES; i++) {
+		if (i > 0 && !sim_chance(sim.dup))
+			break;
+		if (sim_chance(sim.loss))
+			continue;
+		ev = sim_ev_push(t3 + sim_owd() + (sim_chance(sim.reorder) ?
+				sim.reorder_delay : 0), TYPE_PONG, d, t2 + SIM_EPOCH,
+				t3 + SIM_EPOCH);
+		pong[n_pong].at = ev->at;
+		pong[n_pong].order = ev->order;
+		n_pong++;
+	}
+	ev = sim_ev_push(t3 + sim_owd() + (sim_chance(sim.stall) ?
+			sim.timeout + TIMEOUT_INTERVAL : 0), TYPE_TIME, d,
+			t2 + SIM_EPOCH, t3 + SIM_EPOCH);
+	time.at = ev->at;
+	time.order = ev->order;
+
+	/* The first PONG, and the event that completes the probe */
+	first = time;
+	for (i = 0; i < n_pong; i++)
+		if (i == 0 || pong[i].at < first.at)
+			first = pong[i];
+	done = time;
+	if (n_pong > 0 && (first.at > time.at ||
+				(first.at == time.at && first.order > time.order)))
+		done = first;
+	if (n_pong > 0 && done.at <= sweep) {
+		state = STATE_SUCCESS;
+	} else {
+		/* Events due at the tick are delivered before the sweep */
+		done.at = sweep;
+		done.order = ~0ULL;
+		if (time.at <= sweep)
+			state = STATE_PONGLOSS;
+		else if (n_pong > 0 && first.at <= sweep)
+			state = STATE_TS_ERR;
+		else
+			state = STATE_TIMEOUT;
+	}
+	sim.expect[state]++;
+	for (i = 0; i < n_pong; i++)
+		if (pong[i].at > done.at ||
+				(pong[i].at == done.at && pong[i].order > done.order))
+			sim.expect[STATE_DUP]++;
+	return 0;
+}
+
+/**
+ * Deliver an event to the engine, as the main loop would
+ */
+static void sim_deliver(struct sim_ev *ev) {
+	data_t d;
+	ts_t t4;
+
+	memset(&d, 0, sizeof d);
+	d.type = ev->type;
+	d.id = ev->id;
+	d.seq = ev->seq;
+	d.version = DATA_VERSION;
+	d.t2 = ev->t2;
+	d.t3 = ev->t3;
+	if (ev->type == TYPE_PONG) {
+		if (ev->seq < sim.pong_seq[ev->id])
+			sim.pongs_reordered++;
+		sim.pong_seq[ev->id] = MAX(sim.pong_seq[ev->id], ev->seq);
+		t4 = ev->at + SIM_EPOCH;
+		client_res_update(&sim.dst, &d, &t4, 0);
+	} else
+		client_res_update(&sim.dst, &d, NULL, -1);
+}
+
+/**
+ * Result callback; counts, and folds the result into the digest of
+ * the run
+ */
+static void sim_result(struct res_fifo *r, /*@unused@*/ void *arg) {
+	unsigned char *p = (unsigned char *)r;
+	size_t i;
+
+	if (r->state < SIM_STATES)
+		sim.got[r->state]++;
+	if (r->state == STATE_SUCCESS) {
+		if (r->seq < sim.res_seq[r->id])
+			sim.results_reordered++;
+		sim.res_seq[r->id] = MAX(sim.res_seq[r->id], r->seq);
+		sim.rtt_total += (double)r->rtt;
+		sim.rtt_n++;
+	}
+	/* FNV-1a */
+	for (i = 0; i < sizeof *r; i++) {
+		sim.digest ^= p[i];
+		sim.digest *= 1099511628211ULL;
+	}
+}
+
+static ts_t sim_ms(char *arg) {
+	double ms;
+	char *end;
+
+	ms = strtod(arg, &end);
+	if (*end != '\0' || ms < 0)
+		help_and_die();
+	return (ts_t)(ms * 1000000);
+}
+
+static double sim_pct(char *arg) {
+	double pct;
+	char *end;
+
+	pct = strtod(arg, &end);
+	if (*end != '\0' || pct < 0 || pct > 100)
+		help_and_die();
+	return pct;
+}
+
+int main(int argc, char *argv[]) {
+	static const char *names[SIM_STATES] = { "", "success", "dscp error",
+		"timestamp error", "pong loss", "timeout", "dup" };
+	struct addrinfo hints, *res;
+	struct timespec w0, w1;
+	struct sim_ev ev;
+	ts_t end, tick, next, t;
+	double wall;
+	int arg, i, fail = 0;
+	num_t id;
+
+	sim.sessions = 1000;
+	sim.interval = NSEC_PER_SEC;
+	sim.duration = 60 * NSEC_PER_SEC;
+	sim.timeout = (ts_t)TIMEOUT * NSEC_PER_SEC;
+	sim.latency = 10000000;
+	sim.jitter = 1000000;
+	sim.loss = 1;
+	sim.reorder = 1;
+	sim.reorder_delay = -1;
+	sim.dup = 0.1;
+	sim.stall = 0.1;
+	sim.seed = 1;
+	while ((arg = getopt(argc, argv, "hn:i:d:t:l:j:L:r:R:D:T:s:")) != EOF) {
+		switch (arg) {
+			case 'n':
+				sim.sessions = atoi(optarg);
+				break;
+			case 'i':
+				sim.interval = sim_ms(optarg);
+				break;
+			case 'd':
+				sim.duration = sim_ms(optarg) * 1000;
+				break;
+			case 't':
+				sim.timeout = sim_ms(optarg);
+				break;
+			case 'l':
+				sim.latency = sim_ms(optarg);
+				break;
+			case 'j':
+				sim.jitter = sim_ms(optarg);
+				break;
+			case 'L':
+				sim.loss = sim_pct(optarg);
+				break;
+			case 'r':
+				sim.reorder = sim_pct(optarg);
+				break;
+			case 'R':
+				sim.reorder_delay = sim_ms(optarg);
+				break;
+			case 'D':
+				sim.dup = sim_pct(optarg);
+				break;
+			case 'T':
+				sim.stall = sim_pct(optarg);
+				break;
+			case 's':
+				sim.seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				help_and_die();
+		}
+	}
+	if (sim.sessions < 1 || sim.interval < 1 || sim.timeout < 1)
+		help_and_die();
+	if (sim.reorder_delay < 0)
+		sim.reorder_delay = 2 * sim.interval;
+	/* xorshift never leaves 0 */
+	sim.rand = sim.seed != 0 ? sim.seed : 0x9e3779b97f4a7c15ULL;
+	sim.digest = 14695981039346656037ULL;
+	sim.pong_seq = calloc((size_t)sim.sessions + 1, sizeof *sim.pong_seq);
+	sim.res_seq = calloc((size_t)sim.sessions + 1, sizeof *sim.res_seq);
+	if (sim.pong_seq == NULL || sim.res_seq == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&cfg, 0, sizeof cfg);
+	openlog("probed-sim", LOG_PERROR, LOG_USER);
+	(void)setlogmask(LOG_UPTO(LOG_CRIT));
+	cfg.op = DAEMON;
+	cfg.ts = USERLAND;
+	cfg.ring = -1;
+	cfg.uring = -1;
+	cfg.handoff = -1;
+	cfg.bulk = -1;
+	cfg.fifo = open("/dev/null", O_WRONLY);
+	sim.now = SIM_START;
+	client_init();
+	tstamp_backend_select();
+	send_w_ts = sim_send;
+	send_train_w_ts = send_train_w_ts_each;
+	client_res_sink(sim_result, NULL);
+
+	/* One responder for all; client_msess_gothello() is O(sessions) */
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = (AI_V4MAPPED | AI_NUMERICHOST);
+	if (getaddrinfo("10.0.0.2", "60666", &hints, &res) != 0) {
+		fprintf(stderr, "getaddrinfo failed\n");
+		return EXIT_FAILURE;
+	}
+	memcpy(&sim.dst, res->ai_addr, sizeof sim.dst);
+	freeaddrinfo(res);
+	/* Spread evenly over the interval, as client_msess_load() does; the
+	 * first deadline is the virtual time of the add */
+	for (i = 0; i < sim.sessions; i++) {
+		id = (num_t)i + 1;
+		sim.now = SIM_START + sim.interval * i / sim.sessions;
+		if (client_msess_add("60666", "10.0.0.2", 0, sim.interval, id) < 0 ||
+				client_msess_modify(id, 0, sim.interval, sim.timeout) < 0) {
+			fprintf(stderr, "Unable to add session %d\n", (int)id);
+			return EXIT_FAILURE;
+		}
+	}
+	sim.now = SIM_START;
+	(void)client_msess_gothello(&sim.dst);
+
+	/* Events, then timeouts, then PINGs; until the last result is in */
+	(void)clock_gettime(CLOCK_MONOTONIC, &w0);
+	end = SIM_START + sim.duration;
+	tick = (SIM_START / TIMEOUT_INTERVAL + 1) * TIMEOUT_INTERVAL;
+	while (sim.ev_len > 0 || tick <= sim.last_sweep || sim.now < end) {
+		t = tick;
+		if (sim.ev_len > 0)
+			t = MIN(t, sim.ev[0].at);
+		next = client_msess_next();
+		if (sim.now < end && next >= 0)
+			t = MIN(t, MAX(next, sim.now));
+		sim.now = t;
+		while (sim.ev_len > 0 && sim.ev[0].at <= sim.now) {
+			ev = sim.ev[0];
+			sim_ev_pop();
+			sim_deliver(&ev);
+		}
+		if (sim.now == tick) {
+			client_res_clear_timeouts();
+			tick += TIMEOUT_INTERVAL;
+		}
+		if (sim.now < end)
+			client_msess_transmit(0, sim.now);
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &w1);
+	wall = (double)(w1.tv_sec - w0.tv_sec) +
+		(double)(w1.tv_nsec - w0.tv_nsec) / 1e9;
+
+	printf("%d sessions, %lld PINGs, %.1f s simulated in %.3f s: %.0fx, "
+			"%.0f PINGs/s\n", sim.sessions, sim.pings,
+			(double)(sim.now - SIM_START) / NSEC_PER_SEC, wall,
+			(double)(sim.now - SIM_START) / NSEC_PER_SEC / wall,
+			(double)sim.pings / wall);
+	printf("%-20s %12s %12s\n", "result", "expected", "engine");
+	for (i = 1; i < SIM_STATES; i++) {
+		printf("%-20s %12lld %12lld%s\n", names[i], sim.expect[i], sim.got[i],
+				sim.expect[i] != sim.got[i] ? "  MISMATCH" : "");
+		if (sim.expect[i] != sim.got[i])
+			fail = 1;
+	}
+	printf("reordered: %lld PONGs, %lld results\n", sim.pongs_reordered,
+			sim.results_reordered);
+	printf("avg rtt: %.0f ns\n", sim.rtt_n > 0 ?
+			sim.rtt_total / (double)sim.rtt_n : 0.0);
+	printf("digest: %016llx (seed %llu)\n", sim.digest, sim.seed);
+	return fail == 1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   bulk.c
+ * \brief  Throughput streams; a GSO sender, and a GRO sink for the server
+ *
+ * PINGs are DATALEN bytes and sent one system call each, which measures
+ * delay, not capacity. A throughput stream is a train of datagrams of
+ * up to the path MTU, sent as fast as possible or at a fixed rate, and
+ * counted by a sink at the other end: received, bytes and reordered.
+ *
+ * The sender builds its datagrams in a template allocated once, and
+ * only writes the header (stream ID and a 64 bit sequence number) of
+ * each before sending. With UDP_SEGMENT (GSO), up to BULK_SEGS equal
+ * datagrams go to the kernel as one buffer, and BULK_VLEN buffers per
+ * sendmmsg(), so a single core can fill the link. The sink receives
+ * with UDP_GRO, so that the kernel hands it trains of datagrams in one
+ * buffer, too, and splits them again by the segment size it is given.
+ *
+ * Streams use their own UDP socket, on the port after the PING port
+ * (BULK_PORT_OFFSET), so that GRO and the large buffers never touch
+ * the timestamped PING socket. When the sender stops, it asks for the
+ * counters of the sink with TYPE_BULK_END, and prints a summary.
+ *
+ * The sink is open to anyone, so it keeps at most BULK_STREAMS streams,
+ * in a hash; datagrams of new streams beyond that are dropped. Only
+ * TYPE_BULK datagrams start a stream, and TYPE_BULK_END is answered for
+ * known streams only, and only if the request is as large as the
+ * answer, so the sink cannot be used to amplify traffic.
+ */
+
+#define _GNU_SOURCE /* sendmmsg(), recvmmsg() */
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include "probed.h"
+#include "util.h"
+#include "net.h"
+#include "log.h"
+#include "bulk.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* GSO (or GRO) buffers per sendmmsg()/recvmmsg() */
+#define BULK_VLEN 8
+/* Datagrams per GSO buffer; the kernel allows at most 64 */
+#define BULK_SEGS 64
+/* Largest UDP payload, and so GSO/GRO buffer */
+#define BULK_BUFLEN 65507
+/* recvmmsg() calls per wake-up of the sink, before serving PINGs again */
+#define BULK_RX_BUDGET 16
+/* Streams idle this long are forgotten by the sink [nanoseconds] */
+#define BULK_IDLE 60000000000LL
+/* Streams the sink keeps at most, and its hash buckets; a power of two */
+#define BULK_STREAMS 1024
+#define BULK_HASH 256
+/* Requests for the counters of the sink, and the wait for each [ms] */
+#define BULK_END_TRIES 5
+#define BULK_END_WAIT 400
+
+/* Header of every datagram of a stream; the rest is the template */
+struct bulk_hdr {
+	num_t type; /* TYPE_BULK, or TYPE_BULK_END */
+	num_t id; /* Stream ID, random */
+	uint64_t seq;
+};
+/* The answer of the sink to TYPE_BULK_END, DATALEN bytes */
+struct bulk_report {
+	num_t type; /* TYPE_BULK_END */
+	num_t id;
+	uint64_t recv; /* Datagrams */
+	uint64_t bytes; /* UDP payload */
+	uint64_t reorder; /* Datagrams that arrived after a higher seq */
+	uint64_t expect; /* Highest seq received, plus one */
+	uint64_t pad;
+};
+/* TYPE_BULK_END, padded to the size of the answer */
+struct bulk_req {
+	struct bulk_hdr h;
+	char pad[sizeof (struct bulk_report) - sizeof (struct bulk_hdr)];
+};
+
+/* A stream, as seen by the sink */
+struct bulk_stream {
+	addr_t addr;
+	num_t id;
+	uint64_t recv, bytes, reorder, expect;
+	ts_t last; /* Last datagram, monotonic */
+	LIST_ENTRY(bulk_stream) list;
+};
+static LIST_HEAD(bulk_stream_listhead, bulk_stream) streams[BULK_HASH];
+static int n_streams = 0;
+static unsigned long bulk_refused = 0; /* Datagrams of streams too many */
+
+static volatile sig_atomic_t bulk_stop = 0;
+
+static int bulk_port(char *port, /*@out@*/ char *buf);
+static int bulk_mtu(int sock, addr_t *dst);
+static void bulk_account(int sock, addr_t *addr, char *buf, int len);
+static unsigned int bulk_hash(num_t id, addr_t *addr);
+static int bulk_report(int sock, num_t id, /*@out@*/ struct bulk_report *rep);
+static void bulk_sigint(/*@unused@*/ int sig);
+
+/**
+ * Open the throughput sink, for server and daemon mode
+ *
+ * Binds a UDP socket to the port after 'port', with UDP_GRO if the
+ * kernel has it. Read it with bulk_sink() when it is readable.
+ *
+ * \param[in] port The PING port
+ * \return         The sink socket, or -1 on error
+ */
+int bulk_sink_open(char *port) {
+	struct addrinfo hints, *res;
+	char bport[NI_MAXSERV];
+	int s, f, ret;
+
+	if (bulk_port(port, bport) < 0)
+		return -1;
+	for (f = 0; f < BULK_HASH; f++)
+		LIST_INIT(&streams[f]);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = (AI_V4MAPPED | AI_PASSIVE);
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(NULL, bport, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "bulk: %s", gai_strerror(ret));
+		return -1;
+	}
+	s = socket(PF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			IPPROTO_UDP);
+	if (s < 0) {
+		syslog(LOG_ERR, "bulk: socket: %s", strerror(errno));
+		freeaddrinfo(res);
+		return -1;
+	}
+	f = 0;
+	(void)setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &f, sizeof f);
+	/* A successor (see handoff.c) binds before we have exited */
+	f = 1;
+	(void)setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &f, sizeof f);
+	if (bind(s, res->ai_addr, res->ai_addrlen) < 0) {
+		syslog(LOG_ERR, "bulk: bind: %s", strerror(errno));
+		freeaddrinfo(res);
+		(void)close(s);
+		return -1;
+	}
+	freeaddrinfo(res);
+	if (setsockopt(s, IPPROTO_UDP, UDP_GRO, &f, sizeof f) < 0)
+		syslog(LOG_INFO, "bulk: No UDP_GRO; one datagram per receive");
+	/* Line rate of MTU sized datagrams is about a million per second */
+	sockbuf_size(s, 1000000);
+	syslog(LOG_INFO, "Throughput sink on UDP port %s", bport);
+	return s;
+}
+
+/**
+ * Read what the sink socket 's' has, and count it per stream
+ *
+ * At most BULK_RX_BUDGET batches are read per call, so that a stream
+ * at line rate does not starve the PING socket.
+ *
+ * \param[in] s The socket from bulk_sink_open()
+ */
+void bulk_sink(int s) {
+	static char *bufs = NULL;
+	static ts_t last_sweep = 0;
+	struct mmsghdr msgs[BULK_VLEN];
+	struct iovec iov[BULK_VLEN];
+	addr_t addrs[BULK_VLEN];
+	char ctrl[BULK_VLEN][CMSG_SPACE(sizeof (int))];
+	struct cmsghdr *cmsg;
+	struct bulk_stream *st, *st_tmp;
+	ts_t now;
+	int i, n, b, seg, off;
+
+	if (bufs == NULL) {
+		bufs = malloc((size_t)BULK_VLEN * BULK_BUFLEN);
+		if (bufs == NULL) {
+			syslog(LOG_ERR, "bulk: malloc: %s", strerror(errno));
+			return;
+		}
+	}
+	for (b = 0; b < BULK_RX_BUDGET; b++) {
+		memset(msgs, 0, sizeof msgs);
+		for (i = 0; i < BULK_VLEN; i++) {
+			iov[i].iov_base = bufs + (size_t)i * BULK_BUFLEN;
+			iov[i].iov_len = BULK_BUFLEN;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof ctrl[i];
+		}
+		n = recvmmsg(s, msgs, BULK_VLEN, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n; i++) {
+			/* GRO; equal datagrams of 'seg' bytes, the last maybe less */
+			seg = (int)msgs[i].msg_len;
+			for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+					cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+				if (cmsg->cmsg_level == IPPROTO_UDP &&
+						cmsg->cmsg_type == UDP_GRO)
+					memcpy(&seg, CMSG_DATA(cmsg), sizeof seg);
+			if (seg <= 0)
+				continue;
+			for (off = 0; off < (int)msgs[i].msg_len; off += seg)
+				bulk_account(s, &addrs[i], (char *)iov[i].iov_base + off,
+						MIN(seg, (int)msgs[i].msg_len - off));
+		}
+		if (n < BULK_VLEN)
+			break;
+	}
+	/* Forget streams that went away without asking for their counters;
+	 * once a second is enough */
+	now = ts_monotonic();
+	if (now - last_sweep < NSEC_PER_SEC)
+		return;
+	last_sweep = now;
+	for (i = 0; i < BULK_HASH; i++) {
+		for (st = streams[i].lh_first; st != NULL; st = st_tmp) {
+			st_tmp = st->list.le_next;
+			if (now - st->last > BULK_IDLE) {
+				LIST_REMOVE(st, list);
+				free(st);
+				n_streams--;
+			}
+		}
+	}
+}
+
+/**
+ * Count one datagram from 'addr' in its stream, or answer a request
+ * for the counters of the stream
+ */
+static void bulk_account(int sock, addr_t *addr, char *buf, int len) {
+	struct bulk_hdr h;
+	struct bulk_report rep;
+	struct bulk_stream *st;
+	unsigned int b;
+
+	if (len < (int)sizeof h)
+		return;
+	memcpy(&h, buf, sizeof h);
+	if (h.type != TYPE_BULK && h.type != TYPE_BULK_END)
+		return;
+	b = bulk_hash(h.id, addr);
+	for (st = streams[b].lh_first; st != NULL; st = st->list.le_next)
+		if (st->id == h.id && st->addr.sin6_port == addr->sin6_port &&
+				memcmp(&st->addr.sin6_addr, &addr->sin6_addr,
+					sizeof st->addr.sin6_addr) == 0)
+			break;
+	/* Only data starts a stream; no counters for strangers */
+	if (st == NULL && h.type == TYPE_BULK_END)
+		return;
+	if (st == NULL) {
+		if (n_streams >= BULK_STREAMS) {
+			bulk_refused++;
+			log_msg(LOGT_SOCK, LOG_INFO, "bulk: %d streams already; %lu "
+					"datagrams of new ones dropped", n_streams, bulk_refused);
+			return;
+		}
+		st = malloc(sizeof *st);
+		if (st == NULL)
+			return;
+		memset(st, 0, sizeof *st);
+		memcpy(&st->addr, addr, sizeof st->addr);
+		st->id = h.id;
+		LIST_INSERT_HEAD(&streams[b], st, list);
+		n_streams++;
+	}
+	st->last = ts_monotonic();
+	if (h.type == TYPE_BULK_END) {
+		/* Not larger than the request */
+		if (len < (int)sizeof rep)
+			return;
+		memset(&rep, 0, sizeof rep);
+		rep.type = TYPE_BULK_END;
+		rep.id = st->id;
+		rep.recv = st->recv;
+		rep.bytes = st->bytes;
+		rep.reorder = st->reorder;
+		rep.expect = st->expect;
+		(void)sendto(sock, &rep, sizeof rep, 0, (struct sockaddr *)addr,
+				sizeof *addr);
+		return;
+	}
+	st->recv++;
+	st->bytes += (uint64_t)len;
+	if (h.seq < st->expect)
+		st->reorder++;
+	else
+		st->expect = h.seq + 1;
+}
+
+/**
+ * Hash bucket of stream 'id' from 'addr'
+ */
+static unsigned int bulk_hash(num_t id, addr_t *addr) {
+	uint32_t h, w;
+	int i;
+
+	h = (uint32_t)id ^ addr->sin6_port;
+	for (i = 0; i < 4; i++) {
+		memcpy(&w, &addr->sin6_addr.s6_addr[i * 4], sizeof w);
+		h = (h ^ w) * 2654435761U;
+	}
+	return (h >> 16) & (BULK_HASH - 1);
+}
+
+/**
+ * Send a throughput stream to 'addr', until Ctrl-C, and print the
+ * rate every second and the counters of the sink at the end
+ *
+ * \param[in] addr Host name or address of a server or daemon started
+ *                 with the sink enabled
+ * \param[in] port The PING port; the stream uses the one after it
+ * \param[in] size UDP payload per datagram, or 0 for the path MTU
+ * \param[in] pps  Datagrams per second, or 0 for as fast as possible
+ */
+void bulk_or_die(char *addr, char *port, int size, long pps) {
+	struct addrinfo hints, *res;
+	struct mmsghdr msgs[BULK_VLEN * BULK_SEGS];
+	struct iovec iov[BULK_VLEN * BULK_SEGS];
+	struct bulk_hdr h;
+	struct bulk_report rep;
+	struct timespec ts;
+	addr_t dst;
+	char bport[NI_MAXSERV], *tmpl;
+	uint64_t seq = 0, sec_seq = 0;
+	ts_t start, now, next_report, t;
+	long due;
+	int s, ret, max, segs, gso, n, nmsg, i, j, sent;
+	num_t id;
+
+	if (bulk_port(port, bport) < 0)
+		exit(EXIT_FAILURE);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = AI_V4MAPPED;
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(addr, bport, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "Unable to look up hostname %s: %s", addr,
+				gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&dst, res->ai_addr, sizeof dst);
+	freeaddrinfo(res);
+	s = socket(PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (s < 0 || connect(s, (struct sockaddr *)&dst, sizeof dst) < 0) {
+		syslog(LOG_ERR, "bulk: %s: %s", addr, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* Datagram size; at least a header, at most the path MTU */
+	max = bulk_mtu(s, &dst);
+	if (size <= 0 || size > max) {
+		if (size > max)
+			syslog(LOG_INFO, "bulk: %d bytes exceeds the MTU; using %d",
+					size, max);
+		size = max;
+	}
+	size = MAX(size, DATALEN);
+	segs = MIN(BULK_SEGS, BULK_BUFLEN / size);
+	gso = size;
+	if (setsockopt(s, IPPROTO_UDP, UDP_SEGMENT, &gso, sizeof gso) < 0) {
+		syslog(LOG_INFO, "bulk: No UDP_SEGMENT; one datagram per message");
+		gso = 0;
+	}
+	sockbuf_size(s, pps > 0 ? pps : 1000000);
+	/* The template; every datagram of a batch, back to back */
+	tmpl = malloc((size_t)BULK_VLEN * segs * size);
+	if (tmpl == NULL) {
+		syslog(LOG_ERR, "bulk: malloc: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < BULK_VLEN * segs * size; i++)
+		tmpl[i] = (char)(i % size);
+	memset(msgs, 0, sizeof msgs);
+	srandom((unsigned int)(getpid() ^ ts_monotonic()));
+	id = (num_t)random();
+	syslog(LOG_INFO, "Throughput to %s port %s: %d byte datagrams, %d per "
+			"send%s", addr, bport, size, gso > 0 ? segs : 1,
+			gso > 0 ? " (GSO)" : "");
+
+	(void)signal(SIGINT, bulk_sigint);
+	start = ts_monotonic();
+	next_report = start + NSEC_PER_SEC;
+	while (bulk_stop == 0) {
+		now = ts_monotonic();
+		if (now >= next_report) {
+			t = now - start;
+			printf("%4lld s: sent %8llu, %9.2f Mbit/s\n",
+					(long long)(t / NSEC_PER_SEC),
+					(unsigned long long)(seq - sec_seq),
+					(double)(seq - sec_seq) * size * 8 / 1e6);
+			(void)fflush(stdout);
+			sec_seq = seq;
+			next_report += NSEC_PER_SEC;
+		}
+		/* Datagrams due; wait for the next one, if none is */
+		due = BULK_VLEN * segs;
+		if (pps > 0) {
+			due = MIN(due, (long)((double)(now - start) * pps /
+					NSEC_PER_SEC - (double)seq));
+			if (due <= 0) {
+				t = start + (ts_t)(seq + 1) * NSEC_PER_SEC / pps;
+				t = MIN(t, next_report);
+				ts.tv_sec = (time_t)(t / NSEC_PER_SEC);
+				ts.tv_nsec = (long)(t % NSEC_PER_SEC);
+				(void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+						NULL);
+				continue;
+			}
+		}
+		/* Headers; the payload is already there. With an odd 'size',
+		 * they are not aligned */
+		h.type = TYPE_BULK;
+		h.id = id;
+		for (j = 0; j < (int)due; j++) {
+			h.seq = seq + (uint64_t)j;
+			memcpy(tmpl + (size_t)j * size, &h, sizeof h);
+		}
+		/* With GSO, 'segs' datagrams per message, the last one short */
+		n = gso > 0 ? segs : 1;
+		nmsg = ((int)due + n - 1) / n;
+		for (i = 0; i < nmsg; i++) {
+			iov[i].iov_base = tmpl + (size_t)i * n * size;
+			iov[i].iov_len = (size_t)MIN(n, (int)due - i * n) * size;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		ret = sendmmsg(s, msgs, (unsigned int)nmsg, 0);
+		if (ret < 0) {
+			if (errno != EINTR && errno != ENOBUFS && errno != EAGAIN &&
+					errno != ECONNREFUSED)
+				syslog(LOG_ERR, "bulk: sendmmsg: %s", strerror(errno));
+			continue;
+		}
+		/* What was not sent gets its sequence numbers again */
+		for (i = 0, sent = 0; i < ret; i++)
+			sent += (int)(msgs[i].msg_len / size);
+		seq += (uint64_t)sent;
+	}
+	t = ts_monotonic() - start;
+
+	/* Summary, with the counters of the sink */
+	printf("\n%llu datagrams of %d bytes sent in %.3f s, %.2f Mbit/s\n",
+			(unsigned long long)seq, size, (double)t / NSEC_PER_SEC,
+			t > 0 ? (double)seq * size * 8 * 1000 / (double)t : 0.0);
+	if (bulk_report(s, id, &rep) < 0) {
+		printf("No counters from the sink; is it started with -g?\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("%llu received, %llu lost (%.4f%%), %llu reordered, "
+			"%.2f Mbit/s received\n", (unsigned long long)rep.recv,
+			(unsigned long long)(seq > rep.recv ? seq - rep.recv : 0),
+			seq > rep.recv ? 100.0 * (double)(seq - rep.recv) / (double)seq :
+			0.0, (unsigned long long)rep.reorder,
+			t > 0 ? (double)rep.bytes * 8 * 1000 / (double)t : 0.0);
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Ask the sink for the counters of stream 'id'
+ *
+ * \return 0 on success, -1 if it did not answer
+ */
+static int bulk_report(int sock, num_t id, struct bulk_report *rep) {
+	struct bulk_req req;
+	struct pollfd pfd;
+	int i;
+
+	/* As large as the answer, or the sink does not answer */
+	memset(&req, 0, sizeof req);
+	req.h.type = TYPE_BULK_END;
+	req.h.id = id;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	for (i = 0; i < BULK_END_TRIES; i++) {
+		if (send(sock, &req, sizeof req, 0) < 0)
+			continue;
+		while (poll(&pfd, 1, BULK_END_WAIT) > 0) {
+			if (recv(sock, rep, sizeof *rep, 0) != (ssize_t)sizeof *rep)
+				break;
+			if (rep->type == TYPE_BULK_END && rep->id == id)
+				return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * The largest payload for a datagram to 'dst' that is not fragmented
+ */
+static int bulk_mtu(int sock, addr_t *dst) {
+	socklen_t slen;
+	int mtu, v4;
+
+	v4 = IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr);
+	slen = (socklen_t)sizeof mtu;
+	if (getsockopt(sock, v4 ? IPPROTO_IP : IPPROTO_IPV6,
+				v4 ? IP_MTU : IPV6_MTU, &mtu, &slen) < 0)
+		mtu = 1500;
+	/* IP and UDP headers */
+	return mtu - (v4 ? 20 : 40) - 8;
+}
+
+/**
+ * The port of the throughput streams, BULK_PORT_OFFSET after 'port'
+ */
+static int bulk_port(char *port, char *buf) {
+	int p;
+
+	p = atoi(port);
+	if (p <= 0 || p + BULK_PORT_OFFSET > 65535) {
+		syslog(LOG_ERR, "bulk: Invalid port %s", port);
+		return -1;
+	}
+	(void)snprintf(buf, NI_MAXSERV, "%d", p + BULK_PORT_OFFSET);
+	return 0;
+}
+
+static void bulk_sigint(int sig) {
+	bulk_stop = 1;
+}
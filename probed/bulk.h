@@ -0,0 +1,10 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+int bulk_sink_open(char *port);
+void bulk_sink(int s);
+void bulk_or_die(char *addr, char *port, int size, long pps);
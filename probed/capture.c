@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   capture.c
+ * \brief  Rotating mmap'd capture of the results, for offline replay
+ *
+ * Every result given to the FIFO (or the result callback) is also
+ * copied into a capture file, with the time it was delivered, so that
+ * the manager can be fed the same stream again later; with the same
+ * loss, reordering and timing, at its original speed or as fast as
+ * possible (see manager/sla-ng-replay).
+ *
+ * The file is CAPTURE_SIZE bytes, mapped shared, and the records are
+ * written straight into the mapping, so capturing costs a memcpy() per
+ * result. The header has the number of records written, updated after
+ * each one, so a capture is valid at all times, even if probed dies.
+ * When the file is full, it is renamed to 'path'.1, the older ones to
+ * 'path'.2 and so on up to CAPTURE_KEEP, and a new one is started.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include "probed.h"
+#include "util.h"
+#include "client.h"
+#include "capture.h"
+
+#define CAPTURE_MAGIC 0x534c4e4743415054ULL /* "SLNGCAPT" */
+#define CAPTURE_VERSION 1
+
+/* The file; a header, and 'count' records after it */
+struct cap_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t rec_size; /* sizeof (struct cap_rec) */
+	int64_t count; /* Records written */
+	int64_t start; /* Creation, nanoseconds since the epoch */
+};
+
+struct cap_rec {
+	int64_t ts; /* Delivery, nanoseconds since the epoch */
+	struct res_fifo res;
+};
+
+static struct {
+	/*@null@*/ char *path;
+	/*@null@*/ struct cap_hdr *map;
+	size_t len;
+	int64_t max; /* Records that fit */
+} cap = { NULL, NULL, 0, 0 };
+
+static int capture_map(void);
+static void capture_rotate(void);
+
+/**
+ * Start capturing results to 'path'; an existing capture there is
+ * rotated away first
+ *
+ * \param[in] path Path to the capture file
+ * \return         0 on success, -1 on error
+ */
+int capture_open(char *path) {
+	cap.path = strdup(path);
+	if (cap.path == NULL)
+		return -1;
+	cap.len = CAPTURE_SIZE;
+	cap.max = (int64_t)((cap.len - sizeof *cap.map) / sizeof (struct cap_rec));
+	if (access(path, F_OK) == 0)
+		capture_rotate();
+	if (capture_map() < 0) {
+		free(cap.path);
+		cap.path = NULL;
+		return -1;
+	}
+	syslog(LOG_INFO, "capture: %s: Capturing results", path);
+	return 0;
+}
+
+/**
+ * Copy result 'r' into the capture, if enabled
+ *
+ * \param[in] r The result, as written to the FIFO
+ */
+void capture_write(struct res_fifo *r) {
+	struct cap_rec *rec;
+
+	if (cap.map == NULL)
+		return;
+	if (cap.map->count == cap.max) {
+		(void)munmap(cap.map, cap.len);
+		cap.map = NULL;
+		capture_rotate();
+		if (capture_map() < 0)
+			return;
+	}
+	rec = (struct cap_rec *)(cap.map + 1) + cap.map->count;
+	rec->ts = ts_now();
+	memcpy(&rec->res, r, sizeof rec->res);
+	cap.map->count++;
+}
+
+/**
+ * Flush the capture to disk, without waiting for it
+ */
+void capture_sync(void) {
+	if (cap.map == NULL)
+		return;
+	(void)msync(cap.map, cap.len, MS_ASYNC);
+}
+
+/**
+ * Create, size and map a new capture file at cap.path
+ */
+static int capture_map(void) {
+	int fd;
+
+	fd = open(cap.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		syslog(LOG_ERR, "capture: open: %s: %s", cap.path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)cap.len) < 0) {
+		syslog(LOG_ERR, "capture: ftruncate: %s", strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+	cap.map = mmap(NULL, cap.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (cap.map == MAP_FAILED) {
+		syslog(LOG_ERR, "capture: mmap: %s", strerror(errno));
+		cap.map = NULL;
+		return -1;
+	}
+	cap.map->magic = CAPTURE_MAGIC;
+	cap.map->version = CAPTURE_VERSION;
+	cap.map->rec_size = (uint32_t)sizeof (struct cap_rec);
+	cap.map->count = 0;
+	cap.map->start = ts_now();
+	return 0;
+}
+
+/**
+ * Rename 'path' to 'path'.1, 'path'.1 to 'path'.2 and so on; the one
+ * numbered CAPTURE_KEEP is overwritten
+ */
+static void capture_rotate(void) {
+	char from[TMPLEN], to[TMPLEN];
+	int i;
+
+	for (i = CAPTURE_KEEP; i > 0; i--) {
+		if (i == 1)
+			(void)snprintf(from, sizeof from, "%s", cap.path);
+		else
+			(void)snprintf(from, sizeof from, "%s.%d", cap.path, i - 1);
+		(void)snprintf(to, sizeof to, "%s.%d", cap.path, i);
+		if (rename(from, to) < 0 && errno != ENOENT)
+			syslog(LOG_ERR, "capture: rename: %s: %s", from, strerror(errno));
+	}
+}
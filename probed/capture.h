@@ -0,0 +1,10 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+int capture_open(char *path);
+void capture_write(struct res_fifo *r);
+void capture_sync(void);
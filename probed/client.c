@@ -20,6 +20,7 @@
 #endif
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
@@ -38,6 +39,11 @@
 #include "util.h"
 #include "unix.h"
 #include "net.h"
+#include "log.h"
+#include "snap.h"
+#include "hist.h"
+#include "iface.h"
+#include "capture.h"
 
 #define MASK_PING 1 /* Got ping */
 #define MASK_PONG 2 /* Got pong */
@@ -45,15 +51,14 @@
 #define MASK_DONE 7 /* Got everything */
 #define MASK_DSCP 8 /* DSCP error occured */
 
-#define STATE_SUCCESS  1
-#define STATE_DS_ERR 2
-#define STATE_TS_ERR 3
-#define STATE_PONGLOSS 4
-#define STATE_TIMEOUT 5
-#define STATE_DUP 6
-
 #define XML_NODE "probe"
 
+/* Timing wheel slots, of TIMEOUT_INTERVAL each; should span TIMEOUT */
+#define WHEEL_SLOTS 2048
+/* Buckets of the measurement session hash, on ID; a power of two, and
+ * enough that 100k sessions make short chains */
+#define MSESS_HASH 65536
+
 /* List of probe results */
 struct res {
 	/*@dependent@*/ ts_t created;
@@ -62,7 +67,10 @@ struct res {
 	num_t id;
 	num_t seq;
 	/*@dependent@*/ ts_t ts[4];
+	ts_t expire; /* Timeout, monotonic */
+	struct msess *sess;
 	TAILQ_ENTRY(res) list;
+	LIST_ENTRY(res) wheel;
 };
 
 /**
@@ -72,31 +80,62 @@ struct msess {
 	num_t id; /**< Measurement session ID */
 	TAILQ_HEAD(res_listhead, res) res_head;
 	addr_t dst; /**< Destination address and port */
-	int msec_interval; /**< Probe interval */
-	int timeout; /**< Timeout for PING */
+	ts_t interval; /**< Probe interval [nanoseconds] */
+	ts_t next; /**< Deadline of next PING, monotonic [nanoseconds] */
+	ts_t timeout; /**< Timeout for PING [nanoseconds] */
 	int got_hello; /**< Are we connected with server? */
 	uint8_t dscp; /**< DiffServ Code Point value of measurement session */
 	pid_t child_pid; /**< PID of child process doing the TCP connection */
 	uint32_t last_seq; /**< Last sequence number sent */
+	/*@null@*/ struct snap_rec *snap; /**< Snapshot record, if enabled */
+	LIST_ENTRY(msess) hash; /**< In msess_hash, on ID */
+	num_t ipdv_seq; /**< Sequence number of 'ipdv_rtt' */
+	ts_t ipdv_rtt; /**< RTT of the last response, for IPDV */
+	int res_ok, res_lost, res_err; /**< CLIENT mode summary per target */
+	ts_t rtt_min, rtt_max;
+	long long rtt_total;
+	int train; /**< PINGs per train, 1 for single PINGs */
+	num_t train_base; /**< Sequence number of the first PING of a train */
+	num_t disp_base; /**< The train of 'disp_first' and 'disp_last' */
+	ts_t disp_first, disp_last; /**< T2 of its first and last PING */
+	ts_t base_interval; /**< Configured interval, 'interval' when not bursting */
+	ts_t burst_until; /**< End of the burst, monotonic, or 0 */
+	LIST_ENTRY(msess) burst; /**< In burst_head, while bursting */
+	int sock; /**< Socket of its <interface>, or -1 for the main one */
+	int heap; /**< Index in sched[] */
 	LIST_ENTRY(msess) list;
 };
 
 static LIST_HEAD(msess_listhead, msess) msess_head;
+static struct msess_listhead msess_hash[MSESS_HASH];
+/* Measurement sessions ordered by deadline; binary min-heap on 'next' */
+static struct msess **sched = NULL;
+static int sched_len = 0;
+static int sched_size = 0;
+/* Probe results ordered by timeout; a hashed timing wheel */
+static LIST_HEAD(wheel_listhead, res) wheel[WHEEL_SLOTS];
+static ts_t wheel_tick; /* Last tick that was expired */
+/* Node-wide PING pacing; a token bucket kept as the time of next token */
+static ts_t pace_gap = 0; /* Time between tokens, 0 is unlimited */
+static ts_t pace_burst = 0; /* Bucket depth, as time */
+static ts_t pace_next = 0;
+/* Adaptive rate; sessions bursting after loss, and their extra PINGs */
+static LIST_HEAD(burst_listhead, msess) burst_head;
+static double burst_budget = 0; /* Extra PINGs per second, 0 is off */
+static double burst_pps = 0; /* Extra PINGs per second, in use */
 
-struct res_fifo {
-	uint32_t id;
-	uint32_t seq;
-	uint32_t state;
-	uint32_t created_sec;
-	uint32_t created_nsec;
-	uint32_t rtt_sec;
-	uint32_t rtt_nsec;
-};
 struct fifoq {
 	struct res_fifo res;
 	TAILQ_ENTRY(fifoq) list;
 };
 static TAILQ_HEAD(fifoq_listhead, fifoq) fifoq_head;
+/* Result callback, instead of the FIFO; see client_res_sink() */
+static /*@null@*/ void (*res_cb)(struct res_fifo *r, void *arg) = NULL;
+static /*@null@*/ void *res_cb_arg = NULL;
+/* Results held while walking the timing wheel; see client_res_hold() */
+static /*@null@*/ struct res_fifo *res_held = NULL;
+static int res_held_len = 0;
+static int res_held_size = 0;
 /* Client mode statistics */
 static int res_ok = 0;
 static int res_timeout = 0;
@@ -106,11 +145,39 @@ static int res_dserror = 0;
 static int res_dup = 0;
 static long long res_rtt_total = 0;
 static ts_t res_rtt_min, res_rtt_max;
+/* Client mode percentiles, and the per second lines of summary mode */
+static int res_quiet = 0; /* No line per PONG; see client_res_quiet() */
+static struct hist res_hist, res_hist_sec;
+static long long res_ipdv_total = 0, sec_ipdv_total = 0;
+static int res_ipdv_n = 0, sec_ipdv_n = 0;
+static int sec_lost = 0, sec_err = 0, sec_sent = 0;
+static ts_t res_start;
 
 static void client_res_insert(addr_t *a, data_t *d, ts_t *ts);
+static void client_res_output(struct res_fifo *r_fifo);
+static void client_res_ok(struct msess *s, num_t seq, ts_t rtt);
+static uint32_t client_res_dispersion(struct msess *s, struct res *r);
+static void client_res_print(const char *fmt, ...);
+static /*@null@*/ struct msess *client_msess_find(num_t id);
+static void client_res_free(struct msess *s);
 static pid_t client_fork(int pipe, addr_t *server);
+static void client_backoff(int *backoff);
 static int client_msess_isaddrtaken(addr_t *addr, num_t id);
-static void client_write_fifo(struct res_fifo *r_fifo);
+static int client_sched_insert(struct msess *s);
+static void client_sched_up(int i);
+static void client_sched_down(int i);
+static void client_sched_index(void);
+static void client_sched_earlier(struct msess *s, ts_t next);
+static void client_burst_start(struct msess *s, ts_t now);
+static void client_burst_end(struct msess *s);
+static void client_burst_decay(ts_t now);
+static void client_sched_spread(ts_t now);
+static int client_sched_cmp_interval(const void *a, const void *b);
+static int client_sched_cmp_next(const void *a, const void *b);
+static int client_sched_cmp_id(const void *a, const void *b);
+static void client_res_targets(void);
+static void client_res_hold(struct res_fifo *r_fifo);
+static void client_res_deliver(void);
 
 /**
  * Initializes global variables
@@ -118,14 +185,23 @@ static void client_write_fifo(struct res_fifo *r_fifo);
  * Init global variables such as the linked lists. Should be run once.
  */
 void client_init(void) {
+	int i;
+
 	/*@ -mustfreeonly -immediatetrans TODO wtf */
 	LIST_INIT(&msess_head);
+	LIST_INIT(&burst_head);
+	for (i = 0; i < MSESS_HASH; i++)
+		LIST_INIT(&msess_hash[i]);
 	TAILQ_INIT(&fifoq_head);
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		LIST_INIT(&wheel[i]);
 	/*@ +mustfreeonly +immediatetrans */
-	res_rtt_min.tv_sec = -1;
-	res_rtt_min.tv_nsec = 0;
-	res_rtt_max.tv_sec = 0;
-	res_rtt_max.tv_nsec = 0;
+	wheel_tick = ts_monotonic() / TIMEOUT_INTERVAL;
+	res_rtt_min = -1;
+	res_rtt_max = 0;
+	hist_clear(&res_hist);
+	hist_clear(&res_hist_sec);
+	res_start = ts_monotonic();
 	/*@ -nullstate TODO wtf? */
 	return;
 	/*@ +nullstate */
@@ -154,117 +230,6 @@ void client_res_fifo_or_die(char *fifopath) {
 
 }
 
-/**
- * Fork a process which triggers the main proces at regular intervals
- *
- * To avoid keeping track of time in the main process, a fork is created which
- * handles this. For IPC there is a pipe, to which data is sent at regular
- * intervals (SEND_INTERVAL microseconds).
- *
- * \param pipe	IPC pipe to which trigger messages are sent
- */
-void client_send_fork(int pipe) {
-
-	int niter = 0;
-	int time_dev = 0;
-	int t_dev = 0;
-	int neg;
-	char b = 's';
-	ts_t last, now, time_passed, diff, ideal;
-
-	/* ideal time between timer checks
-	 * the number '1000' is there to convert bewtween usec and nsec.
-	 */
-	ideal.tv_sec = 0;
-	ideal.tv_nsec = SEND_INTERVAL *
-		SEND_INTERVAL_DEV_INTERVAL * 1000;
-
-	/* Do not react to SIGCHLD (when a child dies) */
-	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
-		syslog(LOG_ERR, "send: signal: SIG_IGN on SIGCHLD failed");
-
-	/* Create client fork; parent returns */
-	if (fork() != 0) return;
-
-	/* We are child, do not react to HUP (reload), INT (print) */
-	if (signal(SIGHUP, SIG_IGN) == SIG_ERR)
-		syslog(LOG_ERR, "send: signal: SIG_IGN on SIGHUP failed");
-	if (signal(SIGINT, SIG_IGN) == SIG_ERR)
-		syslog(LOG_ERR, "send: signal: SIG_IGN on SIGINT failed");
-
-	/* Please kill me, I hate myself */
-	(void)prctl(PR_SET_PDEATHSIG, SIGKILL);
-
-
-	/*
-	 * Infinite loop - this is where it happens.
-	 * But first, initialize last iteration timestamp.
-	 */
-	(void)clock_gettime(CLOCK_REALTIME, &last);
-	while (1) {
-
-		usleep(SEND_INTERVAL - time_dev);
-
-		/* send trigger message */
-		if (write(pipe, &b, sizeof b) < 0)
-			syslog(LOG_ERR, "send: write: %s", strerror(errno));
-
-		/*
-		 * The SEND_INTERVAL needs to be adjusted slightly as other
-		 * actions in the loop takes some time to complete.
-		 * Check this evere SEND_INTERVAL_DEV_INTERVAL:th iteration.
-		 *
-		 */
-		if (niter % SEND_INTERVAL_DEV_INTERVAL == 0) {
-
-			/*
-			 * How long time did the last
-			 * SEND_INTERVAL_DEV_INTERVAL iterations take?
-			 */
-			(void)clock_gettime(CLOCK_REALTIME, &now);
-			diff_ts(&time_passed, &now, &last);
-			memcpy(&last, &now, sizeof last);
-			neg = diff_ts(&diff, &time_passed, &ideal);
-
-			/*
-			 * Calculate deviation from ideal time.
-			 * Division by 1000 is conversion from nsec to usec.
-			 */
-			t_dev = diff.tv_nsec / 1000 /
-				SEND_INTERVAL_DEV_INTERVAL;
-			if (neg) {
-				time_dev -= t_dev;
-			} else {
-				time_dev += t_dev;
-			}
-
-			/* Warn if we have very high values
-			* and limit the modifier */
-			if (time_dev > 300 || time_dev < -300) {
-
-				syslog(LOG_INFO, "time diff large @%d: s: %d ns: %d; time_dev: %d",
-					niter, (int)diff.tv_sec, (int)diff.tv_nsec, time_dev);
-				syslog(LOG_INFO, "time_passed: s: %d ns: %d; ideal: s: %d ns: %d",
-					(int)time_passed.tv_sec, (int)time_passed.tv_nsec,
-					(int)ideal.tv_sec, (int)ideal.tv_nsec);
-
-				if (time_dev > 300) {
-					time_dev = 300;
-				} else {
-					time_dev = -300;
-				}
-
-			}
-
-		}
-
-		niter++;
-
-	}
-
-}
-
-
 /**
  * Forks a 'client' process that connects to a server to get timestamps
  *
@@ -274,6 +239,9 @@ void client_send_fork(int pipe) {
  * state and timeouts in one context only, avoid conflicts with
  * the 'server' (parent) file descriptor set, for example when
  * doing bi-directional tests (both connecting to each other).
+ * Failed attempts are retried with a jittered, exponential backoff (see
+ * client_backoff()), so that the clients of a restarted server do not
+ * all reconnect in lockstep.
  * \param pipe   The main loop pipe file descriptor to send timestamps to
  * \param server The server address to connect to, and read timestamps from
  * \return       The process ID of the forked process
@@ -283,12 +251,12 @@ void client_send_fork(int pipe) {
 pid_t client_fork(int pipe, addr_t *server) {
 	int sock, r;
 	pid_t client_pid;
+	int backoff, attempts;
 	char addrstr[INET6_ADDRSTRLEN];
 	pkt_t pkt;
 	fd_set fs;
 	struct timeval tv;
 	char log[100];
-	ts_t zero;
 	socklen_t slen;
 
 	if (addr2str(server, addrstr) < 0)
@@ -308,12 +276,17 @@ pid_t client_fork(int pipe, addr_t *server) {
 	/* Please kill me, I hate myself */
 	(void)prctl(PR_SET_PDEATHSIG, SIGKILL);
 	/* We're going to send a struct packet over the pipe */
-	memset(&pkt.ts, 0, sizeof zero);
+	pkt.ts = 0;
+	/* Different jitter in every fork */
+	srandom((unsigned int)(getpid() ^ ts_monotonic()));
+	backoff = RECONNECT_MIN;
+	attempts = 0;
 	/* Try to stay connected to server; forever */
 	while (1 == 1) {
+		attempts++;
 		memcpy(&pkt.addr, server, sizeof pkt.addr);
 		if (addr2str(&pkt.addr, addrstr) < 0) {
-			(void)sleep(10);
+			client_backoff(&backoff);
 			continue;
 		}
 		syslog(LOG_INFO, "%s Connecting to port %d", log,
@@ -321,14 +294,14 @@ pid_t client_fork(int pipe, addr_t *server) {
 		sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);	
 		if (sock < 0) {
 			syslog(LOG_ERR, "%s socket: %s", log, strerror(errno));
-			(void)sleep(10);
+			client_backoff(&backoff);
 			continue;
 		}
 		slen = (socklen_t)sizeof pkt.addr;
 		if (connect(sock, (struct sockaddr *)&pkt.addr, slen) < 0) {
 			syslog(LOG_ERR, "%s connect: %s", log, strerror(errno));
 			(void)close(sock);
-			(void)sleep(10);
+			client_backoff(&backoff);
 			continue;
 		}
 		while (1 == 1) {
@@ -348,16 +321,43 @@ pid_t client_fork(int pipe, addr_t *server) {
 				syslog(LOG_ERR, "%s recv: %s", log, strerror(errno));
 				break;
 			}
+			/* The server accepted us; start over on the next loss */
+			if (attempts > 0) {
+				if (attempts > 1)
+					syslog(LOG_INFO, "%s Connected after %d attempts", log,
+							attempts);
+				attempts = 0;
+				backoff = RECONNECT_MIN;
+			}
 			if (write(pipe, (char *)&pkt, sizeof pkt) < 0)
 				syslog(LOG_ERR, "%s write: %s", log, strerror(errno));
 		}
 		syslog(LOG_ERR, "%s Connection lost", log);
 		(void)close(sock);
-		(void)sleep(1);
+		client_backoff(&backoff);
 	}
 	exit(EXIT_FAILURE);
 }
 
+/**
+ * Sleep before the next connection attempt of client_fork()
+ *
+ * The sleep is random, between half and all of 'backoff', which is then
+ * doubled, up to RECONNECT_MAX.
+ *
+ * \param[in,out] backoff The current backoff [milliseconds]
+ */
+static void client_backoff(int *backoff) {
+	struct timespec t;
+	long ms;
+
+	ms = *backoff / 2 + random() % (*backoff / 2 + 1);
+	t.tv_sec = (time_t)(ms / 1000);
+	t.tv_nsec = (ms % 1000) * 1000000;
+	(void)nanosleep(&t, NULL);
+	*backoff = MIN(*backoff * 2, RECONNECT_MAX);
+}
+
 /**
  * Insert a new 'ping' into the result list
  *
@@ -369,24 +369,28 @@ pid_t client_fork(int pipe, addr_t *server) {
  */
 void client_res_insert(addr_t *a, data_t *d, ts_t *ts) {
 	struct res *r;
-	struct msess *s, *s2;
+	struct msess *s2;
+	ts_t tick;
 
-	s2 = NULL;
-	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next)
-		if (s->id == d->id)
-			s2 = s;
+	s2 = client_msess_find(d->id);
 	if (s2 == NULL) return;
 	r = malloc(sizeof *r);
 	if (r == NULL) return;
 	memset(r, 0, sizeof *r);
-	(void)clock_gettime(CLOCK_REALTIME, &r->created);
+	r->created = ts_now();
 	r->state = MASK_PING;
 	memcpy(&r->addr, &a->sin6_addr, sizeof r->addr);
 	r->id = d->id;
 	r->seq = d->seq;
 	r->ts[0] = *ts;
+	r->sess = s2;
+	/* The first tick at or after the timeout, but not one already past */
+	r->expire = ts_monotonic() + s2->timeout;
+	tick = (r->expire + TIMEOUT_INTERVAL - 1) / TIMEOUT_INTERVAL;
+	tick = MAX(tick, wheel_tick + 1);
 	/*@ -mustfreeonly -immediatetrans TODO wtf */
 	TAILQ_INSERT_HEAD(&s2->res_head, r, list);
+	LIST_INSERT_HEAD(&wheel[tick % WHEEL_SLOTS], r, wheel);
 	/*@ +mustfreeonly +immediatetrans */
 	/*@ -compmempass TODO wtf? */
 	return;
@@ -409,13 +413,10 @@ void client_res_update(addr_t *a, data_t *d, /*@null@*/ ts_t *ts, int dscp) {
 	struct res *r;
 	struct msess *s;
 	struct res_fifo r_fifo;
-	ts_t now, diff, rtt;
-	int i, neg1 = 0, neg2 = 0, neg3 = 0;
+	ts_t now, rtt;
+	int i;
 
-	r = NULL;
-	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next)
-		if (s->id == d->id)
-			break;
+	s = client_msess_find(d->id);
 	if (s == NULL)
 		return;
 	r = s->res_head.tqh_first;
@@ -436,91 +437,86 @@ void client_res_update(addr_t *a, data_t *d, /*@null@*/ ts_t *ts, int dscp) {
 					r->state |= MASK_DSCP;
 			} else if (d->type == TYPE_TIME) {
 				r->state |= MASK_TIME;
+				data_decode(d);
 				r->ts[1] = d->t2;
 				r->ts[2] = d->t3;
 			}
 			/* Update the status mask to status codes */
 			if ((r->state & MASK_DONE) == MASK_DONE) {
+				memset(&r_fifo, 0, sizeof r_fifo);
 				r_fifo.id = (uint32_t)r->id;
 				r_fifo.seq = (uint32_t)r->seq;
-				r_fifo.created_sec = (uint32_t)r->created.tv_sec;
-				r_fifo.created_nsec = (uint32_t)r->created.tv_nsec;
+				r_fifo.created = r->created;
 				/* Check for DSCP error */
 				if (r->state & MASK_DSCP)
 					r_fifo.state = STATE_DS_ERR;
 				else
 					r_fifo.state = STATE_SUCCESS;
 
-				/* Calculate RTT */
-				neg1 = diff_ts(&diff, &r->ts[3], &r->ts[0]);
-				neg2 = diff_ts(&now, &r->ts[2], &r->ts[1]);
-				neg3 = diff_ts(&rtt, &diff, &now);
-				r_fifo.rtt_sec = (uint32_t)rtt.tv_sec;
-				r_fifo.rtt_nsec = (uint32_t)rtt.tv_nsec;
+				/* Calculate RTT: (T4 - T1) - (T3 - T2) */
+				now = r->ts[2] - r->ts[1];
+				rtt = r->ts[3] - r->ts[0] - now;
+				r_fifo.rtt = rtt;
 
-				/* Check that RTT calculations did not result in any
-				 * negative numbers */
-				if (neg1 || neg2 || neg3) {
+				/* Check that neither the RTT nor the time spent in
+				 * the responder is negative */
+				if (rtt < 0 || now < 0) {
 					r_fifo.state = STATE_TS_ERR;
-					syslog(LOG_ERR, "RTT calculation resulted in negative "
-						"value: neg1 %d neg2 %d neg3 %d\n", neg1, neg2, neg3);
+					log_msg(LOGT_RTT, LOG_ERR, "RTT calculation resulted in negative "
+						"value: rtt %lld responder %lld\n",
+						(long long)rtt, (long long)now);
 				}
 
 				/* Check that all timestamps are present */
 				for (i = 0; i < 4; i++)
-					if (r->ts[i].tv_sec == 0 && r->ts[i].tv_nsec == 0)
+					if (r->ts[i] == 0)
 						r_fifo.state = STATE_TS_ERR;
 				if (r_fifo.state == STATE_SUCCESS &&
-						r_fifo.rtt_sec > 20) {
-					syslog(LOG_ERR, "Strange RTT %d %ld.%ld sec\n",
-					      r->id, rtt.tv_sec, rtt.tv_nsec);
+						rtt > 20 * NSEC_PER_SEC) {
+					log_msg(LOGT_RTT, LOG_ERR, "Strange RTT %d %lld ns\n",
+					      (int)r->id, (long long)rtt);
 						r_fifo.state = STATE_TS_ERR;
 				}
+				/* Packet trains; spread of the train at the responder */
+				if (s->train > 1 && r_fifo.state == STATE_SUCCESS)
+					r_fifo.dispersion = client_res_dispersion(s, r);
 				count_client_done++;
 
-				/* Pipe (daemon) output */
-				if (cfg.op == DAEMON)
-					client_write_fifo(&r_fifo);
 				/* Client output */
 				if (cfg.op == CLIENT) {
 					if (r_fifo.state == STATE_TS_ERR) {
 						res_tserror++;
-						printf("Error    %4d from %d (invalid timestamps)\n",
+						sec_err++;
+						s->res_err++;
+						client_res_print("Error    %4d from %d (invalid timestamps)\n",
 								(int)r->seq, (int)r->id);
 					} else if (r_fifo.state == STATE_DS_ERR) {
 						res_dserror++;
-						printf("Error    %4d from %d in %d sec (invalid DSCP)\n",
-								(int)r->seq, (int)r->id, (int)diff.tv_sec);
+						sec_err++;
+						s->res_err++;
+						client_res_print("Error    %4d from %d in %d sec (invalid DSCP)\n",
+								(int)r->seq, (int)r->id,
+								(int)(rtt / NSEC_PER_SEC));
 					} else { /* STATE_SUCCESS implicit */
-						res_ok++;
-						neg1 = diff_ts(&diff, &r->ts[3], &r->ts[0]);
-						neg2 = diff_ts(&now, &r->ts[2], &r->ts[1]);
-						neg3 = diff_ts(&rtt, &diff, &now);
-						if (neg1 || neg2 || neg3) {
-							printf("RTT calculation resulted in negative "
-								"value: neg1 %d neg2 %d neg3 %d\n",
-								neg1, neg2, neg3);
-						}
-						if (rtt.tv_sec > 0)
-							printf("Response %4d from %d in %10ld.%09ld\n",
-									(int)r->seq, (int)r->id, rtt.tv_sec,
-									rtt.tv_nsec);
+						if (rtt >= NSEC_PER_SEC)
+							client_res_print("Response %4d from %d in %10lld.%09lld\n",
+									(int)r->seq, (int)r->id,
+									(long long)(rtt / NSEC_PER_SEC),
+									(long long)(rtt % NSEC_PER_SEC));
 						else
-							printf("Response %4d from %d in %ld ns\n",
-									(int)r->seq, (int)r->id, rtt.tv_nsec);
-						if (cmp_ts(&res_rtt_max, &rtt) == -1)
-							res_rtt_max = rtt;
-						if (res_rtt_min.tv_sec == -1)
-							res_rtt_min = rtt;
-						if (cmp_ts(&res_rtt_min, &rtt) == 1)
-							res_rtt_min = rtt;
-						res_rtt_total = res_rtt_total + rtt.tv_nsec;
+							client_res_print("Response %4d from %d in %lld ns\n",
+									(int)r->seq, (int)r->id, (long long)rtt);
+						client_res_ok(s, r->seq, rtt);
 					}
 				}
 				/*@ -branchstate -onlytrans TODO wtf */
 				TAILQ_REMOVE(&s->res_head, r, list);
+				LIST_REMOVE(r, wheel);
 				/*@ +branchstate +onlytrans */
 				free(r);
+				/* Callback or pipe (daemon) output; last, as the callback
+				 * may remove the session */
+				client_res_output(&r_fifo);
 			}
 			return;
 		}
@@ -529,34 +525,36 @@ void client_res_update(addr_t *a, data_t *d, /*@null@*/ ts_t *ts, int dscp) {
 	}
 	/* Didn't find PING. DUP! */
 	i = 0;
-	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next)
-		if (memcmp(&s->dst.sin6_addr, &a->sin6_addr, sizeof a->sin6_addr) == 0)
-			if (d->type == TYPE_PONG)
-				if (s->id == d->id)
-					if (s->last_seq >= d->seq)
-						i = 1;
+	if (memcmp(&s->dst.sin6_addr, &a->sin6_addr, sizeof a->sin6_addr) == 0)
+		if (d->type == TYPE_PONG)
+			if (s->last_seq >= d->seq)
+				i = 1;
 	/* DUPs should not come from the future :) Reconf? */
 	if (i == 0) return;
 	memset(&r_fifo, 0, sizeof r_fifo);
-	(void)clock_gettime(CLOCK_REALTIME, &now);
 	r_fifo.state = STATE_DUP;
 	r_fifo.id = (uint32_t)d->id;
 	r_fifo.seq = (uint32_t)d->seq;
-	r_fifo.created_sec = (uint32_t)now.tv_sec;
-	r_fifo.created_nsec = (uint32_t)now.tv_nsec;
-	if (cfg.op == DAEMON)
-		client_write_fifo(&r_fifo);
+	r_fifo.created = ts_now();
+	client_res_output(&r_fifo);
 	if (cfg.op == CLIENT) {
 		res_dup++;
-		printf("Unknown  %4d from %d (probably DUP)\n",
+		client_res_print("Unknown  %4d from %d (probably DUP)\n",
 				(int)d->seq, (int)d->id);
 	}
 }
 
-void client_res_summary(/*@unused@*/ int sig) {
+/**
+ * Print the summary of a CLIENT run, per target and in total, and exit
+ *
+ * Called from loop_step() after Ctrl+C, not from the signal handler, as
+ * it allocates and prints.
+ */
+void client_res_summary(void) {
 	float loss;
 	long long total;
 
+	client_res_targets();
 	total = (res_ok + res_dserror + res_tserror + res_timeout + res_pongloss);
 	loss = (float)(res_timeout + res_pongloss) / (float)total;
 	loss = loss * 100;
@@ -565,93 +563,339 @@ void client_res_summary(/*@unused@*/ int sig) {
 			res_ok, res_dserror, res_tserror, res_dup);
 	printf("%d lost pongs, %d timeouts, %f%% loss\n",
 			res_pongloss, res_timeout, loss);
-	if (res_rtt_max.tv_sec > 0)
-		printf("max: %ld.%09ld", res_rtt_max.tv_sec, res_rtt_max.tv_nsec);
-	else
-		printf("max: %ld ns", res_rtt_max.tv_nsec);
+	printf("%u local drops (UDP receive buffer full)\n",
+			(unsigned int)count_sock_drops);
+	printf("max: %lld ns", (long long)res_rtt_max);
 	loss = (float)res_rtt_total / (float)res_ok;
 	printf(", avg: %.0f ns", loss);
-	if (res_rtt_min.tv_sec > 0)
-		printf(", min: %ld.%09ld\n", res_rtt_min.tv_sec, res_rtt_min.tv_nsec);
-	else
-		printf(", min: %ld ns\n", res_rtt_min.tv_nsec);
+	printf(", min: %lld ns\n", (long long)res_rtt_min);
+	printf("p50: %lld ns, p90: %lld ns, p99: %lld ns, p99.9: %lld ns, "
+			"p99.99: %lld ns\n",
+			(long long)hist_percentile(&res_hist, 50),
+			(long long)hist_percentile(&res_hist, 90),
+			(long long)hist_percentile(&res_hist, 99),
+			(long long)hist_percentile(&res_hist, 99.9),
+			(long long)hist_percentile(&res_hist, 99.99));
+	printf("ipdv: %lld ns avg, of %d consecutive responses\n",
+			res_ipdv_n > 0 ? res_ipdv_total / res_ipdv_n : 0LL, res_ipdv_n);
 	exit(0);
 }
 
+/**
+ * Print one line per second instead of one per PONG, in CLIENT mode
+ *
+ * At high rates, the terminal can not keep up with a line per PONG;
+ * the summary lines, see client_res_report(), come from histograms.
+ *
+ * \param[in] quiet 1 for summary lines, 0 for a line per PONG
+ */
+void client_res_quiet(int quiet) {
+	res_quiet = quiet;
+}
+
+/**
+ * Print the summary line of the last second, in CLIENT summary mode
+ *
+ * Sent and received PINGs, loss, RTT percentiles, and IPDV; the mean
+ * RTT difference of responses with consecutive sequence numbers.
+ */
+void client_res_report(void) {
+	ts_t t;
+	int done;
+
+	if (res_quiet == 0)
+		return;
+	t = ts_monotonic() - res_start;
+	done = (int)res_hist_sec.n + sec_lost + sec_err;
+	printf("%4lld s: sent %6d, recv %6d, loss %6.2f%%, "
+			"p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, ipdv %lld ns\n",
+			(long long)(t / NSEC_PER_SEC), count_client_sent - sec_sent,
+			(int)res_hist_sec.n,
+			done > 0 ? 100.0 * (double)sec_lost / (double)done : 0.0,
+			(long long)hist_percentile(&res_hist_sec, 50),
+			(long long)hist_percentile(&res_hist_sec, 90),
+			(long long)hist_percentile(&res_hist_sec, 99),
+			(long long)hist_percentile(&res_hist_sec, 99.9),
+			sec_ipdv_n > 0 ? sec_ipdv_total / sec_ipdv_n : 0LL);
+	(void)fflush(stdout);
+	hist_clear(&res_hist_sec);
+	sec_sent = count_client_sent;
+	sec_lost = 0;
+	sec_err = 0;
+	sec_ipdv_total = 0;
+	sec_ipdv_n = 0;
+}
+
+/**
+ * The dispersion of the packet train of result 'r', if complete
+ *
+ * That is T2 of the last PING of the train minus T2 of the first, both
+ * taken by the responder, so that it is the spacing the path put on a
+ * train that left back to back. It is known when the second of the two
+ * completes, and given in the result record of that one.
+ *
+ * \param[in] s The measurement session, with s->train > 1
+ * \param[in] r A successful result of 's'
+ * \return      The dispersion [nanoseconds], or 0 if not known yet
+ */
+static uint32_t client_res_dispersion(struct msess *s, struct res *r) {
+	int32_t pos;
+	num_t base;
+	ts_t d;
+
+	/* Trains are sent whole, so they are aligned to any train's start */
+	pos = (int32_t)(r->seq - s->train_base) % s->train;
+	if (pos < 0)
+		pos += s->train;
+	if (pos != 0 && pos != s->train - 1)
+		return 0;
+	base = r->seq - (num_t)pos;
+	if (base != s->disp_base) {
+		s->disp_base = base;
+		s->disp_first = 0;
+		s->disp_last = 0;
+	}
+	if (pos == 0)
+		s->disp_first = r->ts[1];
+	else
+		s->disp_last = r->ts[1];
+	if (s->disp_first == 0 || s->disp_last == 0)
+		return 0;
+	d = s->disp_last - s->disp_first;
+	if (d < 0)
+		return 0;
+	return (uint32_t)MIN(d, (ts_t)UINT32_MAX);
+}
+
+/**
+ * Count a successful response of session 's', in CLIENT mode
+ */
+static void client_res_ok(struct msess *s, num_t seq, ts_t rtt) {
+	ts_t d;
+
+	res_ok++;
+	if (rtt > res_rtt_max)
+		res_rtt_max = rtt;
+	if (res_rtt_min == -1 || rtt < res_rtt_min)
+		res_rtt_min = rtt;
+	res_rtt_total = res_rtt_total + rtt;
+	hist_add(&res_hist, rtt);
+	hist_add(&res_hist_sec, rtt);
+	if (s->ipdv_seq != 0 && seq == s->ipdv_seq + 1) {
+		d = rtt > s->ipdv_rtt ? rtt - s->ipdv_rtt : s->ipdv_rtt - rtt;
+		res_ipdv_total += d;
+		res_ipdv_n++;
+		sec_ipdv_total += d;
+		sec_ipdv_n++;
+	}
+	s->ipdv_seq = seq;
+	s->ipdv_rtt = rtt;
+	if (s->res_ok == 0 || rtt < s->rtt_min)
+		s->rtt_min = rtt;
+	s->rtt_max = MAX(s->rtt_max, rtt);
+	s->rtt_total += rtt;
+	s->res_ok++;
+}
+
+/**
+ * Print the summary of each target, when there are more than one
+ */
+static void client_res_targets(void) {
+	char addrstr[INET6_ADDRSTRLEN];
+	struct msess **l, *s;
+	int i, done;
+
+	if (sched_len < 2)
+		return;
+	l = malloc((size_t)sched_len * sizeof *l);
+	if (l == NULL)
+		return;
+	memcpy(l, sched, (size_t)sched_len * sizeof *l);
+	qsort(l, (size_t)sched_len, sizeof *l, client_sched_cmp_id);
+	printf("\n%5s %-39s %8s %8s %8s %7s %10s %10s %10s\n", "id", "target",
+			"sent", "ok", "lost", "loss%", "min ns", "avg ns", "max ns");
+	for (i = 0; i < sched_len; i++) {
+		s = l[i];
+		if (addr2str(&s->dst, addrstr) < 0)
+			addrstr[0] = '\0';
+		done = s->res_ok + s->res_lost + s->res_err;
+		printf("%5d %-39s %8d %8d %8d %7.2f %10lld %10lld %10lld\n",
+				(int)s->id, addrstr, (int)s->last_seq, s->res_ok, s->res_lost,
+				done > 0 ? 100.0 * (double)s->res_lost / (double)done : 0.0,
+				(long long)s->rtt_min,
+				s->res_ok > 0 ? s->rtt_total / s->res_ok : 0LL,
+				(long long)s->rtt_max);
+	}
+	free(l);
+}
+
+/**
+ * printf() the line of one PONG, unless in summary mode
+ */
+static void client_res_print(const char *fmt, ...) {
+	va_list ap;
+
+	if (res_quiet == 1)
+		return;
+	va_start(ap, fmt);
+	(void)vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Expire the probes whose timeout has passed
+ *
+ * Probes are kept in a hashed timing wheel, in the slot of the first
+ * tick (TIMEOUT_INTERVAL) at or after their timeout, and this visits
+ * only the slots of the ticks that have passed since the last call.
+ * Probes in those slots that belong to a later turn of the wheel, with
+ * a timeout longer than WHEEL_SLOTS ticks, are left alone. Timeouts
+ * and lost PONGs start bursts, which decay here too (client_burst()).
+ */
 void client_res_clear_timeouts(void) {
 	struct res *r, *r_tmp;
 	struct res_fifo r_fifo;
-	struct msess *s;
-	ts_t now, diff;
-
-	(void)clock_gettime(CLOCK_REALTIME, &now);
-	r = NULL;
-	/* For each mesasurement sesion */
-	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next) {
-		/* For each probe, in reverse order */
-		if ((&s->res_head)->tqh_last == NULL)
-			continue;
-		r = *(((struct res_listhead *)((&s->res_head)->tqh_last))->tqh_last);
+	ts_t now, mono, tick, diff;
+
+	now = ts_now();
+	mono = ts_monotonic();
+	tick = mono / TIMEOUT_INTERVAL;
+	/* Never go around the wheel more than once */
+	wheel_tick = MAX(wheel_tick, tick - WHEEL_SLOTS);
+	while (wheel_tick < tick) {
+		wheel_tick++;
+		r = wheel[wheel_tick % WHEEL_SLOTS].lh_first;
 		while (r != NULL) {
-			diff_ts(&diff, &now, &r->created);
-			if (diff.tv_sec <= TIMEOUT) {
-				/* We have reached young probes; stop looking */
-				break;
-			} else {
-				/*
-				 * Define three states:
-				 * PONGLOSS, we have a TCP timestamp, but no pong
-				 * TS_ERR, we have a pong, but no TCP timestamp
-				 * TIMEOUT, we have nothing
-				 */
-				memset(&r_fifo, 0, sizeof r_fifo);
-				if (r->state & MASK_TIME)
-					r_fifo.state = STATE_PONGLOSS;
-				else if (r->state & MASK_PONG)
-				   	r_fifo.state = STATE_TS_ERR;
-				else /* MASK_PING implicit */
-					r_fifo.state = STATE_TIMEOUT;
-				r_fifo.id = (uint32_t)r->id;
-				r_fifo.seq = (uint32_t)r->seq;
-				r_fifo.created_sec = (uint32_t)r->created.tv_sec;
-				r_fifo.created_nsec = (uint32_t)r->created.tv_nsec;
-				count_client_done++;
-				if (cfg.op == DAEMON)
-					client_write_fifo(&r_fifo);
-				/* Client output */
-				if (cfg.op == CLIENT) {
-					if (r_fifo.state == STATE_TS_ERR) {
-						res_tserror++;
-						printf("Error    %4d from %d in %d sec (missing T2/T3)\n",
-								(int)r->seq, (int)r->id, (int)diff.tv_sec);
-					} else if (r_fifo.state == STATE_PONGLOSS) {
-						res_pongloss++;
-						printf("Timeout  %4d from %d in %d sec (missing PONG)\n",
-								(int)r->seq, (int)r->id, (int)diff.tv_sec);
-					} else if (r_fifo.state == STATE_TIMEOUT) {
-						res_timeout++;
-						printf("Timeout  %4d from %d in %d sec (missing all)\n",
-								(int)r->seq, (int)r->id, (int)diff.tv_sec);
-					} else {
-						printf("Error    %4d from %d (unknown error)\n",
-								(int)r->seq, (int)r->id);
-					}
-				}
-				/* Ready, timeout or error; safe removal */
-				r_tmp = *(((struct res_listhead *)(r->list.tqe_prev))->tqh_last);
-				/*@ -branchstate -onlytrans TODO wtf */
-				TAILQ_REMOVE(&s->res_head, r, list);
-				/*@ +branchstate +onlytrans */
-				free(r);
+			r_tmp = r->wheel.le_next;
+			if (r->expire > mono) {
+				/* Later turn of the wheel */
 				r = r_tmp;
 				continue;
 			}
-			r = *(((struct res_listhead *)(r->list.tqe_prev))->tqh_last);
+			diff = now - r->created;
+			/*
+			 * Define three states:
+			 * PONGLOSS, we have a TCP timestamp, but no pong
+			 * TS_ERR, we have a pong, but no TCP timestamp
+			 * TIMEOUT, we have nothing
+			 */
+			memset(&r_fifo, 0, sizeof r_fifo);
+			if (r->state & MASK_TIME)
+				r_fifo.state = STATE_PONGLOSS;
+			else if (r->state & MASK_PONG)
+			   	r_fifo.state = STATE_TS_ERR;
+			else /* MASK_PING implicit */
+				r_fifo.state = STATE_TIMEOUT;
+			r_fifo.id = (uint32_t)r->id;
+			r_fifo.seq = (uint32_t)r->seq;
+			r_fifo.created = r->created;
+			count_client_done++;
+			client_res_hold(&r_fifo);
+			/* Loss; look closer for a while */
+			if (burst_budget > 0 && r_fifo.state != STATE_TS_ERR)
+				client_burst_start(r->sess, mono);
+			/* Client output */
+			if (cfg.op == CLIENT) {
+				if (r_fifo.state == STATE_TS_ERR) {
+					res_tserror++;
+					sec_err++;
+					r->sess->res_err++;
+					client_res_print("Error    %4d from %d in %d sec (missing T2/T3)\n",
+							(int)r->seq, (int)r->id,
+							(int)(diff / NSEC_PER_SEC));
+				} else if (r_fifo.state == STATE_PONGLOSS) {
+					res_pongloss++;
+					sec_lost++;
+					r->sess->res_lost++;
+					client_res_print("Timeout  %4d from %d in %d sec (missing PONG)\n",
+							(int)r->seq, (int)r->id,
+							(int)(diff / NSEC_PER_SEC));
+				} else if (r_fifo.state == STATE_TIMEOUT) {
+					res_timeout++;
+					sec_lost++;
+					r->sess->res_lost++;
+					client_res_print("Timeout  %4d from %d in %d sec (missing all)\n",
+							(int)r->seq, (int)r->id,
+							(int)(diff / NSEC_PER_SEC));
+				} else {
+					client_res_print("Error    %4d from %d (unknown error)\n",
+							(int)r->seq, (int)r->id);
+				}
+			}
+			/* Ready, timeout or error; safe removal */
+			/*@ -branchstate -onlytrans TODO wtf */
+			TAILQ_REMOVE(&r->sess->res_head, r, list);
+			LIST_REMOVE(r, wheel);
+			/*@ +branchstate +onlytrans */
+			free(r);
+			r = r_tmp;
 		}
 	}
+	client_burst_decay(mono);
+	client_res_deliver();
 	return;
 }
 
+/**
+ * Deliver a result to the callback registered with client_res_sink(),
+ * or else, in DAEMON mode, write it to the FIFO; and to the capture,
+ * if enabled
+ */
+static void client_res_output(struct res_fifo *r_fifo) {
+	capture_write(r_fifo);
+	if (res_cb != NULL)
+		res_cb(r_fifo, res_cb_arg);
+	else if (cfg.op == DAEMON)
+		client_write_fifo(r_fifo);
+}
+
+/**
+ * Hold result 'r_fifo' until client_res_deliver()
+ *
+ * For results found while walking the timing wheel; the callback may
+ * remove sessions, and with them, the probes the walk is at.
+ */
+static void client_res_hold(struct res_fifo *r_fifo) {
+	struct res_fifo *tmp;
+
+	if (res_held_len == res_held_size) {
+		tmp = realloc(res_held, (size_t)(res_held_size * 2 + 16) * sizeof *tmp);
+		if (tmp == NULL) {
+			syslog(LOG_ERR, "client: realloc: %s", strerror(errno));
+			return;
+		}
+		res_held = tmp;
+		res_held_size = res_held_size * 2 + 16;
+	}
+	memcpy(&res_held[res_held_len++], r_fifo, sizeof *r_fifo);
+}
+
+/**
+ * Output the results held by client_res_hold()
+ */
+static void client_res_deliver(void) {
+	int i, n;
+
+	n = res_held_len;
+	res_held_len = 0;
+	for (i = 0; i < n; i++)
+		client_res_output(&res_held[i]);
+}
+
+/**
+ * Deliver results to the function 'cb' instead of the FIFO
+ *
+ * Used when probed is embedded, see libprobed.c. The result is only
+ * valid during the call.
+ *
+ * \param[in] cb  Result callback, or NULL for the FIFO again
+ * \param[in] arg Passed on to 'cb'
+ */
+void client_res_sink(void (*cb)(struct res_fifo *r, void *arg), void *arg) {
+	res_cb = cb;
+	res_cb_arg = arg;
+}
+
 void client_write_fifo(struct res_fifo *r_fifo) {
 	struct fifoq *q, *q_tmp;
 
@@ -690,17 +934,31 @@ void client_write_fifo(struct res_fifo *r_fifo) {
  *
  * \return 0 on success, otherwise -1
  */
-int client_msess_add(char *port, char *a, uint8_t dscp, int wait, num_t id) {
+int client_msess_add(char *port, char *a, uint8_t dscp, ts_t interval,
+		num_t id) {
 	int ret;
 	struct msess *s;
 	struct addrinfo /*@dependent@*/ dst_hints, *dst_addr;
 
+	if (interval < 1) {
+		syslog(LOG_ERR, "Invalid interval");
+		return -1;
+	}
+	if (client_msess_find(id) != NULL) {
+		syslog(LOG_ERR, "Probe %d: Already added", (int)id);
+		return -1;
+	}
 	s = malloc(sizeof *s);
 	if (s == NULL) return -1;
 	memset(s, 0, sizeof *s);
 	s->id = id;
 	s->dscp = dscp;
-	s->msec_interval = wait;
+	s->interval = interval;
+	s->timeout = (ts_t)TIMEOUT * NSEC_PER_SEC;
+	s->next = ts_monotonic();
+	s->train = 1;
+	s->base_interval = interval;
+	s->sock = -1;
 	/* Prepare for getaddrinfo */
 	memset(&dst_hints, 0, sizeof dst_hints);
 	dst_hints.ai_family = AF_INET6;
@@ -714,8 +972,13 @@ int client_msess_add(char *port, char *a, uint8_t dscp, int wait, num_t id) {
 	}
 	memcpy(&s->dst, dst_addr->ai_addr, sizeof s->dst);
 	freeaddrinfo(dst_addr);
+	if (client_sched_insert(s) < 0) {
+		free(s);
+		return -1;
+	}
 	/*@ -mustfreeonly -immediatetrans TODO wtf */
 	LIST_INSERT_HEAD(&msess_head, s, list);
+	LIST_INSERT_HEAD(&msess_hash[id & (MSESS_HASH - 1)], s, hash);
 	/*@ +mustfreeonly +immediatetrans */
 	/*@ -compmempass TODO wtf? */
 	return 0;
@@ -723,48 +986,575 @@ int client_msess_add(char *port, char *a, uint8_t dscp, int wait, num_t id) {
 }
 
 /**
- * Send PING packets on the UDP socket for all measurement sessions
+ * Add a measurement session for each target in the file 'path', in
+ * CLIENT mode
+ *
+ * One target per line: address, and optionally the interval [ms, may
+ * be decimal] and DSCP; e.g. "10.0.0.1 0.5 46". Empty lines and lines
+ * starting with '#' are skipped. Sessions get IDs 1, 2, ... in order.
+ * The sessions are spread evenly over their intervals, so that the
+ * aggregate PING rate is smooth (see client_sched_spread()).
+ *
+ * \param[in] port     Destination port
+ * \param[in] path     The target list, or "-" for standard input
+ * \param[in] interval Default interval [nanoseconds]
+ * \return             Number of sessions added, or -1 on error
+ */
+int client_msess_load(char *port, char *path, ts_t interval) {
+	char line[TMPLEN], addr[TMPLEN];
+	double ms;
+	FILE *f;
+	int dscp, n, lineno = 0, added = 0;
+	ts_t iv;
+
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL) {
+		syslog(LOG_ERR, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof line, f) != NULL) {
+		lineno++;
+		ms = -1;
+		dscp = 0;
+		n = sscanf(line, "%511s %lf %d", addr, &ms, &dscp);
+		if (n < 1 || addr[0] == '#')
+			continue;
+		iv = n >= 2 ? (ts_t)(ms * 1000000) : interval;
+		if (dscp < 0 || dscp > 63) {
+			syslog(LOG_ERR, "%s:%d: Invalid DSCP", path, lineno);
+			continue;
+		}
+		if (client_msess_add(port, addr, (uint8_t)dscp, iv,
+				(num_t)(added + 1)) != 0) {
+			syslog(LOG_ERR, "%s:%d: Skipping %s", path, lineno, addr);
+			continue;
+		}
+		added++;
+	}
+	if (f != stdin)
+		(void)fclose(f);
+	client_sched_spread(ts_monotonic());
+	syslog(LOG_INFO, "Loaded %d targets from %s", added, path);
+	return added;
+}
+
+/**
+ * Remove measurement session 'id', and its results
+ *
+ * Its client fork is killed; if other sessions were using it, call
+ * client_msess_forkall() to start a new one.
  *
- * This is called from the main loop at constant intervals, and
- * this function determines if it is time to send to a particular
- * msess
+ * \param[in] id Measurement session ID
+ * \return       0 on success, -1 if there is no such session
+ */
+int client_msess_remove(num_t id) {
+	struct msess *s, *last;
+	int i;
+
+	s = client_msess_find(id);
+	if (s == NULL)
+		return -1;
+	if (s->child_pid != 0)
+		if (kill(s->child_pid, SIGKILL) != 0)
+			syslog(LOG_ERR, "client: kill: %s", strerror(errno));
+	client_res_free(s);
+	client_burst_end(s);
+	/* The last session takes its place, and moves up or down from there */
+	i = s->heap;
+	last = sched[--sched_len];
+	if (i < sched_len) {
+		sched[i] = last;
+		last->heap = i;
+		client_sched_up(i);
+		client_sched_down(last->heap);
+	}
+	/*@ -branchstate -onlytrans TODO wtf */
+	LIST_REMOVE(s, list);
+	LIST_REMOVE(s, hash);
+	/*@ +branchstate +onlytrans */
+	free(s);
+	return 0;
+}
+
+/**
+ * Change the DSCP, interval and timeout of measurement session 'id'
  *
- * \param[in] s_udp The UDP socket to send on
+ * The sequence numbers continue; a new interval is used from the next
+ * PING, which is not sent later than one new interval from now.
+ *
+ * \param[in] id       Measurement session ID
+ * \param[in] dscp     DiffServ Code Point
+ * \param[in] interval Probe interval [nanoseconds]
+ * \param[in] timeout  Probe timeout [nanoseconds]
+ * \return             0 on success, -1 on error
  */
+int client_msess_modify(num_t id, uint8_t dscp, ts_t interval, ts_t timeout) {
+	struct msess *s;
+
+	s = client_msess_find(id);
+	if (s == NULL || interval < 1 || timeout < 1)
+		return -1;
+	s->dscp = dscp;
+	s->timeout = timeout;
+	client_burst_end(s);
+	s->base_interval = interval;
+	if (s->interval != interval) {
+		s->interval = interval;
+		s->next = MIN(s->next, ts_monotonic() + interval);
+		client_sched_up(s->heap);
+		if (s->snap != NULL) {
+			s->snap->interval = s->interval;
+			s->snap->next = s->next;
+		}
+	}
+	return 0;
+}
 
-void client_msess_transmit(int s_udp, int sends) {
+/**
+ * Send 'n' PINGs back to back at each interval of session 'id'
+ *
+ * \param[in] id Measurement session ID
+ * \param[in] n  PINGs per train, 1 to TRAIN_MAX
+ * \return       0 on success, -1 on error
+ */
+int client_msess_train(num_t id, int n) {
 	struct msess *s;
-	data_t tx;
-	ts_t ts;
-	
-	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next) {
+
+	s = client_msess_find(id);
+	if (s == NULL || n < 1 || n > TRAIN_MAX)
+		return -1;
+	/* The burst budget is counted in PINGs */
+	client_burst_end(s);
+	s->train = n;
+	return 0;
+}
+
+/**
+ * Find measurement session 'id', in the hash
+ */
+static struct msess *client_msess_find(num_t id) {
+	struct msess *s;
+
+	for (s = msess_hash[id & (MSESS_HASH - 1)].lh_first; s != NULL;
+			s = s->hash.le_next)
+		if (s->id == id)
+			return s;
+	return NULL;
+}
+
+/**
+ * Free the outstanding results of measurement session 's'
+ */
+static void client_res_free(struct msess *s) {
+	struct res *r, *r_tmp;
+
+	r = s->res_head.tqh_first;
+	while (r != NULL) {
+		r_tmp = r->list.tqe_next;
+		/*@ -branchstate -onlytrans TODO wtf */
+		TAILQ_REMOVE(&s->res_head, r, list);
+		LIST_REMOVE(r, wheel);
+		/*@ +branchstate +onlytrans */
+		free(r);
+		r = r_tmp;
+	}
+}
+
+/**
+ * Send PING packets on the UDP socket for all measurement sessions
+ * whose deadline has passed
+ *
+ * Each session has its own interval and deadline, on the monotonic
+ * clock, and the sessions are kept in a min-heap ordered by deadline,
+ * so only sessions that are due are looked at. A session that has
+ * fallen behind by more than one interval skips the missed PINGs,
+ * instead of sending them back-to-back; the deadlines stay on the same
+ * grid, so the phase of the session is kept. If pacing is enabled
+ * (see client_pace), due sessions wait for a token, and the rest of
+ * them are sent on a later call. A session with a <train> sends that
+ * many PINGs at each deadline, back to back, see send_train_w_ts().
+ * A session with an <interface> or <source> sends on the socket of
+ * that interface, see iface.c.
+ *
+ * \param[in] s_udp The UDP socket to send on, for the other sessions
+ * \param[in] now   Current monotonic time, from ts_monotonic()
+ */
+void client_msess_transmit(int s_udp, ts_t now) {
+	struct msess *s;
+	data_t tx[TRAIN_MAX];
+	ts_t ts[TRAIN_MAX];
+	int i, n, sock;
+
+	while (sched_len > 0 && sched[0]->next <= now) {
+		s = sched[0];
+		/* Out of tokens? */
+		if (pace_gap > 0 && s->got_hello == 1) {
+			if (pace_next > now)
+				break;
+			pace_next = MAX(pace_next, now - pace_burst) +
+				pace_gap * s->train;
+		}
+		/* Next deadline, skipping the ones we missed */
+		s->next += s->interval;
+		if (s->next <= now) {
+			count_client_skip++;
+			s->next += ((now - s->next) / s->interval + 1) * s->interval;
+		}
+		client_sched_down(0);
+		if (s->snap != NULL)
+			s->snap->next = s->next;
 		/* Are we connected to server? */
 		if (s->got_hello != 1)
 			continue;
-		/* time to send new packet? */
-		if (s->msec_interval < 1) {
-			syslog(LOG_CRIT, "Invalid interval");
-			continue;
-		}
-		if (sends % s->msec_interval == 0) {
-			count_client_sent++;
-			memset(&tx, 0, sizeof tx);
-			tx.type = TYPE_PING;
-			tx.id = s->id;
+		count_client_sent += s->train;
+		memset(tx, 0, sizeof *tx * (size_t)s->train);
+		s->train_base = s->last_seq + 1;
+		for (i = 0; i < s->train; i++) {
+			tx[i].type = TYPE_PING;
+			tx[i].version = DATA_VERSION;
+			tx[i].id = s->id;
 			s->last_seq++;
-			tx.seq = s->last_seq;
-			last_tx_id = s->id;
-			last_tx_seq = s->last_seq;
-			(void)dscp_set(s_udp, s->dscp);
-			if (send_w_ts(s_udp, &s->dst, (char*)&tx, &ts) < 0)
-				syslog(LOG_INFO, "skipping send");
+			tx[i].seq = s->last_seq;
+		}
+		if (s->snap != NULL)
+			s->snap->last_seq = s->last_seq;
+		last_tx_id = s->id;
+		last_tx_seq = s->last_seq;
+		sock = s->sock >= 0 ? s->sock : s_udp;
+		(void)dscp_set(sock, s->dscp);
+		if (s->train == 1) {
+			if (send_w_ts(sock, &s->dst, (char*)&tx[0], &ts[0]) < 0)
+				log_msg(LOGT_SEND, LOG_INFO, "skipping send");
 			else
-				client_res_insert(&s->dst, &tx, &ts);
+				client_res_insert(&s->dst, &tx[0], &ts[0]);
+			continue;
 		}
+		/* A train; back to back, in one batch */
+		n = send_train_w_ts(sock, &s->dst, (char*)tx, s->train, ts);
+		if (n < s->train)
+			log_msg(LOGT_SEND, LOG_INFO, "skipping send");
+		for (i = 0; i < n; i++)
+			client_res_insert(&s->dst, &tx[i], &ts[i]);
 	}
 
 }
 
+/**
+ * Get the deadline of the measurement session that is due first
+ *
+ * \return The monotonic deadline [nanoseconds], or -1 if no sessions
+ */
+ts_t client_msess_next(void) {
+	if (sched_len < 1)
+		return -1;
+	/* Due, but waiting for a token */
+	if (pace_gap > 0)
+		return MAX(sched[0]->next, pace_next);
+	return sched[0]->next;
+}
+
+/**
+ * The aggregate PING rate of all measurement sessions, after pacing
+ *
+ * \return PINGs per second
+ */
+long client_msess_pps(void) {
+	double pps = 0;
+	int i;
+
+	for (i = 0; i < sched_len; i++)
+		pps += (double)NSEC_PER_SEC * sched[i]->train /
+			(double)sched[i]->base_interval;
+	pps += burst_budget;
+	if (pace_gap > 0)
+		pps = MIN(pps, (double)NSEC_PER_SEC / (double)pace_gap);
+	return (long)pps;
+}
+
+/**
+ * Limit the PINGs of all measurement sessions together to 'pps'
+ *
+ * The bucket holds one millisecond worth of PINGs, but at least one,
+ * so that sessions that are due at the same time may still be sent
+ * back-to-back, but the transmit load is smooth over time.
+ *
+ * \param[in] pps PINGs per second, or 0 for no limit
+ */
+void client_pace(int pps) {
+	if (pps < 1) {
+		pace_gap = 0;
+		return;
+	}
+	pace_gap = NSEC_PER_SEC / pps;
+	pace_burst = MAX(NSEC_PER_SEC / 1000 - pace_gap, 0);
+	pace_next = 0;
+}
+
+/**
+ * Let sessions that see loss PING more often, 'pps' extra PINGs per
+ * second for all of them together
+ *
+ * A session with a timeout or a lost PONG bursts: its interval is cut
+ * to 1/BURST_FACTOR, but not below BURST_MIN_INTERVAL, for as long as
+ * the loss goes on and BURST_HOLD after. Then its rate halves every
+ * BURST_HOLD, back to its configured interval. A burst gets what is
+ * left of 'pps'; when that is used up, no more sessions burst, so the
+ * steady-state rate stays low, and the worst case is known.
+ *
+ * \param[in] pps Extra PINGs per second, or 0 for no bursts
+ */
+void client_burst(int pps) {
+	burst_budget = MAX(pps, 0);
+}
+
+/**
+ * Start a burst of session 's', or make it last longer, after loss
+ *
+ * \param[in] s   The measurement session that saw loss
+ * \param[in] now Current monotonic time
+ */
+static void client_burst_start(struct msess *s, ts_t now) {
+	double base, left;
+	ts_t iv;
+
+	if (s->burst_until != 0) {
+		s->burst_until = now + BURST_HOLD;
+		return;
+	}
+	base = (double)NSEC_PER_SEC * s->train / (double)s->base_interval;
+	left = burst_budget - burst_pps;
+	iv = MAX(s->base_interval / BURST_FACTOR, BURST_MIN_INTERVAL);
+	/* The budget left may not allow a full burst */
+	if ((double)NSEC_PER_SEC * s->train / (double)iv - base > left)
+		iv = (ts_t)((double)NSEC_PER_SEC * s->train / (base + left));
+	if (iv >= s->base_interval)
+		return;
+	s->interval = iv;
+	s->burst_until = now + BURST_HOLD;
+	burst_pps += (double)NSEC_PER_SEC * s->train / (double)iv - base;
+	LIST_INSERT_HEAD(&burst_head, s, burst);
+	/* The next PING; now, on the grid of the new interval */
+	client_sched_earlier(s, MIN(s->next, now + iv));
+	log_msg(LOGT_SEND, LOG_INFO, "Probe %d: Loss, interval %lld us for "
+			"now", (int)s->id, (long long)(iv / 1000));
+}
+
+/**
+ * End the burst of session 's', if any, and go back to its interval
+ */
+static void client_burst_end(struct msess *s) {
+	if (s->burst_until == 0)
+		return;
+	burst_pps -= (double)NSEC_PER_SEC * s->train / (double)s->interval -
+		(double)NSEC_PER_SEC * s->train / (double)s->base_interval;
+	burst_pps = MAX(burst_pps, 0);
+	s->interval = s->base_interval;
+	s->burst_until = 0;
+	LIST_REMOVE(s, burst);
+}
+
+/**
+ * Halve the rate of the sessions whose burst has been quiet for
+ * BURST_HOLD, see client_burst()
+ *
+ * \param[in] now Current monotonic time
+ */
+static void client_burst_decay(ts_t now) {
+	struct msess *s, *s_tmp;
+	double before;
+
+	for (s = burst_head.lh_first; s != NULL; s = s_tmp) {
+		s_tmp = s->burst.le_next;
+		if (now < s->burst_until)
+			continue;
+		if (s->interval * 2 >= s->base_interval) {
+			client_burst_end(s);
+			continue;
+		}
+		before = (double)NSEC_PER_SEC * s->train / (double)s->interval;
+		s->interval *= 2;
+		s->burst_until = now + BURST_HOLD;
+		burst_pps -= before / 2;
+	}
+}
+
+/**
+ * Move the deadline of session 's' earlier, to 'next', and restore the
+ * heap order above it
+ */
+static void client_sched_earlier(struct msess *s, ts_t next) {
+	if (s->heap < 0 || s->heap >= sched_len || sched[s->heap] != s)
+		return;
+	s->next = next;
+	client_sched_up(s->heap);
+	if (s->snap != NULL)
+		s->snap->next = s->next;
+}
+
+/**
+ * Add a measurement session to the deadline heap
+ *
+ * \param[in] s The measurement session, with 'next' set
+ * \return      0 on success, -1 on error
+ */
+static int client_sched_insert(struct msess *s) {
+	struct msess **tmp;
+	int i;
+
+	if (sched_len == sched_size) {
+		tmp = realloc(sched, (sched_size * 2 + 16) * sizeof *sched);
+		if (tmp == NULL) {
+			syslog(LOG_ERR, "client: realloc: %s", strerror(errno));
+			return -1;
+		}
+		sched = tmp;
+		sched_size = sched_size * 2 + 16;
+	}
+	i = sched_len++;
+	sched[i] = s;
+	client_sched_up(i);
+	return 0;
+}
+
+/**
+ * Restore the heap order above 'i', after its deadline was moved earlier
+ *
+ * \param[in] i Index in the heap of the session that was moved
+ */
+static void client_sched_up(int i) {
+	struct msess *s;
+
+	s = sched[i];
+	while (i > 0 && sched[(i - 1) / 2]->next > s->next) {
+		sched[i] = sched[(i - 1) / 2];
+		sched[i]->heap = i;
+		i = (i - 1) / 2;
+	}
+	sched[i] = s;
+	s->heap = i;
+}
+
+/**
+ * Restore the heap order below 'i', after its deadline was moved later
+ *
+ * \param[in] i Index in the heap of the session that was moved
+ */
+static void client_sched_down(int i) {
+	struct msess *s;
+	int c;
+
+	s = sched[i];
+	while ((c = 2 * i + 1) < sched_len) {
+		if (c + 1 < sched_len && sched[c + 1]->next < sched[c]->next)
+			c++;
+		if (sched[c]->next >= s->next)
+			break;
+		sched[i] = sched[c];
+		sched[i]->heap = i;
+		i = c;
+	}
+	sched[i] = s;
+	s->heap = i;
+}
+
+/**
+ * Set the heap index of every session, after sched[] was sorted
+ */
+static void client_sched_index(void) {
+	int i;
+
+	for (i = 0; i < sched_len; i++)
+		sched[i]->heap = i;
+}
+
+/**
+ * Spread the first deadline of the sessions evenly across their interval
+ *
+ * Sessions with the same interval would otherwise all be sent at the
+ * same time, in a burst of PINGs, TX timestamps and FIFO records that
+ * pollutes our own RTTs. The n sessions that share an interval get the
+ * phase offsets 0, 1/n, ... (n-1)/n of the interval, in order of ID, so
+ * the schedule is the same after every reload. A sorted array is also
+ * a valid heap.
+ *
+ * If the session snapshot is enabled (see snap.c), sessions found in it
+ * continue their sequence numbers, and, if the interval is unchanged,
+ * their phase, from before the reload or restart.
+ *
+ * \param[in] now Current monotonic time, the first deadline
+ */
+static void client_sched_spread(ts_t now) {
+	struct snap_rec *recs, rec;
+	struct msess *s;
+	int i, j, k;
+
+	qsort(sched, (size_t)sched_len, sizeof *sched, client_sched_cmp_interval);
+	for (i = 0; i < sched_len; i = j) {
+		for (j = i; j < sched_len; j++)
+			if (sched[j]->interval != sched[i]->interval)
+				break;
+		for (k = i; k < j; k++)
+			sched[k]->next = now + sched[i]->interval * (k - i) / (j - i);
+	}
+	recs = snap_resize(sched_len);
+	for (i = 0; i < sched_len; i++) {
+		s = sched[i];
+		if (snap_find(s->id, &rec) == 0) {
+			s->last_seq = rec.last_seq;
+			if (rec.interval == s->interval)
+				s->next = now + ((rec.next - now) % s->interval +
+						s->interval) % s->interval;
+		}
+		if (recs == NULL)
+			continue;
+		s->snap = &recs[i];
+		s->snap->id = (uint32_t)s->id;
+		s->snap->last_seq = s->last_seq;
+		s->snap->interval = s->interval;
+		s->snap->next = s->next;
+	}
+	qsort(sched, (size_t)sched_len, sizeof *sched, client_sched_cmp_next);
+	client_sched_index();
+}
+
+/**
+ * qsort() comparison of sessions, on interval and then ID
+ */
+static int client_sched_cmp_interval(const void *a, const void *b) {
+	const struct msess *x = *(struct msess * const *)a;
+	const struct msess *y = *(struct msess * const *)b;
+
+	if (x->interval != y->interval)
+		return x->interval < y->interval ? -1 : 1;
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return 0;
+}
+
+/**
+ * qsort() comparison of sessions, on ID
+ */
+static int client_sched_cmp_id(const void *a, const void *b) {
+	const struct msess *x = *(struct msess * const *)a;
+	const struct msess *y = *(struct msess * const *)b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return 0;
+}
+
+/**
+ * qsort() comparison of sessions, on deadline
+ */
+static int client_sched_cmp_next(const void *a, const void *b) {
+	const struct msess *x = *(struct msess * const *)a;
+	const struct msess *y = *(struct msess * const *)b;
+
+	if (x->next != y->next)
+		return x->next < y->next ? -1 : 1;
+	return 0;
+}
+
 /**
  * Spawn client forks for all configured measurement sessions
  *
@@ -776,6 +1566,8 @@ void client_msess_forkall(int pipe) {
 	struct msess *s;
 
 	for (s = msess_head.lh_first; s != NULL; s = s->list.le_next) {
+		if (s->child_pid != 0)
+			continue;
 		/* Make sure there is no fork already running with
 		 * the same destination address */
 		if (client_msess_isaddrtaken(&s->dst, s->id) == 1) {
@@ -802,8 +1594,8 @@ void client_msess_forkall(int pipe) {
 
 int client_msess_reconf(char *port, char *cfgpath) {
 	int ok, ret = 0;
+	ts_t now;
 	struct msess *s, *s_tmp;
-	struct res *r, *r_tmp;
 	struct addrinfo /*@dependent@*/ dst_hints, *dst_addr;
 	xmlDoc *cfgdoc = 0;
 	xmlNode *root, *n, *k;
@@ -835,25 +1627,22 @@ int client_msess_reconf(char *port, char *cfgpath) {
 			if (kill(s->child_pid, SIGKILL) != 0)
 				syslog(LOG_ERR, "client: kill: %s", strerror(errno));
 		/* Kill all client results */
-		r = s->res_head.tqh_first;
-		while (r != NULL) {
-			r_tmp = r->list.tqe_next;
-			/*@ -branchstate -onlytrans TODO wtf */
-			TAILQ_REMOVE(&s->res_head, r, list);
-			/*@ +branchstate +onlytrans */
-			free(r);
-			r = r_tmp;
-		}
+		client_res_free(s);
 		s_tmp = s->list.le_next;
 		/*@ -branchstate -onlytrans TODO wtf */
 		LIST_REMOVE(s, list);
+		LIST_REMOVE(s, hash);
 		/*@ +branchstate +onlytrans */
 		free(s);
 		s = s_tmp;
 	}
 	/*@ -mustfreeonly -immediatetrans TODO wtf */
 	LIST_INIT(&msess_head);
+	LIST_INIT(&burst_head);
 	/*@ +mustfreeonly +immediatetrans */
+	burst_pps = 0;
+	sched_len = 0;
+	now = ts_monotonic();
 	/* Populate msess list from config */
 	for (n = root->children; n != NULL; n = n->next) {
 		/* Begin <probe> loop */
@@ -872,7 +1661,11 @@ int client_msess_reconf(char *port, char *cfgpath) {
 		memset(s, 0, sizeof *s);
 		s->id = (num_t)atoi((char *)c);
 		xmlFree(c);
-		s->msec_interval = 1000;
+		s->interval = NSEC_PER_SEC;
+		s->timeout = (ts_t)TIMEOUT * NSEC_PER_SEC;
+		s->next = now;
+		s->train = 1;
+		s->sock = -1;
 		ok = 0;
 		for (k = n->children; k != NULL; k = k->next) {
 			/* Begin <address/dscp/etc> loop */
@@ -881,9 +1674,12 @@ int client_msess_reconf(char *port, char *cfgpath) {
 			/*@ -mustfreefresh TODO Doesn't understand xmlFree */
 			c = xmlNodeGetContent(k);
 			/*@ +mustfreefresh */
-			/* Interval */
+			/* Interval, in microseconds */
 			if (strcmp((char *)k->name, "interval") == 0)
-				s->msec_interval = atoi((char *)c);
+				s->interval = (ts_t)atoll((char *)c) * 1000;
+			/* Timeout, in microseconds */
+			if (strcmp((char *)k->name, "timeout") == 0)
+				s->timeout = (ts_t)atoll((char *)c) * 1000;
 			/* Address */
 			if (strcmp((char *)k->name, "address") == 0) {
 				/* prepare for getaddrinfo */
@@ -904,13 +1700,43 @@ int client_msess_reconf(char *port, char *cfgpath) {
 			/* DSCP */
 			if (strcmp((char *)k->name, "dscp") == 0)
 				s->dscp = (uint8_t)atoi((char *)c);
+			/* PINGs per train */
+			if (strcmp((char *)k->name, "train") == 0)
+				s->train = atoi((char *)c);
+			/* Send on one interface, by name or by its address */
+			if (strcmp((char *)k->name, "interface") == 0 &&
+					(s->sock = iface_open((char *)c)) < 0)
+				s->sock = -2;
+			if (strcmp((char *)k->name, "source") == 0 &&
+					(s->sock = iface_by_addr((char *)c)) < 0)
+				s->sock = -2;
 			xmlFree(c);
 			/* End <address/dscp/etc> loop */
 		}
+		if (ok == 1 && s->interval < 1) {
+			syslog(LOG_ERR, "Probe %d: Invalid interval", (int)s->id);
+			ok = 0;
+		}
+		s->base_interval = s->interval;
+		if (ok == 1 && s->timeout < 1) {
+			syslog(LOG_ERR, "Probe %d: Invalid timeout", (int)s->id);
+			ok = 0;
+		}
+		if (ok == 1 && (s->train < 1 || s->train > TRAIN_MAX)) {
+			syslog(LOG_ERR, "Probe %d: Invalid train", (int)s->id);
+			ok = 0;
+		}
+		if (ok == 1 && s->sock == -2) {
+			syslog(LOG_ERR, "Probe %d: Invalid interface", (int)s->id);
+			ok = 0;
+		}
+		if (ok == 1 && client_sched_insert(s) < 0)
+			ok = 0;
 		/*@ -mustfreeonly -immediatetrans TODO wtf */
 		if (ok == 1) {
 			TAILQ_INIT(&s->res_head);
 			LIST_INSERT_HEAD(&msess_head, s, list);
+			LIST_INSERT_HEAD(&msess_hash[s->id & (MSESS_HASH - 1)], s, hash);
 		} else {
 			free(s);
 		}
@@ -919,6 +1745,7 @@ int client_msess_reconf(char *port, char *cfgpath) {
 		/*@ -branchstate -mustfreefresh TODO wtf */
 	}
 	/*@ +branchstate */
+	client_sched_spread(now);
 	/*@ -compmempass -nullstate -mustfreefresh xmlFree */
 	xmlFreeDoc(cfgdoc);
 	return 0;
@@ -5,14 +5,45 @@
  * used and redistributed with our explicit permission.
  */ 
 
+/* Result states, of struct res_fifo */
+#define STATE_SUCCESS  1
+#define STATE_DS_ERR 2
+#define STATE_TS_ERR 3
+#define STATE_PONGLOSS 4
+#define STATE_TIMEOUT 5
+#define STATE_DUP 6
+
+/* Result record written to the daemon FIFO */
+struct res_fifo {
+	uint32_t id;
+	uint32_t seq;
+	uint32_t state;
+	uint32_t dispersion; /* T2 of the last minus the first PING of a train */
+	int64_t created; /* T1, nanoseconds since the epoch */
+	int64_t rtt; /* nanoseconds */
+};
+
 void client_init(void);
-void client_send_fork(int pipe);
 void client_res_fifo_or_die(char *fifopath);
 void client_res_update(addr_t *a, data_t *d, /*@null@*/ ts_t *ts, int dscp);
-void client_res_summary(/*@unused@*/ int sig);
+void client_res_summary(void);
+void client_res_quiet(int quiet);
+void client_res_report(void);
 void client_res_clear_timeouts(void);
-void client_msess_transmit(int s_udp, int sends);
+void client_write_fifo(struct res_fifo *r_fifo);
+void client_res_sink(/*@null@*/ void (*cb)(struct res_fifo *r, void *arg),
+		/*@null@*/ void *arg);
+void client_msess_transmit(int s_udp, ts_t now);
+ts_t client_msess_next(void);
+void client_pace(int pps);
+void client_burst(int pps);
+long client_msess_pps(void);
 void client_msess_forkall(int pipe);
 int client_msess_reconf(char *port, char *cfgpath);
-int client_msess_add(char *port, char *a, uint8_t dscp, int wait, num_t id);
+int client_msess_add(char *port, char *a, uint8_t dscp, ts_t interval,
+		num_t id);
+int client_msess_load(char *port, char *path, ts_t interval);
+int client_msess_remove(num_t id);
+int client_msess_modify(num_t id, uint8_t dscp, ts_t interval, ts_t timeout);
+int client_msess_train(num_t id, int n);
 int client_msess_gothello(addr_t *addr);
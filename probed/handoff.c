@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   handoff.c
+ * \brief  Pass the sockets of a running probed on to its successor
+ *
+ * Restarting probed re-binds the port, which drops the timestamp
+ * connection of every remote client, and they wait in client_fork()
+ * before connecting again. With handoff, a probed listens on a unix
+ * socket, and a new probed started with the same path connects to it
+ * instead of binding. The running one passes its UDP socket, its TCP
+ * listening socket, the TCP sockets of its peers and its session
+ * snapshot (see snap.c) as SCM_RIGHTS, and exits. PINGs that arrive
+ * meanwhile wait in the UDP socket, which is never closed.
+ *
+ * Messages are a struct handoff_msg, with 'n' descriptors attached:
+ * first the UDP, TCP and (optionally) snapshot descriptors, then the
+ * peers, HANDOFF_BATCH at a time, and last a message with none.
+ *
+ * The unix socket is created 0600, and both ends check with
+ * SO_PEERCRED that the other runs as the same user, before anything
+ * is passed; otherwise any local user could take the sockets, and stop
+ * us while at it.
+ */
+
+#define _GNU_SOURCE /* struct ucred */
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "probed.h"
+#include "util.h"
+#include "handoff.h"
+
+#define HANDOFF_MAGIC 0x4e534844
+/* Descriptors per message; the kernel allows at most 253 */
+#define HANDOFF_BATCH 64
+
+struct handoff_msg {
+	uint32_t magic;
+	uint32_t n; /* Descriptors attached */
+};
+
+/* Peer sockets received from our predecessor */
+static int *peer_fds = NULL;
+static int peer_n = 0;
+
+static int handoff_sendfds(int sock, int *fds, int n);
+static int handoff_recvfds(int sock, /*@out@*/ int *fds);
+static int handoff_addr(char *path, /*@out@*/ struct sockaddr_un *sun);
+static int handoff_peer_ok(int sock);
+
+/**
+ * Take over the sockets of a probed listening on 'path'
+ *
+ * \param[in]  path    Path of the unix socket
+ * \param[out] s_udp   The UDP (PING/PONG) socket
+ * \param[out] s_tcp   The TCP listening (timestamp) socket
+ * \param[out] snap_fd The session snapshot, or -1
+ * \return             0 if we took over, -1 if nobody was running
+ */
+int handoff_recv(char *path, int *s_udp, int *s_tcp, int *snap_fd) {
+	struct sockaddr_un sun;
+	int fds[HANDOFF_BATCH], *tmp;
+	int sock, n;
+
+	*snap_fd = -1;
+	if (handoff_addr(path, &sun) < 0)
+		return -1;
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock < 0) {
+		syslog(LOG_ERR, "handoff: socket: %s", strerror(errno));
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&sun, sizeof sun) < 0) {
+		syslog(LOG_INFO, "handoff: No probed running on %s", path);
+		(void)close(sock);
+		return -1;
+	}
+	if (handoff_peer_ok(sock) < 0) {
+		(void)close(sock);
+		return -1;
+	}
+	n = handoff_recvfds(sock, fds);
+	if (n < 2) {
+		syslog(LOG_ERR, "handoff: Invalid handoff from %s", path);
+		(void)close(sock);
+		return -1;
+	}
+	*s_udp = fds[0];
+	*s_tcp = fds[1];
+	if (n > 2)
+		*snap_fd = fds[2];
+	/* The PING filter of a PACKET_MMAP ring; see ring_filter_udp() */
+	(void)setsockopt(*s_udp, SOL_SOCKET, SO_DETACH_FILTER, &n, sizeof n);
+	/* Peers, until the empty message */
+	while ((n = handoff_recvfds(sock, fds)) > 0) {
+		tmp = realloc(peer_fds, (size_t)(peer_n + n) * sizeof *peer_fds);
+		if (tmp == NULL) {
+			while (n > 0)
+				(void)close(fds[--n]);
+			continue;
+		}
+		peer_fds = tmp;
+		memcpy(peer_fds + peer_n, fds, (size_t)n * sizeof *fds);
+		peer_n += n;
+	}
+	(void)close(sock);
+	syslog(LOG_INFO, "handoff: Took over from %s, with %d peers", path,
+			peer_n);
+	return 0;
+}
+
+/**
+ * The peer sockets received by handoff_recv()
+ *
+ * \param[out] fds Pointer to the array of file descriptors
+ * \return         Number of peer sockets
+ */
+int handoff_peers(int **fds) {
+	*fds = peer_fds;
+	return peer_n;
+}
+
+/**
+ * Listen for a successor on the unix socket 'path'
+ *
+ * \param[in] path Path of the unix socket
+ * \return         The listening socket, or -1 on error
+ */
+int handoff_listen(char *path) {
+	struct sockaddr_un sun;
+	mode_t mask;
+	int l, ret;
+
+	if (handoff_addr(path, &sun) < 0)
+		return -1;
+	l = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (l < 0) {
+		syslog(LOG_ERR, "handoff: socket: %s", strerror(errno));
+		return -1;
+	}
+	(void)unlink(path);
+	/* Not for other users to connect to */
+	mask = umask(0077);
+	ret = bind(l, (struct sockaddr *)&sun, sizeof sun);
+	(void)umask(mask);
+	if (ret < 0 || listen(l, 1) < 0) {
+		syslog(LOG_ERR, "handoff: %s: %s", path, strerror(errno));
+		(void)close(l);
+		return -1;
+	}
+	return l;
+}
+
+/**
+ * Accept a successor on 'l', and pass it our sockets
+ *
+ * \param[in] l       The listening socket from handoff_listen()
+ * \param[in] s_udp   The UDP (PING/PONG) socket
+ * \param[in] s_tcp   The TCP listening (timestamp) socket
+ * \param[in] snap_fd The session snapshot, or -1
+ * \param[in] fds     Peer sockets
+ * \param[in] n       Number of peer sockets
+ * \return            0 if the successor has our sockets, -1 on error
+ */
+int handoff_send(int l, int s_udp, int s_tcp, int snap_fd, int *fds, int n) {
+	int first[3];
+	int c, i, ret = 0;
+
+	c = accept(l, NULL, NULL);
+	if (c < 0) {
+		syslog(LOG_ERR, "handoff: accept: %s", strerror(errno));
+		return -1;
+	}
+	if (handoff_peer_ok(c) < 0) {
+		(void)close(c);
+		return -1;
+	}
+	first[0] = s_udp;
+	first[1] = s_tcp;
+	first[2] = snap_fd;
+	if (handoff_sendfds(c, first, snap_fd >= 0 ? 3 : 2) < 0)
+		ret = -1;
+	for (i = 0; ret == 0 && i < n; i += HANDOFF_BATCH)
+		if (handoff_sendfds(c, fds + i, MIN(n - i, HANDOFF_BATCH)) < 0)
+			ret = -1;
+	if (ret == 0 && handoff_sendfds(c, NULL, 0) < 0)
+		ret = -1;
+	(void)close(c);
+	return ret;
+}
+
+/**
+ * Send one message, with 'n' descriptors attached
+ */
+static int handoff_sendfds(int sock, int *fds, int n) {
+	struct handoff_msg hm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char ctrl[CMSG_SPACE(HANDOFF_BATCH * sizeof (int))];
+
+	hm.magic = HANDOFF_MAGIC;
+	hm.n = (uint32_t)n;
+	iov.iov_base = &hm;
+	iov.iov_len = sizeof hm;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n > 0) {
+		msg.msg_control = ctrl;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof (int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof (int));
+		memcpy(CMSG_DATA(cmsg), fds, n * sizeof (int));
+	}
+	if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof hm) {
+		syslog(LOG_ERR, "handoff: sendmsg: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Receive one message, and its descriptors
+ *
+ * \return Number of descriptors, or -1 on error
+ */
+static int handoff_recvfds(int sock, int *fds) {
+	struct handoff_msg hm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char ctrl[CMSG_SPACE(HANDOFF_BATCH * sizeof (int))];
+	int n = 0;
+
+	iov.iov_base = &hm;
+	iov.iov_len = sizeof hm;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof ctrl;
+	if (recvmsg(sock, &msg, 0) != (ssize_t)sizeof hm ||
+			hm.magic != HANDOFF_MAGIC)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int));
+			memcpy(fds, CMSG_DATA(cmsg), n * sizeof (int));
+		}
+	if (n != (int)hm.n) {
+		while (n > 0)
+			(void)close(fds[--n]);
+		return -1;
+	}
+	return n;
+}
+
+/**
+ * Fill in the unix socket address of 'path'
+ */
+static int handoff_addr(char *path, struct sockaddr_un *sun) {
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun->sun_path) {
+		syslog(LOG_ERR, "handoff: %s: Path too long", path);
+		return -1;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+/**
+ * Check that the other end of 'sock' runs as our (effective) user
+ *
+ * \return 0 if it does, -1 if not
+ */
+static int handoff_peer_ok(int sock) {
+	struct ucred cred;
+	socklen_t len = (socklen_t)sizeof cred;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		syslog(LOG_ERR, "handoff: SO_PEERCRED: %s", strerror(errno));
+		return -1;
+	}
+	if (cred.uid != geteuid()) {
+		syslog(LOG_ERR, "handoff: Refused pid %d of uid %d",
+				(int)cred.pid, (int)cred.uid);
+		return -1;
+	}
+	return 0;
+}
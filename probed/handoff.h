@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+int handoff_recv(char *path, /*@out@*/ int *s_udp, /*@out@*/ int *s_tcp,
+		/*@out@*/ int *snap_fd);
+int handoff_peers(/*@out@*/ int **fds);
+int handoff_listen(char *path);
+int handoff_send(int l, int s_udp, int s_tcp, int snap_fd, int *fds, int n);
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   hist.c
+ * \brief  Log-linear histograms, for RTT percentiles
+ *
+ * Adding a value is a bit scan and an increment, so it can be done for
+ * every PONG at any rate, and percentiles are read by walking the
+ * buckets. The bucket index is the position of the highest bit of the
+ * value, and the HIST_SUB_BITS - 1 bits below it.
+ */
+
+#include <string.h>
+#include "probed.h"
+#include "util.h"
+#include "hist.h"
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+
+static int hist_index(ts_t v);
+static ts_t hist_value(int i);
+
+/**
+ * Empty histogram 'h'
+ */
+void hist_clear(struct hist *h) {
+	memset(h, 0, sizeof *h);
+}
+
+/**
+ * Add value 'v' to histogram 'h'; negative values count as 0
+ */
+void hist_add(struct hist *h, ts_t v) {
+	v = MAX(v, 0);
+	h->count[hist_index(v)]++;
+	h->n++;
+	h->max = MAX(h->max, v);
+}
+
+/**
+ * The value at percentile 'pct' of histogram 'h'
+ *
+ * \param[in] h   The histogram
+ * \param[in] pct Percentile, 0 to 100
+ * \return        The middle of the bucket, or 0 if empty
+ */
+ts_t hist_percentile(struct hist *h, double pct) {
+	uint64_t rank, sum = 0;
+	int i;
+
+	if (h->n == 0)
+		return 0;
+	rank = (uint64_t)(pct / 100 * (double)h->n + 0.5);
+	rank = MIN(MAX(rank, 1), h->n);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum >= rank)
+			return MIN((hist_value(i) + hist_value(i + 1)) / 2, h->max);
+	}
+	return h->max;
+}
+
+/**
+ * The bucket of value 'v'
+ */
+static int hist_index(ts_t v) {
+	int msb, shift;
+
+	if (v < HIST_SUB)
+		return (int)v;
+	msb = 63 - __builtin_clzll((unsigned long long)v);
+	shift = msb - (HIST_SUB_BITS - 1);
+	if (msb >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+	return HIST_SUB + (shift - 1) * HIST_HALF +
+		(int)((v >> shift) - HIST_HALF);
+}
+
+/**
+ * The lowest value of bucket 'i'
+ */
+static ts_t hist_value(int i) {
+	int shift;
+
+	if (i < HIST_SUB)
+		return (ts_t)i;
+	shift = (i - HIST_SUB) / HIST_HALF + 1;
+	return (ts_t)((i - HIST_SUB) % HIST_HALF + HIST_HALF) << shift;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/* Values below 2^HIST_SUB_BITS have a bucket each; above, every power
+ * of two is split in 2^(HIST_SUB_BITS - 1) buckets, up to 2^HIST_MAX_BITS */
+#define HIST_SUB_BITS 7
+#define HIST_MAX_BITS 41
+#define HIST_BUCKETS ((1 << HIST_SUB_BITS) + \
+		(HIST_MAX_BITS - HIST_SUB_BITS) * (1 << (HIST_SUB_BITS - 1)))
+
+/* Histogram of nanosecond values, with a relative error below 1.6% */
+struct hist {
+	uint32_t count[HIST_BUCKETS];
+	uint64_t n;
+	ts_t max;
+};
+
+void hist_clear(/*@out@*/ struct hist *h);
+void hist_add(struct hist *h, ts_t v);
+ts_t hist_percentile(struct hist *h, double pct);
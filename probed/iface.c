@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   iface.c
+ * \brief  Per-interface UDP sockets, for multi-homed probes
+ *
+ * The UDP socket of bind_or_die() sends through whichever interface
+ * the routing table picks, and hardware timestamps are enabled on one
+ * NIC only. A probe with several uplinks needs to measure each of
+ * them, with the timestamps of its own NIC. For that, each interface
+ * in use gets a socket of its own, bound to the PING port with
+ * SO_BINDTODEVICE (see bind_udp_iface()), with the timestamping of the
+ * main socket, and in hardware mode, its NIC set up with SIOCSHWTSTAMP.
+ *
+ * Sockets are opened when first asked for, by the measurement sessions
+ * (<interface> and <source> in the XML), or up front for the list of
+ * interfaces given with -i. They are never closed; the main loop waits
+ * on all of them. A PING that arrives on an interface that has a
+ * socket is read from that socket, and answered on it, so the PONG
+ * leaves the way the PING came.
+ *
+ * A <source> gets a socket bound to that address too, as an interface
+ * may have several and SO_BINDTODEVICE does not pick one. The sockets
+ * share the port with the main one with SO_REUSEPORT (see
+ * udp_sockopts()), and each keeps the SO_RXQ_OVFL count it last saw,
+ * for drops_count().
+ */
+
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include "probed.h"
+#include "util.h"
+#include "net.h"
+#include "tstamp.h"
+#include "ring.h"
+#include "iface.h"
+
+/* Interface sockets, at most */
+#define IFACE_MAX 32
+
+static struct {
+	char name[IFNAMSIZ];
+	struct in6_addr src; /* Bound to, or in6addr_any */
+	int sock;
+	uint32_t drops; /* SO_RXQ_OVFL, last seen */
+} ifaces[IFACE_MAX];
+static int n_ifaces = 0;
+static int s_main = -1;
+static uint32_t main_drops = 0;
+static /*@null@*/ char *iface_port = NULL;
+
+static int iface_open_src(char *name, /*@null@*/ struct in6_addr *src);
+
+/**
+ * Allow interface sockets next to 's_udp', the main UDP socket
+ *
+ * \param[in] s_udp The socket of bind_or_die(), with its timestamping
+ *                  already set up
+ * \param[in] port  The port it is bound to
+ */
+void iface_init(int s_udp, char *port) {
+	s_main = s_udp;
+	iface_port = port;
+}
+
+/**
+ * The socket bound to interface 'name'; opened if there is none yet
+ *
+ * Not with the io_uring backend, which only sends on the main socket.
+ *
+ * \param[in] name The interface name, such as "eth1"
+ * \return         The socket, or -1 on error
+ */
+int iface_open(char *name) {
+	return iface_open_src(name, NULL);
+}
+
+/**
+ * The socket bound to interface 'name' and address 'src', see
+ * iface_open()
+ *
+ * \param[in] name The interface name
+ * \param[in] src  A local address of 'name', or NULL for any
+ * \return         The socket, or -1 on error
+ */
+static int iface_open_src(char *name, struct in6_addr *src) {
+	char addrstr[INET6_ADDRSTRLEN];
+	addr_t a;
+	int i, s;
+
+	if (src == NULL)
+		src = (struct in6_addr *)&in6addr_any;
+	for (i = 0; i < n_ifaces; i++)
+		if (strncmp(ifaces[i].name, name, sizeof ifaces[i].name) == 0 &&
+				memcmp(&ifaces[i].src, src, sizeof *src) == 0)
+			return ifaces[i].sock;
+	if (s_main < 0 || iface_port == NULL) {
+		syslog(LOG_ERR, "iface: %s: No interface sockets", name);
+		return -1;
+	}
+	if (cfg.uring >= 0) {
+		syslog(LOG_ERR, "iface: %s: Not with io_uring", name);
+		return -1;
+	}
+	if (n_ifaces == IFACE_MAX || strlen(name) >= sizeof ifaces[0].name) {
+		syslog(LOG_ERR, "iface: %s: Too many interfaces", name);
+		return -1;
+	}
+	s = bind_udp_iface(iface_port, name,
+			IN6_IS_ADDR_UNSPECIFIED(src) ? NULL : src);
+	if (s < 0)
+		return -1;
+	/* Same timestamps as the main socket, and if PINGs are read from
+	 * the PACKET_MMAP ring, not from this one either */
+	if (tstamp_mode_copy(s_main, s, name) < 0 ||
+			(cfg.ring >= 0 && ring_filter_udp(s) < 0)) {
+		syslog(LOG_ERR, "iface: %s: Unable to timestamp", name);
+		(void)close(s);
+		return -1;
+	}
+	strncpy(ifaces[n_ifaces].name, name, sizeof ifaces[0].name);
+	memcpy(&ifaces[n_ifaces].src, src, sizeof *src);
+	ifaces[n_ifaces].sock = s;
+	ifaces[n_ifaces].drops = 0;
+	n_ifaces++;
+	memset(&a, 0, sizeof a);
+	memcpy(&a.sin6_addr, src, sizeof a.sin6_addr);
+	if (IN6_IS_ADDR_UNSPECIFIED(src) || addr2str(&a, addrstr) < 0)
+		syslog(LOG_INFO, "iface: %s: Bound", name);
+	else
+		syslog(LOG_INFO, "iface: %s: Bound to %s", name, addrstr);
+	return s;
+}
+
+/**
+ * The socket of the interface that has address 'addr', bound to it,
+ * see iface_open()
+ *
+ * \param[in] addr A local address, such as "10.0.0.1" or "2001:db8::1"
+ * \return         The socket, or -1 on error
+ */
+int iface_by_addr(char *addr) {
+	struct addrinfo hints, *res;
+	struct ifaddrs *ifa, *i;
+	struct in6_addr want, have;
+	char name[IFNAMSIZ];
+
+	/* IPv4 addresses as v4-mapped, as everywhere else */
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = (AI_V4MAPPED | AI_NUMERICHOST);
+	if (getaddrinfo(addr, NULL, &hints, &res) != 0) {
+		syslog(LOG_ERR, "iface: %s: Invalid address", addr);
+		return -1;
+	}
+	memcpy(&want, &((addr_t *)res->ai_addr)->sin6_addr, sizeof want);
+	freeaddrinfo(res);
+	if (getifaddrs(&ifa) < 0) {
+		syslog(LOG_ERR, "getifaddrs: %s", strerror(errno));
+		return -1;
+	}
+	name[0] = '\0';
+	for (i = ifa; i != NULL; i = i->ifa_next) {
+		if (i->ifa_addr == NULL)
+			continue;
+		memset(&have, 0, sizeof have);
+		if (i->ifa_addr->sa_family == AF_INET) {
+			have.s6_addr[10] = 0xff;
+			have.s6_addr[11] = 0xff;
+			memcpy(&have.s6_addr[12],
+					&((struct sockaddr_in *)i->ifa_addr)->sin_addr, 4);
+		} else if (i->ifa_addr->sa_family == AF_INET6)
+			memcpy(&have, &((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr,
+					sizeof have);
+		else
+			continue;
+		if (memcmp(&have, &want, sizeof want) == 0) {
+			strncpy(name, i->ifa_name, sizeof name - 1);
+			name[sizeof name - 1] = '\0';
+			break;
+		}
+	}
+	freeifaddrs(ifa);
+	if (name[0] == '\0') {
+		syslog(LOG_ERR, "iface: %s: No such local address", addr);
+		return -1;
+	}
+	return iface_open_src(name, &want);
+}
+
+/**
+ * Number of interface sockets open
+ */
+int iface_count(void) {
+	return n_ifaces;
+}
+
+/**
+ * Interface socket number 'i', of iface_count()
+ */
+int iface_fd(int i) {
+	return ifaces[i].sock;
+}
+
+/**
+ * The SO_RXQ_OVFL count last seen on socket 'sock', for drops_count()
+ *
+ * \param[in] sock An interface socket, or any other for the main one
+ */
+uint32_t *iface_drops(int sock) {
+	int i;
+
+	for (i = 0; i < n_ifaces; i++)
+		if (ifaces[i].sock == sock)
+			return &ifaces[i].drops;
+	return &main_drops;
+}
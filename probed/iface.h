@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+void iface_init(int s_udp, char *port);
+int iface_open(char *name);
+int iface_by_addr(char *addr);
+int iface_count(void);
+int iface_fd(int i);
+uint32_t *iface_drops(int sock);
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   libprobed.c
+ * \brief  C API of the measurement engine, see libprobed.h
+ *
+ * The engine is everything but main.c; probed itself is main.c linked
+ * with libprobed.a. An embedding program calls probed_init(), adds its
+ * measurement sessions, and runs probed_step() from its own loop (or
+ * probed_run() in a thread of its own). Results are not written to
+ * the FIFO, but given to the result callback as they complete, and/or
+ * summed up per session and given to the aggregate callback at the end
+ * of every period.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "probed.h"
+#include "util.h"
+#include "tstamp.h"
+#include "client.h"
+#include "loop.h"
+#include "net.h"
+#include "log.h"
+#include "libprobed.h"
+
+struct config cfg;
+
+/* Results of one session in the current period */
+struct lib_agg {
+	struct probed_aggregate a;
+	int64_t rtt_sum;
+};
+
+static struct {
+	/*@null@*/ char *port;
+	/*@null@*/ probed_result_fn result_fn;
+	/*@null@*/ void *result_arg;
+	/*@null@*/ probed_aggregate_fn agg_fn;
+	/*@null@*/ void *agg_arg;
+	ts_t agg_period;
+	ts_t agg_next; /* End of the current period, monotonic */
+	ts_t agg_start; /* Start of the current period, CLOCK_REALTIME */
+	/*@null@*/ struct lib_agg *agg; /* Sorted on ID */
+	int nagg;
+} lib;
+
+static void lib_result(struct res_fifo *r_fifo, /*@unused@*/ void *arg);
+static /*@null@*/ struct lib_agg *lib_agg_find(uint32_t id, int add);
+static void lib_agg_flush(ts_t now);
+
+/**
+ * Start the engine on UDP/TCP 'port'
+ *
+ * Like probed, this exits if the port cannot be bound.
+ *
+ * \param[in] port  UDP and TCP port, both source and destination
+ * \param[in] ts    Timestamp mode
+ * \param[in] iface Network interface, for hardware timestamps
+ * \return          0 on success, -1 on error
+ */
+int probed_init(const char *port, enum probed_tsmode ts, const char *iface) {
+	int s_udp, s_tcp;
+
+	lib.port = strdup(port);
+	if (lib.port == NULL)
+		return -1;
+	/* Both server and client, as in DAEMON mode */
+	cfg.op = DAEMON;
+	cfg.fifo = -1;
+	cfg.ring = -1;
+	cfg.uring = -1;
+	cfg.handoff = -1;
+	cfg.bulk = -1;
+	cfg.backlog = BACKLOG;
+	(void)log_init();
+	bind_or_die(&s_udp, &s_tcp, lib.port, 0);
+	if (ts == PROBED_TS_HARDWARE) tstamp_mode_hardware(s_udp, (char *)iface);
+	if (ts == PROBED_TS_KERNEL) tstamp_mode_kernel(s_udp);
+	if (ts == PROBED_TS_USERLAND) tstamp_mode_userland(s_udp);
+	tstamp_backend_select();
+	client_init();
+	client_res_sink(lib_result, NULL);
+	loop_init(s_udp, s_tcp, lib.port, NULL);
+	return 0;
+}
+
+/**
+ * Add measurement session 'id', PINGing 'addr'
+ *
+ * \param[in] id       Measurement session ID, unique
+ * \param[in] addr     Host name or address of the responder
+ * \param[in] dscp     DiffServ Code Point
+ * \param[in] interval Probe interval [nanoseconds]
+ * \param[in] timeout  Probe timeout [nanoseconds]
+ * \return             0 on success, -1 on error
+ */
+int probed_session_add(uint32_t id, const char *addr, uint8_t dscp,
+		int64_t interval, int64_t timeout) {
+	if (lib.port == NULL)
+		return -1;
+	if (client_msess_add(lib.port, (char *)addr, dscp, interval, id) != 0)
+		return -1;
+	if (client_msess_modify(id, dscp, interval, timeout) != 0) {
+		(void)client_msess_remove(id);
+		return -1;
+	}
+	loop_forkall();
+	return 0;
+}
+
+/**
+ * Change the DSCP, interval and timeout of session 'id'; its sequence
+ * numbers continue
+ *
+ * \return 0 on success, -1 on error
+ */
+int probed_session_modify(uint32_t id, uint8_t dscp, int64_t interval,
+		int64_t timeout) {
+	return client_msess_modify(id, dscp, interval, timeout);
+}
+
+/**
+ * Send 'n' PINGs back to back at each interval of session 'id', for
+ * capacity and queueing estimates; the result that completes a train
+ * carries its dispersion
+ *
+ * \param[in] id Measurement session ID
+ * \param[in] n  PINGs per train, 1 to 64; 1 for single PINGs
+ * \return       0 on success, -1 on error
+ */
+int probed_session_train(uint32_t id, int n) {
+	return client_msess_train(id, n);
+}
+
+/**
+ * Remove session 'id'; its outstanding probes are dropped, and results
+ * not yet given to the aggregate callback are lost
+ *
+ * \return 0 on success, -1 if there is no such session
+ */
+int probed_session_remove(uint32_t id) {
+	struct lib_agg *g;
+
+	if (client_msess_remove(id) != 0)
+		return -1;
+	g = lib_agg_find(id, 0);
+	if (g != NULL) {
+		lib.nagg--;
+		memmove(g, g + 1, (size_t)(lib.agg + lib.nagg - g) * sizeof *g);
+	}
+	/* Other sessions to the same address may have used its fork */
+	loop_forkall();
+	return 0;
+}
+
+/**
+ * Give every result to 'fn' as it completes
+ *
+ * \param[in] fn  Result callback, or NULL to stop
+ * \param[in] arg Passed on to 'fn'
+ */
+void probed_result_cb(probed_result_fn fn, void *arg) {
+	lib.result_fn = fn;
+	lib.result_arg = arg;
+}
+
+/**
+ * Sum up the results of each session over 'period', and give them to
+ * 'fn' at the end of it; sessions without results are left out
+ *
+ * \param[in] fn     Aggregate callback, or NULL to stop
+ * \param[in] period Aggregation period [nanoseconds]
+ * \param[in] arg    Passed on to 'fn'
+ */
+void probed_aggregate_cb(probed_aggregate_fn fn, int64_t period, void *arg) {
+	lib.agg_fn = fn;
+	lib.agg_arg = arg;
+	lib.agg_period = MAX(period, TIMEOUT_INTERVAL);
+	lib.agg_next = ts_monotonic() + lib.agg_period;
+	lib.agg_start = ts_now();
+}
+
+/**
+ * Run the engine once; send due PINGs, and wait for and handle I/O
+ *
+ * \param[in] wait Longest time to wait [nanoseconds], 0 to poll, or -1
+ *                 to wait until the engine has something to do
+ * \return         0 on success, -1 on error
+ */
+int probed_step(int64_t wait) {
+	ts_t now;
+
+	if (lib.port == NULL)
+		return -1;
+	if (lib.agg_fn != NULL) {
+		now = ts_monotonic();
+		if (now >= lib.agg_next)
+			lib_agg_flush(now);
+		if (wait < 0 || wait > lib.agg_next - now)
+			wait = MAX(lib.agg_next - now, 0);
+	}
+	return loop_step(wait);
+}
+
+/**
+ * Run the engine forever
+ */
+void probed_run(void) {
+	while (1 == 1)
+		(void)probed_step(-1);
+}
+
+/**
+ * The result sink of the engine, see client_res_sink(); the states of
+ * libprobed.h are those of the FIFO
+ */
+static void lib_result(struct res_fifo *r_fifo, void *arg) {
+	struct probed_result r;
+	struct lib_agg *g;
+
+	if (lib.result_fn != NULL) {
+		r.id = r_fifo->id;
+		r.seq = r_fifo->seq;
+		r.state = r_fifo->state;
+		r.dispersion = r_fifo->dispersion;
+		r.created = r_fifo->created;
+		r.rtt = r_fifo->rtt;
+		lib.result_fn(&r, lib.result_arg);
+	}
+	if (lib.agg_fn == NULL)
+		return;
+	g = lib_agg_find(r_fifo->id, 1);
+	if (g == NULL)
+		return;
+	switch (r_fifo->state) {
+		case PROBED_SUCCESS:
+			if (g->a.ok == 0 || r_fifo->rtt < g->a.rtt_min)
+				g->a.rtt_min = r_fifo->rtt;
+			g->a.rtt_max = MAX(g->a.rtt_max, r_fifo->rtt);
+			g->rtt_sum += r_fifo->rtt;
+			g->a.ok++;
+			break;
+		case PROBED_PONGLOSS:
+		case PROBED_TIMEOUT:
+			g->a.lost++;
+			break;
+		case PROBED_DUP:
+			g->a.dups++;
+			break;
+		default:
+			g->a.errors++;
+	}
+}
+
+/**
+ * Find the aggregate of session 'id', and maybe add it
+ *
+ * \param[in] id  Measurement session ID
+ * \param[in] add Add it, if not found
+ * \return        The aggregate, or NULL
+ */
+static struct lib_agg *lib_agg_find(uint32_t id, int add) {
+	struct lib_agg *tmp;
+	int lo = 0, hi = lib.nagg, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (lib.agg[mid].a.id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < lib.nagg && lib.agg[lo].a.id == id)
+		return &lib.agg[lo];
+	if (add == 0)
+		return NULL;
+	tmp = realloc(lib.agg, (size_t)(lib.nagg + 1) * sizeof *tmp);
+	if (tmp == NULL)
+		return NULL;
+	lib.agg = tmp;
+	memmove(&lib.agg[lo + 1], &lib.agg[lo],
+			(size_t)(lib.nagg - lo) * sizeof *tmp);
+	lib.nagg++;
+	memset(&lib.agg[lo], 0, sizeof *tmp);
+	lib.agg[lo].a.id = id;
+	return &lib.agg[lo];
+}
+
+/**
+ * Give the aggregates of the period that ended to the callback, and
+ * start the next one
+ */
+static void lib_agg_flush(ts_t now) {
+	struct lib_agg *g;
+	uint32_t id;
+	ts_t end;
+	int i;
+
+	end = ts_now();
+	for (i = 0; i < lib.nagg; i++) {
+		g = &lib.agg[i];
+		if (g->a.ok + g->a.lost + g->a.errors + g->a.dups == 0)
+			continue;
+		g->a.rtt_avg = g->a.ok > 0 ? g->rtt_sum / g->a.ok : 0;
+		g->a.start = lib.agg_start;
+		g->a.end = end;
+		if (lib.agg_fn != NULL)
+			lib.agg_fn(&g->a, lib.agg_arg);
+		id = g->a.id;
+		memset(g, 0, sizeof *g);
+		g->a.id = id;
+	}
+	lib.agg_start = end;
+	/* On the same grid, skipping periods we missed */
+	lib.agg_next += ((now - lib.agg_next) / lib.agg_period + 1) *
+		lib.agg_period;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/*
+ * libprobed; the SLA-NG measurement engine, for embedding
+ *
+ * One engine per process. It both sends PINGs for its measurement
+ * sessions and answers the PINGs of others, on one UDP port. Results
+ * are delivered to callbacks, from within probed_step(). Client forks
+ * are used for the timestamp connections, so SIGCHLD is ignored.
+ *
+ * The callbacks may add, modify and remove sessions, the one of the
+ * result too, but not call probed_step() or probed_run().
+ */
+
+#include <stdint.h>
+
+enum probed_tsmode {
+	PROBED_TS_HARDWARE,
+	PROBED_TS_KERNEL,
+	PROBED_TS_USERLAND
+};
+
+/* Result states */
+#define PROBED_SUCCESS 1
+#define PROBED_DS_ERR 2 /* PONG had the wrong DSCP */
+#define PROBED_TS_ERR 3 /* Missing or invalid timestamps */
+#define PROBED_PONGLOSS 4 /* Timestamps, but no PONG */
+#define PROBED_TIMEOUT 5
+#define PROBED_DUP 6
+
+struct probed_result {
+	uint32_t id; /* Measurement session ID */
+	uint32_t seq;
+	uint32_t state;
+	uint32_t dispersion; /* T2 of the last minus the first PING of a train,
+	                        nanoseconds; see probed_session_train() */
+	int64_t created; /* T1, nanoseconds since the epoch */
+	int64_t rtt; /* nanoseconds */
+};
+
+/* Results of one measurement session, over one period */
+struct probed_aggregate {
+	uint32_t id;
+	uint32_t ok;
+	uint32_t lost; /* Timeouts and lost PONGs */
+	uint32_t errors; /* DSCP and timestamp errors */
+	uint32_t dups;
+	int64_t rtt_min, rtt_avg, rtt_max; /* Of 'ok', nanoseconds */
+	int64_t start, end; /* The period, nanoseconds since the epoch */
+};
+
+typedef void (*probed_result_fn)(const struct probed_result *r, void *arg);
+typedef void (*probed_aggregate_fn)(const struct probed_aggregate *a,
+		void *arg);
+
+int probed_init(const char *port, enum probed_tsmode ts, const char *iface);
+int probed_session_add(uint32_t id, const char *addr, uint8_t dscp,
+		int64_t interval, int64_t timeout);
+int probed_session_modify(uint32_t id, uint8_t dscp, int64_t interval,
+		int64_t timeout);
+int probed_session_train(uint32_t id, int n);
+int probed_session_remove(uint32_t id);
+void probed_result_cb(probed_result_fn fn, void *arg);
+void probed_aggregate_cb(probed_aggregate_fn fn, int64_t period, void *arg);
+int probed_step(int64_t wait);
+void probed_run(void);
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   log.c
+ * \brief  Asynchronous, rate limited logging for the measurement path
+ *
+ * syslog() may block, and when the network has problems, the same
+ * error is logged for every packet, stalling measurements exactly when
+ * they matter most. log_msg() formats the message into a slot of a
+ * lock-free ring, and a background thread writes the ring to syslog.
+ * Each message type is limited to LOG_RATE messages per second; the
+ * rest, and messages that do not fit in the ring, are counted, and the
+ * writer logs how many were suppressed. Startup and configuration
+ * messages still use syslog() directly.
+ *
+ * The ring is a bounded multi-producer queue (the reflector has many
+ * threads), where the sequence number of each slot tells whether it is
+ * free for the producer or ready for the writer.
+ *
+ * The caller still formats the message, with vsnprintf() straight into
+ * the slot, as the arguments do not outlive the call; that is bounded
+ * by LOG_MSGLEN, and only paid within the rate. The clock of the rate
+ * limit is read by the writer, so the caller does not read one.
+ */
+
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "probed.h"
+#include "util.h"
+#include "log.h"
+
+/* Ring slots, a power of two */
+#define LOG_SLOTS 256
+#define LOG_MSGLEN 120
+/* Messages per second and type, before suppressing */
+#define LOG_RATE 10
+/* Writer sleep when the ring is empty [microseconds] */
+#define LOG_DRAIN_INTERVAL 10000
+
+struct log_slot {
+	unsigned long seq;
+	int prio;
+	char msg[LOG_MSGLEN];
+};
+
+static struct {
+	int on; /* Writer running, in this process */
+	unsigned long head; /* Next slot to fill */
+	unsigned long tail; /* Next slot to write; writer only */
+	struct log_slot slot[LOG_SLOTS];
+	ts_t clock; /* Monotonic time, as of the last writer round */
+	ts_t window[LOGT_MAX]; /* Start of the current rate second */
+	int count[LOGT_MAX]; /* Messages in the current rate second */
+	int suppressed[LOGT_MAX];
+} lr;
+
+static const char *log_names[LOGT_MAX] = {
+	"send", "tstamp", "dscp", "rtt", "socket"
+};
+
+static void *log_writer(/*@unused@*/ void *arg);
+static void log_atfork_child(void);
+
+/**
+ * Start the background writer
+ *
+ * Until this is called, and in forked children, log_msg() calls
+ * syslog() directly. Signals are blocked in the writer, so they are
+ * still delivered to the main loop.
+ *
+ * \return 0 on success, -1 on error
+ */
+int log_init(void) {
+	pthread_t thread;
+	sigset_t all, old;
+	unsigned long i;
+	int ret;
+
+	for (i = 0; i < LOG_SLOTS; i++)
+		lr.slot[i].seq = i;
+	lr.head = 0;
+	lr.tail = 0;
+	lr.clock = ts_monotonic();
+	(void)sigfillset(&all);
+	(void)pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, log_writer, NULL);
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		syslog(LOG_ERR, "log: pthread_create: %s", strerror(ret));
+		return -1;
+	}
+	(void)pthread_detach(thread);
+	(void)pthread_atfork(NULL, NULL, log_atfork_child);
+	__atomic_store_n(&lr.on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Log a message of 'type' without blocking
+ *
+ * \param[in] type Message type, for rate limiting
+ * \param[in] prio syslog priority
+ * \param[in] fmt  printf format, followed by its arguments
+ */
+void log_msg(enum logtype type, int prio, const char *fmt, ...) {
+	struct log_slot *sl;
+	unsigned long pos, seq;
+	va_list ap;
+	ts_t now, window;
+
+	va_start(ap, fmt);
+	if (__atomic_load_n(&lr.on, __ATOMIC_ACQUIRE) == 0) {
+		vsyslog(prio, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	/* Rate limit; racing threads may let a message or two extra by */
+	now = __atomic_load_n(&lr.clock, __ATOMIC_RELAXED);
+	window = __atomic_load_n(&lr.window[type], __ATOMIC_RELAXED);
+	if (now - window >= NSEC_PER_SEC &&
+			__atomic_compare_exchange_n(&lr.window[type], &window, now, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&lr.count[type], 0, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&lr.count[type], 1, __ATOMIC_RELAXED) > LOG_RATE) {
+		__atomic_add_fetch(&lr.suppressed[type], 1, __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
+	}
+	/* Claim a free slot */
+	pos = __atomic_load_n(&lr.head, __ATOMIC_RELAXED);
+	while (1 == 1) {
+		sl = &lr.slot[pos & (LOG_SLOTS - 1)];
+		seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&lr.head, &pos, pos + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			/* Full */
+			__atomic_add_fetch(&lr.suppressed[type], 1, __ATOMIC_RELAXED);
+			va_end(ap);
+			return;
+		} else
+			pos = __atomic_load_n(&lr.head, __ATOMIC_RELAXED);
+	}
+	sl->prio = prio;
+	(void)vsnprintf(sl->msg, sizeof sl->msg, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&sl->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Background thread, writing the ring and suppression counts to syslog
+ */
+static void *log_writer(void *arg) {
+	struct log_slot *sl;
+	ts_t now, last;
+	int i, n;
+
+	last = ts_monotonic();
+	while (1 == 1) {
+		while (1 == 1) {
+			sl = &lr.slot[lr.tail & (LOG_SLOTS - 1)];
+			if (__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) != lr.tail + 1)
+				break;
+			syslog(sl->prio, "%s", sl->msg);
+			__atomic_store_n(&sl->seq, lr.tail + LOG_SLOTS, __ATOMIC_RELEASE);
+			lr.tail++;
+		}
+		now = ts_monotonic();
+		__atomic_store_n(&lr.clock, now, __ATOMIC_RELAXED);
+		if (now - last >= NSEC_PER_SEC) {
+			last = now;
+			for (i = 0; i < LOGT_MAX; i++) {
+				n = __atomic_exchange_n(&lr.suppressed[i], 0, __ATOMIC_RELAXED);
+				if (n > 0)
+					syslog(LOG_INFO, "log: %s: %d messages suppressed",
+							log_names[i], n);
+			}
+		}
+		(void)usleep(LOG_DRAIN_INTERVAL);
+	}
+	/*@ -unreachable */
+	return NULL;
+	/*@ +unreachable */
+}
+
+/**
+ * The writer thread does not survive fork(); log directly in children
+ */
+static void log_atfork_child(void) {
+	lr.on = 0;
+}
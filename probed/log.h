@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/* Message types, each rate limited on its own */
+enum logtype {
+	LOGT_SEND,   /* PING/PONG send failures */
+	LOGT_TSTAMP, /* Missing RX/TX timestamps */
+	LOGT_DSCP,   /* Unreadable DSCP */
+	LOGT_RTT,    /* Negative or strange RTTs */
+	LOGT_SOCK,   /* select, accept, recv and pipe errors */
+	LOGT_MAX
+};
+
+int log_init(void);
+void log_msg(enum logtype type, int prio, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
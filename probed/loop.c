@@ -11,9 +11,9 @@
  * \author Anders Berggren <anders@halon.se>
  * \author Lukas Garberg <lukas@spritelink.net>
  * \date   2011-01-20
- * \bug    Only one 'probed' UDP timestmap socket can be used at a time
  */
 
+#define _GNU_SOURCE /* accept4() */
 #include <stdlib.h>
 #ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
 #include <unistd.h>
@@ -25,6 +25,8 @@
 #include <syslog.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/prctl.h>
 #include <sys/queue.h>
 #include "probed.h"
 #include "loop.h"
@@ -32,6 +34,21 @@
 #include "util.h"
 #include "net.h"
 #include "client.h"
+#include "ring.h"
+#include "uring.h"
+#include "log.h"
+#include "snap.h"
+#include "handoff.h"
+#include "bulk.h"
+#include "resp.h"
+#include "iface.h"
+#include "capture.h"
+#include "tstamp.h"
+
+/* PINGs read per wake-up of the UDP socket, before they are answered */
+#define PING_BATCH 64
+/* PINGs answered per loop_step(), before looking at the sockets again */
+#define PONG_BATCH 64
 
 struct server_peer {
 	addr_t addr;
@@ -39,9 +56,33 @@ struct server_peer {
 	LIST_ENTRY(server_peer) list;
 };
 static LIST_HEAD(peers_listhead, server_peer) peers_head;
+/* State of the main loop, between calls of loop_step() */
+static struct {
+	int s_udp, s_tcp;
+	char *port, *cfgpath;
+	fd_set fs;
+	int fd_max, fd_client_low;
+	int fd_client_pipe[2];
+	ts_t last_stats, next_stats, next_timeouts, next_sync, next_report;
+} lp;
+/* The current burst of connecting peers, such as after a restart */
+static struct {
+	ts_t first, last;
+	int n;
+} burst;
 
 static int server_find_peer_fd(addr_t *addr);
 static void server_kill_peer(fd_set *fs, int *fd_max, int fd);
+static void server_accept(int s_tcp, fd_set *fs, int *fd_max);
+static void server_converged(void);
+static void server_pong(int s_udp, addr_t *addr, uint8_t dscp, data_t *rx,
+		ts_t *t2, fd_set *fs, int *fd_max);
+static void server_serve(int s_udp, fd_set *fs, int *fd_max);
+static int loop_udp(int sock);
+static void loop_ifaces(void);
+static void loop_stats(ts_t delay);
+static void loop_handoff(int s_udp, int s_tcp);
+static void loop_uring_off(void);
 
 /**
  * Main SLA-NG 'probed' state machine, handling all client/server stuff
@@ -58,15 +99,30 @@ static void server_kill_peer(fd_set *fs, int *fd_max, int fd);
  * UDP pongs to a TCP timestamp client socket.
  *
  * CLIENT MODE                                                     \n
- *  loop: wait for time to send > send ping > save tstamp          \n
+ *  loop: wait for deadline > send due pings > save tstamp         \n
  *  loop: wait for pong > save tstamp                              \n
  *  loop: wait for pipe tstamp > save tstamp                       \n
  *  fork: connect > wait for TCP tstamp > write to pipe > wait...  \n
  *
  * SERVER MODE                                                     \n
- *  loop: wait for ping > send pong > find fd > send TCP tstamp    \n
+ *  loop: wait for pings > queue per peer > answer in turn:        \n
+ *        send pong > find fd > send TCP tstamp                    \n
  *  loop: wait for TCP connect > add to fd set > remove dead fds   \n
  *
+ * If a PACKET_MMAP ring is open (cfg.ring), server mode PINGs are read
+ * from the ring instead of the UDP socket, see ring.c. If the io_uring
+ * backend is active (cfg.uring), the UDP socket is served by uring.c,
+ * and we wait for its completion eventfd instead. PINGs are not
+ * answered as they are read, but queued per peer and answered in turn
+ * by server_serve(), see resp.c. If the throughput
+ * sink is open (cfg.bulk), its streams are counted by bulk_sink().
+ * Interfaces with a UDP socket of their own (see iface.c) are served
+ * like the main one, and PINGs are answered on the socket they came in.
+ *
+ * There is no timer tick; each measurement session has its own
+ * deadline (see client_msess_transmit), and pselect() sleeps until the
+ * earliest one, or the next timeout flush or statistics report.
+ *
  * \param[in] s_udp   Listening UDP socket to use for PING/PONG
  * \param[in] s_tcp   Listening TCP socket for client accept and TSTAMP
  * \param[in] port    client_msess_reconf's getaddrinfo needs the port
@@ -74,241 +130,582 @@ static void server_kill_peer(fd_set *fs, int *fd_max, int fd);
  * \bug       The 'first', not 'correct' TCP client socket will be used
  */
 void loop_or_die(int s_udp, int s_tcp, char *port, char *cfgpath) {
+	loop_init(s_udp, s_tcp, port, cfgpath);
+	/* Let's loop those sockets! */
+	while (1 == 1)
+		(void)loop_step(-1);
+}
+
+/**
+ * Prepare the main loop, see loop_or_die()
+ *
+ * Creates the pipe of the client forks, ignores SIGCHLD (the forks
+ * are never waited for), and starts the timers. loop_step() may be
+ * called after this.
+ *
+ * \param[in] s_udp   Listening UDP socket to use for PING/PONG
+ * \param[in] s_tcp   Listening TCP socket for client accept and TSTAMP
+ * \param[in] port    client_msess_reconf's getaddrinfo needs the port
+ * \param[in] cfgpath client_msess_reconf needs XML config, or NULL
+ */
+void loop_init(int s_udp, int s_tcp, char *port, char *cfgpath) {
 	struct server_peer *p;
-	char addrstr[INET6_ADDRSTRLEN];
-	char byte;
-	addr_t addr_tmp;
-	pkt_t pkt;
-	data_t *rx, tx;
-	ts_t ts, last_stats, now, tmp_ts;
-	fd_set fs_tmp;
-	int i, fd, fd_client_low, sends = 0, fd_max = 0;
-	fd_set fs;
 	socklen_t slen;
-	int fd_client_pipe[2];
-	int fd_send_pipe[2];
-	int ok = 1;
+	ts_t now;
+	int i, n, fd;
+	int *fds;
 
+	lp.s_udp = s_udp;
+	lp.s_tcp = s_tcp;
+	lp.port = port;
+	lp.cfgpath = cfgpath;
+	lp.fd_max = 0;
 	LIST_INIT(&peers_head);
 	/* IPC for children-to-parent (TCP client to UDP state machine) */
-	if (pipe(fd_client_pipe) < 0) {
+	if (pipe(lp.fd_client_pipe) < 0) {
 		syslog(LOG_ERR, "pipe: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	if (pipe(fd_send_pipe) < 0) {
-		syslog(LOG_ERR, "pipe: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	/* Do not react to SIGCHLD (when a client fork dies) */
+	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+		syslog(LOG_ERR, "signal: SIG_IGN on SIGCHLD failed");
+
+	/* Sub-millisecond intervals; do not let the kernel defer wake-ups */
+	if (prctl(PR_SET_TIMERSLACK, 1UL) < 0)
+		syslog(LOG_ERR, "prctl: %s; PR_SET_TIMERSLACK", strerror(errno));
+
+	/* Timers, on the monotonic clock */
+	now = ts_monotonic();
+	lp.last_stats = now;
+	lp.next_stats = now + STATS_INTERVAL;
+	lp.next_timeouts = now + TIMEOUT_INTERVAL;
+	lp.next_sync = now + SNAP_SYNC_INTERVAL;
+	lp.next_report = now + NSEC_PER_SEC;
+
+	/* Add both pipe, UDP and TCP to the FD set, note highest FD */
+	unix_fd_zero(&lp.fs);
+	if (cfg.uring >= 0) {
+		unix_fd_set(cfg.uring, &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, cfg.uring);
+	} else
+		unix_fd_set(s_udp, &lp.fs);
+	unix_fd_set(s_tcp, &lp.fs);
+	unix_fd_set(lp.fd_client_pipe[0], &lp.fs);
+	if (cfg.ring >= 0) {
+		unix_fd_set(cfg.ring, &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, cfg.ring);
+	}
+	lp.fd_max = MAX(lp.fd_max, s_udp);
+	lp.fd_max = MAX(lp.fd_max, s_tcp);
+	lp.fd_max = MAX(lp.fd_max, lp.fd_client_pipe[0]);
+	lp.fd_max = MAX(lp.fd_max, lp.fd_client_pipe[1]);
+	if (cfg.handoff >= 0) {
+		unix_fd_set(cfg.handoff, &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, cfg.handoff);
+	}
+	if (cfg.bulk >= 0) {
+		unix_fd_set(cfg.bulk, &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, cfg.bulk);
 	}
+	loop_ifaces();
+	lp.fd_client_low = lp.fd_max;
 
-	if (fcntl(fd_send_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
-		syslog(LOG_ERR, "fcntl: %s; fd_send_pipe[1]", strerror(errno));
-		exit(EXIT_FAILURE);
+	/* SERVER: peers handed over by our predecessor; they were opened
+	 * before the pipe, so move them up among the client FDs */
+	n = handoff_peers(&fds);
+	for (i = 0; i < n; i++) {
+		fd = fcntl(fds[i], F_DUPFD, lp.fd_client_low + 1);
+		(void)close(fds[i]);
+		if (fd < 0)
+			continue;
+		p = malloc(sizeof *p);
+		if (p == NULL) {
+			(void)close(fd);
+			continue;
+		}
+		p->fd = fd;
+		slen = (socklen_t)sizeof p->addr;
+		memset(&p->addr, 0, sizeof p->addr);
+		(void)getpeername(fd, (struct sockaddr *)&p->addr, &slen);
+		LIST_INSERT_HEAD(&peers_head, p, list);
+		unix_fd_set(fd, &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, fd);
 	}
+}
 
-	if (fcntl(fd_send_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
-		syslog(LOG_ERR, "fcntl: %s; fd_send_pipe[0]", strerror(errno));
-		exit(EXIT_FAILURE);
+/**
+ * Run the main loop once
+ *
+ * Sends the PINGs that are due, and handles the timers, then waits for
+ * I/O until the next deadline, but at most 'wait', and handles it.
+ *
+ * \param[in] wait Longest time to wait for I/O [nanoseconds], or -1
+ *                 to wait until the next deadline
+ * \return         0 on success, -1 on error
+ */
+int loop_step(ts_t wait) {
+	struct server_peer *p;
+	char addrstr[INET6_ADDRSTRLEN];
+	pkt_t pkt;
+	struct ring_pkt rp;
+	data_t *rx;
+	ts_t deadline, now;
+	struct timespec timeout;
+	fd_set fs_tmp;
+	int i, fd;
+	uint64_t completions;
+	int ok = 1;
+
+	/* CLIENT: summary and exit on Ctrl+C */
+	if (cfg.should_summarize == 1)
+		client_res_summary();
+	/* CLIENT: reload if requested */
+	if (cfg.should_reload == 1) {
+		cfg.should_reload = 0;
+		(void)client_msess_reconf(lp.port, lp.cfgpath);
+		loop_ifaces();
+		loop_forkall();
+	}
+	now = ts_monotonic();
+	/* CLIENT: clear timed out probes every now and then */
+	if (now >= lp.next_timeouts) {
+		client_res_clear_timeouts();
+		lp.next_timeouts = now + TIMEOUT_INTERVAL;
+	}
+	/* CLIENT: flush the session snapshot and the capture to disk */
+	if (now >= lp.next_sync) {
+		snap_sync();
+		capture_sync();
+		lp.next_sync = now + SNAP_SYNC_INTERVAL;
+	}
+	/* SERVER: report how long a burst of connecting peers took */
+	if (burst.n > 0 && now - burst.last >= CONVERGE_QUIET)
+		server_converged();
+	/* Log statistics */
+	if (now >= lp.next_stats) {
+		if (cfg.op == DAEMON)
+			loop_stats(now - lp.last_stats);
+		/* SERVER: peers that had PINGs shed */
+		resp_stats();
+		lp.last_stats = now;
+		lp.next_stats = now + STATS_INTERVAL;
+	}
+	/* CLIENT: summary line, every second */
+	if (cfg.op == CLIENT && now >= lp.next_report) {
+		client_res_report();
+		lp.next_report = MAX(lp.next_report + NSEC_PER_SEC, now);
+	}
+	/* CLIENT: send PINGs that are due */
+	client_msess_transmit(lp.s_udp, now);
+	/* SERVER: answer the PINGs read last time, peer by peer */
+	server_serve(lp.s_udp, &lp.fs, &lp.fd_max);
+	/* Sleep until the next deadline, or until there is I/O */
+	deadline = MIN(MIN(lp.next_timeouts, lp.next_stats), lp.next_sync);
+	if (cfg.op == CLIENT)
+		deadline = MIN(deadline, lp.next_report);
+	if (client_msess_next() >= 0)
+		deadline = MIN(deadline, client_msess_next());
+	now = ts_monotonic();
+	deadline = MAX(deadline - now, 0);
+	if (wait >= 0)
+		deadline = MIN(deadline, wait);
+	if (resp_pending() > 0)
+		deadline = 0;
+	timeout.tv_sec = (time_t)(deadline / NSEC_PER_SEC);
+	timeout.tv_nsec = (long)(deadline % NSEC_PER_SEC);
+	fs_tmp = lp.fs;
+	i = pselect(lp.fd_max + 1, &fs_tmp, NULL, NULL, &timeout, NULL);
+	if (i < 0 && errno != EINTR) {
+		log_msg(LOGT_SOCK, LOG_ERR, "select: %s", strerror(errno));
+		return -1;
 	}
+	if (i <= 0)
+		return 0;
+	ok = 0;
+	/* CLIENT/SERVER: UDP socket, that is PING and PONG */
+	if (unix_fd_isset(lp.s_udp, &fs_tmp) == 1)
+		ok = loop_udp(lp.s_udp);
+	/* CLIENT/SERVER: the same, on the sockets of single interfaces */
+	for (i = 0; i < iface_count(); i++)
+		if (unix_fd_isset(iface_fd(i), &fs_tmp) == 1) {
+			(void)loop_udp(iface_fd(i));
+			ok = 1;
+		}
+	/* CLIENT/SERVER: io_uring completions, PING and PONG */
+	if (cfg.uring >= 0 && unix_fd_isset(cfg.uring, &fs_tmp) == 1) {
+		ok = 1;
+		(void)read(cfg.uring, &completions, sizeof completions);
+		while (uring_recv(&pkt) == 0) {
+			rx = (data_t *)&pkt.data;
+			if (rx->type == TYPE_PING)
+				(void)resp_enqueue(-1, &pkt.addr, pkt.dscp, rx, &pkt.ts);
+			if (rx->type == TYPE_PONG)
+				client_res_update(&pkt.addr, rx, &pkt.ts, pkt.dscp);
+		}
+		uring_flush();
+		/* TCP timestamp sends that failed; dead peers */
+		while ((fd = uring_dead_fd()) >= 0)
+			for (p = peers_head.lh_first; p != NULL; p = p->list.le_next)
+				if (p->fd == fd) {
+					server_kill_peer(&lp.fs, &lp.fd_max, fd);
+					break;
+				}
+		if (uring_usable() == 0)
+			loop_uring_off();
+	}
+	/* SERVER: PACKET_MMAP ring, PINGs parsed in place */
+	if (cfg.ring >= 0 && unix_fd_isset(cfg.ring, &fs_tmp) == 1) {
+		ok = 1;
+		while (ring_next(&rp) == 0)
+			(void)resp_enqueue(-1, &rp.addr, rp.dscp, rp.data, &rp.ts);
+	}
+	/* SERVER: throughput streams, counted by the sink */
+	if (cfg.bulk >= 0 && unix_fd_isset(cfg.bulk, &fs_tmp) == 1) {
+		ok = 1;
+		bulk_sink(cfg.bulk);
+	}
+	/* SERVER: TCP socket, accept timestamp connections */
+	if (unix_fd_isset(lp.s_tcp, &fs_tmp) == 1) {
+		ok = 1;
+		server_accept(lp.s_tcp, &lp.fs, &lp.fd_max);
+	}
+	/* CLIENT: PIPE; timestamps from client_fork (TCP) */
+	if (unix_fd_isset(lp.fd_client_pipe[0], &fs_tmp) == 1) {
+		ok = 1;
+		if (read(lp.fd_client_pipe[0], &pkt, sizeof pkt) < 0) {
+			log_msg(LOGT_SOCK, LOG_ERR, "pipe: read: %s", strerror(errno));
+			ok = 0;
+		}
+		rx = (data_t *)&pkt.data;
+		if (ok == 1 && rx->type == TYPE_HELO) {
+			/* Connected to server, ready to feed it! */
+			if (client_msess_gothello(&pkt.addr) != 0)
+				syslog(LOG_INFO, "client: Unknown client connected");
+			if (addr2str(&pkt.addr, addrstr) == 0)
+				syslog(LOG_INFO, "client: %s: Connected", addrstr);
+		} else if (ok == 1 && rx->type == TYPE_TIME) {
+			rx = (data_t *)&pkt.data;
+			client_res_update(&pkt.addr, rx, NULL, -1);
+		}
+	}
+	/* Successor connected; hand over our sockets and exit */
+	if (cfg.handoff >= 0 && unix_fd_isset(cfg.handoff, &fs_tmp) == 1) {
+		ok = 1;
+		loop_handoff(lp.s_udp, lp.s_tcp);
+	}
+	/* It's a client. They shouldn't speak, it's probably a
+	 * disconnect. KILL IT. */
+	if (ok == 0) {
+		for (i = lp.fd_client_low; i <= lp.fd_max; i++) {
+			if (unix_fd_isset(i, &fs_tmp) == 1) {
+				server_kill_peer(&lp.fs, &lp.fd_max, i);
+			}
+		}
+	}
+	return 0;
+}
 
-	/* set last stats timer */
-	(void)clock_gettime(CLOCK_REALTIME, &last_stats);
+/**
+ * Start client forks for the measurement sessions that have none, after
+ * sessions were added or removed
+ */
+void loop_forkall(void) {
+	int i;
 
+	client_msess_forkall(lp.fd_client_pipe[1]);
+	/* PONGs (and in DAEMON mode, the PINGs of our peers, which
+	 * usually probe us back) arrive at about the rate we send */
+	sockbuf_size(lp.s_udp, client_msess_pps());
+	for (i = 0; i < iface_count(); i++)
+		sockbuf_size(iface_fd(i), client_msess_pps());
+}
 
-	/* Transmit timer */
-	client_send_fork(fd_send_pipe[1]);
+/**
+ * Read up to PING_BATCH packets from UDP socket 'sock'; PINGs are
+ * queued for their PONGs, and PONGs update the results
+ *
+ * \param[in] sock The main UDP socket, or one of an interface
+ * \return         1 if anything was read, otherwise 0
+ */
+static int loop_udp(int sock) {
+	pkt_t pkt;
+	data_t *rx;
+	int n;
 
-	/* Add both pipe, UDP and TCP to the FD set, note highest FD */
-	unix_fd_zero(&fs);
-	unix_fd_zero(&fs_tmp);
-	unix_fd_set(s_udp, &fs);
-	unix_fd_set(s_tcp, &fs);
-	unix_fd_set(s_tcp, &fs);
-	unix_fd_set(fd_client_pipe[0], &fs);
-	unix_fd_set(fd_send_pipe[0], &fs);
-	fd_max = MAX(fd_max, s_udp);
-	fd_max = MAX(fd_max, s_tcp);
-	fd_max = MAX(fd_max, fd_client_pipe[0]);
-	fd_max = MAX(fd_max, fd_client_pipe[1]);
-	fd_max = MAX(fd_max, fd_send_pipe[0]);
-	fd_max = MAX(fd_max, fd_send_pipe[1]);
-	fd_client_low = fd_max;
+	for (n = 0; n < PING_BATCH; n++) {
+		if (recv_w_ts(sock, 0, &pkt) < 0)
+			return n > 0 ? 1 : 0;
+		rx = (data_t *)&pkt.data;
+		/* SERVER: Queue for a UDP PONG, on the same socket */
+		if (rx->type == TYPE_PING)
+			(void)resp_enqueue(sock, &pkt.addr, pkt.dscp, rx, &pkt.ts);
+		/* CLIENT: Update results with received UDP PONG */
+		if (rx->type == TYPE_PONG)
+			client_res_update(&pkt.addr, rx, &pkt.ts, pkt.dscp);
+	}
+	return 1;
+}
 
-	/* Let's loop those sockets! */
-	while (1 == 1) {
-		fs_tmp = fs;
-		if (select(fd_max + 1, &fs_tmp, NULL, NULL, NULL) > 0) {
-			ok = 0;
-			/* CLIENT/SERVER: UDP socket, that is PING and PONG */
-			if (unix_fd_isset(s_udp, &fs_tmp) == 1) {
-				ok = 1;
-				if (recv_w_ts(s_udp, 0, &pkt) < 0)
-					ok = 0;
-				rx = (data_t *)&pkt.data;
-				/* SERVER: Send UDP PONG */
-				if (ok == 1 && rx->type == TYPE_PING) {
-					count_server_resp++;
-					tx.type = TYPE_PONG;
-					tx.id = rx->id;
-					tx.seq = rx->seq;
-					last_tx_id = rx->id;
-					last_tx_seq = rx->seq;
-					tx.t2 = pkt.ts;
-					(void)dscp_set(s_udp, pkt.dscp);
-					(void)send_w_ts(s_udp, &(pkt.addr), (char*)&tx, &ts);
-					/* Send TCP timestamp */
-					tx.type = TYPE_TIME;
-					tx.t3 = ts;
-					fd = server_find_peer_fd(&pkt.addr);
-					if (fd < 0) continue;
-					if (send(fd, (char*)&tx, DATALEN, 0) != DATALEN) {
-						server_kill_peer(&fs, &fd_max, fd);
-					}
-				}
-				/* CLIENT: Update results with received UDP PONG */
-				if (ok == 1 && rx->type == TYPE_PONG) {
-					client_res_update(&pkt.addr, rx, &pkt.ts, pkt.dscp);
-				}
-			}
-			/* SERVER: TCP socket, accept timestamp connection */
-			if (unix_fd_isset(s_tcp, &fs_tmp) == 1) {
-				ok = 1;
-				slen = (socklen_t)sizeof (addr_t);
-				memset(&addr_tmp, 0, sizeof addr_tmp);
-				fd = accept(s_tcp, (struct sockaddr *)&addr_tmp, &slen);
-				if (fd < 0) {
-					syslog(LOG_ERR, "accept: %s", strerror(errno));
-					ok = 0;
-				}
-				if (ok == 1 && addr2str(&addr_tmp, addrstr) == 0)
-					syslog(LOG_INFO, "server: %s: %d: Connected", addrstr, fd);
-				else
-					ok = 0;
-				if (ok == 1) {
-					/* Keep track of client's FD */
-					unix_fd_set(fd, &fs);
-					if (fd > fd_max)
-						fd_max = fd;
-					/* Send hello, feed me with PINGs */
-					memset(&tx, 0, sizeof tx);
-					tx.type = TYPE_HELO;
-					if (send(fd, (char*)&tx, DATALEN, 0) != DATALEN) {
-						server_kill_peer(&fs, &fd_max, fd);
-					}
-					p = malloc(sizeof *p);
-					if (p == NULL) return;
-					p->fd = fd;
-					memcpy(&p->addr, &addr_tmp, sizeof p->addr);
-					LIST_INSERT_HEAD(&peers_head, p, list);
-				}
-			}
-			/* CLIENT: PIPE; timestamps from client_fork (TCP) */
-			if (unix_fd_isset(fd_client_pipe[0], &fs_tmp) == 1) {
-				ok = 1;
-				if (read(fd_client_pipe[0], &pkt, sizeof pkt) < 0) {
-					syslog(LOG_ERR, "pipe: read: %s", strerror(errno));
-					ok = 0;
-				}
-				rx = (data_t *)&pkt.data;
-				if (ok == 1 && rx->type == TYPE_HELO) {
-					/* Connected to server, ready to feed it! */
-					if (client_msess_gothello(&pkt.addr) != 0)
-						syslog(LOG_INFO, "client: Unknown client connected");
-					if (addr2str(&pkt.addr, addrstr) == 0)
-						syslog(LOG_INFO, "client: %s: Connected", addrstr);
-				} else if (ok == 1 && rx->type == TYPE_TIME) {
-					rx = (data_t *)&pkt.data;
-					client_res_update(&pkt.addr, rx, NULL, -1);
-				}
-			}
-			/* CLIENT: PIPE; send */
-			if (unix_fd_isset(fd_send_pipe[0], &fs_tmp) == 1) {
+/**
+ * Add the interface sockets opened since last time to the FD set
+ */
+static void loop_ifaces(void) {
+	int i;
 
-				ok = 0;
+	for (i = 0; i < iface_count(); i++) {
+		unix_fd_set(iface_fd(i), &lp.fs);
+		lp.fd_max = MAX(lp.fd_max, iface_fd(i));
+	}
+}
 
-				/* Read pipe as long as we have data.
-				 * If the pipe hasn't been read for a while, we might have a
-				 * large number of messages here, but should only trigger
-				 * transmit function once...*/
-				while (read(fd_send_pipe[0], &byte, sizeof byte) > 0) {
-					ok++;
-				}
+/**
+ * Hand the UDP, TCP and peer sockets, and the session snapshot, over to
+ * the probed that connected to cfg.handoff, and exit
+ *
+ * PINGs that have not been read yet stay in the UDP socket, for the
+ * successor. Our own TCP client forks die with us (PR_SET_PDEATHSIG),
+ * and the successor forks new ones when it loads the configuration.
+ *
+ * \param[in] s_udp The UDP (PING/PONG) socket
+ * \param[in] s_tcp The TCP listening (timestamp) socket
+ */
+static void loop_handoff(int s_udp, int s_tcp) {
+	struct server_peer *p;
+	int *fds;
+	int n = 0;
 
-				/* Did we receive any message? */
-				if (ok > 0) {
-
-					/* Warn if we had more than one message queued */
-					if (ok > 1) {
-						syslog(LOG_ERR, "Found %d trigger messages queued",
-							ok);
-					}
-
-					/* trigger client packet transmission*/
-					client_msess_transmit(s_udp, sends);
-
-					/* reload if requested */
-					if (cfg.should_reload == 1) {
-						cfg.should_reload = 0;
-						(void)client_msess_reconf(port, cfgpath);
-						client_msess_forkall(fd_client_pipe[1]);
-					}
-
-					/* clear timed out probes every now and then */
-					if (sends % (TIMEOUT_INTERVAL/SEND_INTERVAL) == 0) {
-						client_res_clear_timeouts();
-					}
-
-					/* log statistics */
-					if (sends % 10000 == 0 &&
-							cfg.op == DAEMON) {
-
-						/* calculate time since last statistics report */
-						(void)clock_gettime(CLOCK_REALTIME, &now);
-						diff_ts(&tmp_ts, &now, &last_stats);
-						memcpy(&last_stats, &now, sizeof last_stats);
-						syslog(LOG_INFO, "stats_delay:        %d.%d",
-								(int)tmp_ts.tv_sec, (int)tmp_ts.tv_nsec);
-
-						syslog(LOG_INFO, "count_server_resp:  %d (pps*10)",
-								count_server_resp);
-						syslog(LOG_INFO, "count_client_sent:  %d (pps*10)",
-								count_client_sent);
-						syslog(LOG_INFO, "count_client_done:  %d (pps*10)",
-								count_client_done);
-						syslog(LOG_INFO, "count_client_find:  %d (1)",
-								count_client_find);
-						syslog(LOG_INFO, "count_client_fifoq: %d (0)",
-								count_client_fifoq);
-						syslog(LOG_INFO, "count_client_fqmax: %d (0)",
-								count_client_fifoq_max);
-						count_server_resp = 0;
-						count_client_sent = 0;
-						count_client_done = 0;
-					}
-
-					sends++;
-
-				} else {
-					syslog(LOG_ERR, "pipe: read: %s", strerror(errno));
-				}
+	for (p = peers_head.lh_first; p != NULL; p = p->list.le_next)
+		n++;
+	fds = malloc((size_t)MAX(n, 1) * sizeof *fds);
+	if (fds == NULL) {
+		syslog(LOG_ERR, "handoff: malloc: %s", strerror(errno));
+		return;
+	}
+	n = 0;
+	for (p = peers_head.lh_first; p != NULL; p = p->list.le_next)
+		fds[n++] = p->fd;
+	if (cfg.uring >= 0)
+		uring_flush();
+	snap_sync();
+	if (handoff_send(cfg.handoff, s_udp, s_tcp, snap_fd(), fds, n) == 0) {
+		syslog(LOG_INFO, "handoff: Handed over %d peers; exiting", n);
+		exit(EXIT_SUCCESS);
+	}
+	free(fds);
+}
 
-			}
-			/* It's a client. They shouldn't speak, it's probably a
-			 * disconnect. KILL IT. */
-			if (ok == 0) {
-				for (i = fd_client_low; i <= fd_max; i++) {
-					if (unix_fd_isset(i, &fs_tmp) == 1) {
-						server_kill_peer(&fs, &fd_max, i);
-					}
-				}
-			}
-		} else {
-			/* select() timeout */
-			syslog(LOG_ERR, "select: %s", strerror(errno));
+/**
+ * Go from io_uring back to socket I/O, if the ring stopped receiving
+ */
+static void loop_uring_off(void) {
+	unix_fd_clr(cfg.uring, &lp.fs);
+	uring_close();
+	cfg.uring = -1;
+	tstamp_backend_select();
+	unix_fd_set(lp.s_udp, &lp.fs);
+	lp.fd_max = MAX(lp.fd_max, lp.s_udp);
+	syslog(LOG_INFO, "Falling back to socket I/O");
+}
+
+/**
+ * Log and reset the statistics counters, in DAEMON mode
+ *
+ * \param[in] delay Time since the last report [nanoseconds]
+ */
+static void loop_stats(ts_t delay) {
+	static uint32_t last_drops = 0;
+
+	syslog(LOG_INFO, "stats_delay:        %d.%09d",
+			(int)(delay / NSEC_PER_SEC), (int)(delay % NSEC_PER_SEC));
+	syslog(LOG_INFO, "count_server_resp:  %d (pps*10)", count_server_resp);
+	syslog(LOG_INFO, "count_server_acpt:  %d (0)", count_server_accept);
+	syslog(LOG_INFO, "count_server_shed:  %d (0)", count_server_shed);
+	syslog(LOG_INFO, "count_server_nopr:  %d (0)", count_server_nopeer);
+	syslog(LOG_INFO, "count_client_sent:  %d (pps*10)", count_client_sent);
+	syslog(LOG_INFO, "count_client_skip:  %d (0)", count_client_skip);
+	syslog(LOG_INFO, "count_client_done:  %d (pps*10)", count_client_done);
+	syslog(LOG_INFO, "count_client_find:  %d (1)", count_client_find);
+	syslog(LOG_INFO, "count_client_fifoq: %d (0)", count_client_fifoq);
+	syslog(LOG_INFO, "count_client_fqmax: %d (0)", count_client_fifoq_max);
+	syslog(LOG_INFO, "count_sock_drops:   %u (0)",
+			(unsigned int)(count_sock_drops - last_drops));
+	if (cfg.ring >= 0)
+		syslog(LOG_INFO, "count_ring_drops:   %u (0)", ring_drops());
+	last_drops = count_sock_drops;
+	count_server_resp = 0;
+	count_server_accept = 0;
+	count_server_shed = 0;
+	count_server_nopeer = 0;
+	count_client_sent = 0;
+	count_client_skip = 0;
+	count_client_done = 0;
+}
+
+/**
+ * Answer a PING with a UDP PONG, and its timestamps over TCP
+ *
+ * The PONG carries T2 (PING RX timestamp), and the TCP timestamp
+ * message carries both T2 and T3 (PONG TX timestamp), sent on the
+ * timestamp connection of the peer, if it has one. With io_uring in
+ * userland mode, T3 is known up front, and both are queued as one
+ * linked send, submitted by uring_flush().
+ *
+ * \param[in]  s_udp  The UDP socket to send the PONG on
+ * \param[in]  addr   Pointer to the address of the PINGing peer
+ * \param[in]  dscp   The DSCP of the PING, which the PONG will use too
+ * \param[in]  rx     Pointer to the PING data
+ * \param[in]  t2     Pointer to the PING RX timestamp
+ * \param[out] fs     Pointer to file descriptor set, if peer dies
+ * \param[out] fd_max Pointer to the highest client file descriptor
+ */
+static void server_pong(int s_udp, addr_t *addr, uint8_t dscp, data_t *rx,
+		ts_t *t2, fd_set *fs, int *fd_max) {
+	data_t tx, tx_time;
+	ts_t ts;
+	int fd;
+
+	count_server_resp++;
+	memset(&tx, 0, sizeof tx);
+	tx.type = TYPE_PONG;
+	tx.id = rx->id;
+	tx.seq = rx->seq;
+	last_tx_id = rx->id;
+	last_tx_seq = rx->seq;
+	tx.t2 = *t2;
+	data_encode(&tx, rx->version);
+	(void)dscp_set(s_udp, dscp);
+	if (cfg.uring >= 0 && cfg.ts == USERLAND) {
+		tx_time = tx;
+		tx_time.type = TYPE_TIME;
+		tx_time.t2 = *t2;
+		tx_time.t3 = ts_now();
+		data_encode(&tx_time, rx->version);
+		(void)uring_send_linked(addr, (char*)&tx, server_find_peer_fd(addr),
+				(char*)&tx_time);
+		return;
+	}
+	(void)send_w_ts(s_udp, addr, (char*)&tx, &ts);
+	/* Send TCP timestamp, answering in the format of the PING */
+	tx.type = TYPE_TIME;
+	tx.t2 = *t2;
+	tx.t3 = ts;
+	data_encode(&tx, rx->version);
+	fd = server_find_peer_fd(addr);
+	if (fd < 0) return;
+	if (cfg.uring >= 0)
+		(void)uring_send_tcp(fd, (char*)&tx);
+	else if (send(fd, (char*)&tx, DATALEN, 0) != DATALEN)
+		server_kill_peer(fs, fd_max, fd);
+}
+
+/**
+ * Answer up to PONG_BATCH queued PINGs, taking one from each peer in
+ * turn, see resp.c
+ *
+ * \param[in]  s_udp  The UDP socket to send the PONGs on, unless the PING
+ *                    came in on an interface socket
+ * \param[out] fs     Pointer to file descriptor set, if a peer dies
+ * \param[out] fd_max Pointer to the highest client file descriptor
+ */
+static void server_serve(int s_udp, fd_set *fs, int *fd_max) {
+	pkt_t pkt;
+	int i, sock;
+
+	for (i = 0; i < PONG_BATCH; i++) {
+		if (resp_dequeue(&pkt, &sock) < 0)
+			break;
+		server_pong(sock >= 0 ? sock : s_udp, &pkt.addr, pkt.dscp, (data_t *)pkt.data, &pkt.ts,
+				fs, fd_max);
+	}
+	if (i > 0 && cfg.uring >= 0)
+		uring_flush();
+}
+
+/**
+ * Accept the timestamp connections waiting on 's_tcp'
+ *
+ * Connections are accepted until EAGAIN, or at most ACCEPT_BATCH per
+ * call, so that a reconnect storm drains the listen backlog quickly,
+ * without starving PINGs.
+ *
+ * \param[in]  s_tcp  The TCP listening (timestamp) socket, non-blocking
+ * \param[out] fs     Pointer to file descriptor set, to add peers to
+ * \param[out] fd_max Pointer to the highest client file descriptor
+ */
+static void server_accept(int s_tcp, fd_set *fs, int *fd_max) {
+	struct server_peer *p;
+	char addrstr[INET6_ADDRSTRLEN];
+	addr_t addr;
+	socklen_t slen;
+	data_t tx;
+	ts_t now;
+	int i, fd;
+
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		slen = (socklen_t)sizeof addr;
+		memset(&addr, 0, sizeof addr);
+		fd = accept4(s_tcp, (struct sockaddr *)&addr, &slen, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_msg(LOGT_SOCK, LOG_ERR, "accept: %s", strerror(errno));
+			return;
+		}
+		if (fd >= FD_SETSIZE) {
+			log_msg(LOGT_SOCK, LOG_ERR, "server: Too many peers");
+			(void)close(fd);
+			continue;
 		}
+		/* Send hello, feed me with PINGs */
+		memset(&tx, 0, sizeof tx);
+		tx.type = TYPE_HELO;
+		if (send(fd, (char*)&tx, DATALEN, 0) != DATALEN) {
+			(void)close(fd);
+			continue;
+		}
+		p = malloc(sizeof *p);
+		if (p == NULL) {
+			(void)close(fd);
+			continue;
+		}
+		/* Keep track of client's FD */
+		p->fd = fd;
+		memcpy(&p->addr, &addr, sizeof p->addr);
+		LIST_INSERT_HEAD(&peers_head, p, list);
+		unix_fd_set(fd, fs);
+		*fd_max = MAX(*fd_max, fd);
+		if (addr2str(&addr, addrstr) == 0)
+			log_msg(LOGT_SOCK, LOG_INFO, "server: %s: %d: Connected",
+					addrstr, fd);
+		/* Convergence of reconnects */
+		count_server_accept++;
+		now = ts_monotonic();
+		if (burst.n == 0)
+			burst.first = now;
+		burst.last = now;
+		burst.n++;
 	}
 }
 
+/**
+ * Log a burst of connecting peers, once it has been quiet for
+ * CONVERGE_QUIET; after a restart, the time until the last peer
+ * was back is how long the reconnects took to converge
+ */
+static void server_converged(void) {
+	struct server_peer *p;
+	ts_t t;
+	int n = 0;
+
+	for (p = peers_head.lh_first; p != NULL; p = p->list.le_next)
+		n++;
+	t = burst.last - burst.first;
+	syslog(LOG_INFO, "server: %d peers connected in %d.%03d s; %d peers",
+			burst.n, (int)(t / NSEC_PER_SEC),
+			(int)(t % NSEC_PER_SEC / 1000000), n);
+	burst.n = 0;
+}
+
 /**
  * The function mapping an address 'peer' to a socket file descriptor
  *
@@ -6,3 +6,6 @@
  */ 
 
 void loop_or_die(int s_udp, int s_tcp, char *port, char *cfgpath);
+void loop_init(int s_udp, int s_tcp, char *port, /*@null@*/ char *cfgpath);
+int loop_step(ts_t wait);
+void loop_forkall(void);
@@ -12,6 +12,7 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
 #include <syslog.h>
 #include "probed.h"
@@ -20,20 +21,31 @@
 #include "client.h"
 #include "loop.h"
 #include "net.h"
+#include "ring.h"
+#include "reflect.h"
+#include "uring.h"
+#include "log.h"
+#include "snap.h"
+#include "handoff.h"
+#include "bulk.h"
+#include "resp.h"
+#include "iface.h"
+#include "capture.h"
 
-struct config cfg;
 int main(int argc, char *argv[]);
 static void help_and_die(void);
 static void reload(/*@unused@*/ int sig);
+static void summarize(/*@unused@*/ int sig);
 
 /**
  * Sets default values, parses arguments, and start main loop. General
  * SLA-NG documentation is found for loop_or_die() in loop.c
  */
 int main(int argc, char *argv[]) {
-	int arg, s_udp, s_tcp, log;
+	int arg, s_udp, s_tcp, log, ring, threads, uring, snap_fd, bulk;
 	enum tsmode tstamp;
-	char *addr, *iface, *port, *cfgpath, *fifopath, *wait;
+	char *addr, *iface, *port, *cfgpath, *fifopath, *wait, *pps, *snappath;
+	char *handoffpath, *targets, *size, *burst, *ifaces, *name, *cappath;
 
 	/* Default settings */
 	cfgpath = "probed.conf";
@@ -45,12 +57,33 @@ int main(int argc, char *argv[]) {
 	addr = "";
 	fifopath = "";
 	wait = "500";
+	pps = "0";
+	burst = "0";
+	snappath = "";
+	cappath = "";
+	handoffpath = "";
+	targets = "";
+	size = "0";
+	bulk = 0;
+	ring = 0;
+	threads = 1;
+	uring = 0;
+	cfg.ring = -1;
+	cfg.uring = -1;
+	cfg.handoff = -1;
+	cfg.bulk = -1;
+	cfg.backlog = BACKLOG;
 	count_server_resp = 0;
+	count_server_accept = 0;
+	count_server_shed = 0;
+	count_server_nopeer = 0;
 	count_client_sent = 0;
+	count_client_skip = 0;
 	count_client_done = 0;
 	count_client_find = 0;
 	count_client_fifoq = 0;
 	count_client_fifoq_max = 0;
+	count_sock_drops = 0;
 
 	p(APP_AND_VERSION);
 	debug(0);
@@ -59,17 +92,33 @@ int main(int argc, char *argv[]) {
 	/*@ -branchstate OK that opcode. etc changes storage @*/
 	/*@ -unrecog OK that 'getopt' and 'optarg' is missing; SPlint bug */
 	/* +charintliteral OK to compare 'arg' (int) int with char @*/
-	while ((arg = getopt(argc, argv, "hqf:i:p:w:kusc:d:")) != -1) {
+	while ((arg = getopt(argc, argv, "hqngf:i:p:w:l:a:R:b:S:H:C:z:kumUsr:c:T:G:d:")) != -1) {
 		if (arg == (int)'h') help_and_die();
 		if (arg == (int)'?') exit(EXIT_FAILURE);
 		if (arg == (int)'q') log = 0;
+		if (arg == (int)'n') client_res_quiet(1);
 		if (arg == (int)'f') cfgpath = optarg;
 		if (arg == (int)'i') iface = optarg;
 		if (arg == (int)'p') port = optarg;
 		if (arg == (int)'w') wait = optarg;
+		if (arg == (int)'l') pps = optarg;
+		if (arg == (int)'a') burst = optarg;
+		if (arg == (int)'R') resp_limit(atoi(optarg));
+		if (arg == (int)'b') cfg.backlog = atoi(optarg);
+		if (arg == (int)'S') snappath = optarg;
+		if (arg == (int)'H') handoffpath = optarg;
+		if (arg == (int)'C') cappath = optarg;
+		if (arg == (int)'z') size = optarg;
+		if (arg == (int)'g') bulk = 1;
 		if (arg == (int)'k') tstamp = KERNEL;
 		if (arg == (int)'u') tstamp = USERLAND;
 		if (arg == (int)'s') cfg.op = SERVER;
+		if (arg == (int)'m') ring = 1;
+		if (arg == (int)'U') uring = 1;
+		if (arg == (int)'r') {
+			cfg.op = REFLECT;
+			threads = atoi(optarg);
+		}
 		if (arg == (int)'d') {
 			cfg.op = DAEMON;
 			fifopath = optarg;
@@ -78,16 +127,76 @@ int main(int argc, char *argv[]) {
 			cfg.op = CLIENT;
 			addr = optarg;
 		}
+		if (arg == (int)'G') {
+			cfg.op = BULK;
+			addr = optarg;
+		}
+		if (arg == (int)'T') {
+			cfg.op = CLIENT;
+			targets = optarg;
+		}
 	}
 	if (cfg.op == HELP) help_and_die();
 	/*@ +branchstate -charintliteral +unrecog @*/
+	/* -i eth0,eth1; hardware timestamps on the first, as with one, and
+	 * with more than one, a UDP socket for each, see iface.c */
+	ifaces = iface;
+	iface = strdup(ifaces);
+	if (iface == NULL)
+		exit(EXIT_FAILURE);
+	iface[strcspn(iface, ",")] = '\0';
 
 	/* Startup config, logging and sockets */
 	openlog("probed", log, LOG_USER);
-	bind_or_die(&s_udp, &s_tcp, port);
+	/* Measurement path errors are logged from a background thread */
+	(void)log_init();
+	if (cfg.op == REFLECT) {
+		/* Binds its own sockets, one pair per thread */
+		reflect_or_die(threads, port, tstamp, iface);
+		exit(EXIT_FAILURE);
+	}
+	if (cfg.op == BULK) {
+		/* Its own socket, on the port of the sink */
+		bulk_or_die(addr, port, atoi(size), atol(pps));
+		exit(EXIT_FAILURE);
+	}
+	/* Take over the sockets of a running probed, or bind our own */
+	snap_fd = -1;
+	if (strlen(handoffpath) == 0 || cfg.op == CLIENT ||
+			handoff_recv(handoffpath, &s_udp, &s_tcp, &snap_fd) < 0)
+		bind_or_die(&s_udp, &s_tcp, port, 0);
+	else if (listen(s_tcp, cfg.backlog) < 0) /* Our backlog */
+		syslog(LOG_ERR, "listen: %s", strerror(errno));
 	if (tstamp == HARDWARE) tstamp_mode_hardware(s_udp, iface);
 	if (tstamp == KERNEL) tstamp_mode_kernel(s_udp);
 	if (tstamp == USERLAND) tstamp_mode_userland(s_udp);
+	if (ring == 1 && cfg.op != CLIENT) {
+		cfg.ring = ring_open(port);
+		if (cfg.ring >= 0 && ring_filter_udp(s_udp) < 0) {
+			(void)close(cfg.ring);
+			cfg.ring = -1;
+		}
+		if (cfg.ring < 0)
+			syslog(LOG_INFO, "Falling back to receiving PINGs on socket");
+	}
+	if (uring == 1) {
+		cfg.uring = uring_open(s_udp);
+		if (cfg.uring < 0)
+			syslog(LOG_INFO, "Falling back to socket I/O");
+	}
+	tstamp_backend_select();
+	/* Sockets on single interfaces, with the timestamping of s_udp */
+	iface_init(s_udp, port);
+	if (strchr(ifaces, ',') != NULL)
+		for (name = strtok(ifaces, ","); name != NULL;
+				name = strtok(NULL, ","))
+			(void)iface_open(name);
+	/* Let our successor take over in turn */
+	if (strlen(handoffpath) > 0 && cfg.op != CLIENT)
+		cfg.handoff = handoff_listen(handoffpath);
+	/* Count the throughput streams of our peers */
+	if (bulk == 1 && cfg.op != CLIENT)
+		cfg.bulk = bulk_sink_open(port);
 
 	/* Start server, client or daemon */
 	if (cfg.op == SERVER) {
@@ -97,20 +206,41 @@ int main(int argc, char *argv[]) {
 	} else if (cfg.op == CLIENT) {
 		/* Create PING results array */
 		client_init();
-		/* Add one measurement session */
-		if (client_msess_add(port, addr, 0, atoi(wait), 0) != 0)
+		client_pace(atoi(pps));
+		client_burst(atoi(burst));
+		/* Add one measurement session, or one per target */
+		if (strlen(targets) > 0) {
+			if (client_msess_load(port, targets,
+					(ts_t)(strtod(wait, NULL) * 1000000)) < 1)
+				exit(EXIT_FAILURE);
+		} else if (client_msess_add(port, addr, 0,
+				(ts_t)(strtod(wait, NULL) * 1000000), 0) != 0)
 			exit(EXIT_FAILURE);
 		/* When loop_or_die starts, reload config (fork!) immediatelly */
 		cfg.should_reload = 1;
 		/* Print results on Ctrl+C */
-		(void)signal(SIGINT, client_res_summary);
+		(void)signal(SIGINT, summarize);
 		/* Launch */
 		loop_or_die(s_udp, s_tcp, port, cfgpath);
 	} else { /* Implicit cfg.op == DAEMON */
 		p("Daemon mode; both server and client, output to pipe");
 		/* Create PING results array and FIFO */
 		client_init();
+		client_pace(atoi(pps));
+		client_burst(atoi(burst));
 		client_res_fifo_or_die(fifopath);
+		/* Resume sequence numbers and phase from before a restart */
+		if (strlen(snappath) > 0)
+			(void)snap_open(snappath);
+		else if (snap_fd >= 0)
+			(void)snap_open_fd(snap_fd);
+		else if (cfg.handoff >= 0)
+			(void)snap_open_fd(-1);
+		if (snap_fd >= 0 && strlen(snappath) > 0)
+			(void)close(snap_fd);
+		/* Keep the results for replay, see sla-ng-replay */
+		if (strlen(cappath) > 0)
+			(void)capture_open(cappath);
 		/* Reload configuration on HUP */
 		(void)signal(SIGHUP, reload);
 		(void)signal(SIGALRM, reload);
@@ -130,20 +260,37 @@ int main(int argc, char *argv[]) {
  * Prints the CLI help message, when 'probed' is started without arguments
  */
 static void help_and_die(void) {
-	p("usage: probed [-kqsu] [-c addr] [-d path] [-i iface] [-p port] [-f path]");
+	p("usage: probed [-gkmnqsuU] [-c addr] [-T path] [-G addr] [-d path] [-r threads] [-i iface] [-p port] [-f path] [-l pps] [-a pps] [-R pps] [-b backlog] [-S path] [-H path] [-C path] [-z bytes]");
 	p("");
 	p("\t          MODES OF OPERATION");
 	p("\t-c addr   Client: PING 'addr', print to standard output");
+	p("\t-T path   Client: PING the targets in 'path' ('-' for stdin), one");
+	p("\t          'addr [interval_ms [dscp]]' per line, summary per target");
+	p("\t-G addr   Throughput: stream to the sink of 'addr', Ctrl-C for summary");
 	p("\t-s        Server: respond to PINGs");
 	p("\t-d path   Daemon: server and (many) clients, print to FIFO 'path'");
+	p("\t-r num    Reflector: respond to PINGs only, using 'num' threads");
 	p("");
 	p("\t          OPTIONS");
 	p("\t-f path   Daemon only, path to config file [default: probed.conf]");
-	p("\t-w time   Client only, wait time between PINGs [default 500] (ms)");
+	p("\t-S path   Daemon only, keep session state in 'path' across restarts");
+	p("\t-H path   Server/daemon, restart without dropping PINGs through 'path'");
+	p("\t-C path   Daemon only, also capture the results to 'path', for replay");
+	p("\t-w time   Client only, wait time between PINGs [default 500] (ms, e.g. 0.1)");
+	p("\t-n        Client only, print a summary line per second, not per PONG");
+	p("\t-l pps    Client/daemon/throughput, limit packets per second [default: off]");
+	p("\t-g        Server/daemon, count throughput streams on UDP port + 1");
+	p("\t-z bytes  Throughput only, datagram size [default: path MTU]");
+	p("\t-a pps    Client/daemon, extra PINGs per second for sessions seeing loss [default: off]");
+	p("\t-R pps    Server/daemon, answer at most 'pps' PINGs per second per peer [default: off]");
+	p("\t-b num    TCP listen backlog, for peers reconnecting at once [default: 4096]");
 	p("\t-i iface  Network interface for hardware timestamps [default: eth0]");
+	p("\t          or a list, 'eth0,eth1', for one UDP socket per interface");
 	p("\t-p port   UDP port, both source and destination [default: 60666]");
 	p("\t-k        Create timestamps in kernel driver instead of hardware");
 	p("\t-u        Create timestamps in userland instead of hardware");
+	p("\t-m        Server/daemon, read PINGs from mmap'd ring (needs root)");
+	p("\t-U        Use io_uring for UDP and timestamp I/O, if available");
 	p("\t-q        Be quiet, log to syslog only");
 	exit(EXIT_FAILURE);
 }
@@ -154,3 +301,10 @@ static void help_and_die(void) {
 static void reload(int sig) {
 	cfg.should_reload = 1;
 }
+
+/*
+ * Print the summary, from the main loop, and exit
+ */
+static void summarize(int sig) {
+	cfg.should_summarize = 1;
+}
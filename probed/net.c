@@ -13,17 +13,30 @@
  * \date   2010-12-01
  */
 
+#define _GNU_SOURCE /* sendmmsg() */
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <syslog.h>
 #include <netdb.h>
 #include "probed.h"
+#include "util.h"
 #include "tstamp.h"
+#include "uring.h"
 #include "net.h"
+#include "iface.h"
+#include "log.h"
 
-static int dscp_extract(struct msghdr *msg, /*@out@*/ uint8_t *dscp_out);
+/* Socket buffer space per packet, including kernel overhead [bytes] */
+#define SOCKBUF_PKT 1024
+/* Traffic the socket buffers should hold [milliseconds] */
+#define SOCKBUF_MSEC 100
+
+static void udp_sockopts(int s_udp);
+static int send_train_mmsg(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts, const int userland);
 
 /**
  * Receive on socket 'sock' into struct pkt with timestamp
@@ -79,16 +92,17 @@ int recv_w_ts(int sock, int flags, /*@out@*/ pkt_t *pkt) {
 			//printf("send: %d\n", d->seq);
 			//printf("tx2: %d\n", da[4]);
 			/* THIS IS A TX TIMESTAMP: store tx tstamp */
-			if (tstamp_extract(msg, &pkt->ts, 1) < 0)
+			if (tstamp_extract_tx(msg, &pkt->ts) < 0)
 				return -1;
 			return 0;
 		} else {
 			//printf("recv: %d\n", pkt->data[1]);
 			/* THIS IS NORMAL PACKET: store rx tstamp and DSCP */
-			if (tstamp_extract(msg, &pkt->ts, 0) < 0)
-				syslog(LOG_ERR, "recv_w_ts: RX tstamp error");
+			if (tstamp_extract_rx(msg, &pkt->ts) < 0)
+				log_msg(LOGT_TSTAMP, LOG_ERR, "recv_w_ts: RX tstamp error");
 			if (dscp_extract(msg, &pkt->dscp) < 0)
-				syslog(LOG_ERR, "recv_w_ts: DSCP error");
+				log_msg(LOGT_DSCP, LOG_ERR, "recv_w_ts: DSCP error");
+			drops_count(sock, msg);
 
 			return 0;
 		}
@@ -108,42 +122,148 @@ int recv_w_ts(int sock, int flags, /*@out@*/ pkt_t *pkt) {
  * \warning          This function only send DATALEN bytes
  * \bug              Will report TX timestamp error if sending data to other 
  *                   interface than the one SO_TIMESTAMPING is active on.
+ *
+ * send_w_ts is a pointer to the variant for the timestamp mode and I/O
+ * backend, chosen once by tstamp_backend_select(). This one is for
+ * userland timestamps, taken right before the send.
  */
+int (*send_w_ts)(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts) =
+	send_w_ts_userland;
 
-int send_w_ts(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts) {
+int send_w_ts_userland(int sock, addr_t *addr, char *data,
+		/*@out@*/ ts_t *ts) {
 	socklen_t slen;
-	
-	//printf("tx: %d\n", data[4]);
-	memset(ts, 0, sizeof *ts);
+
 	/* get userland tx timestamp (before send, hehe) */
-	if (cfg.ts == USERLAND)   
-		(void)clock_gettime(CLOCK_REALTIME, ts);
+	*ts = ts_now();
 	/* do the send */
 	slen = (socklen_t)sizeof *addr;
 	if (sendto(sock, data, DATALEN, 0, (struct sockaddr*)addr, slen) < 0) {
-		syslog(LOG_INFO, "sendto: %s", strerror(errno));
+		log_msg(LOGT_SEND, LOG_INFO, "sendto: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * send_w_ts() for kernel and hardware timestamps; waits for the TX
+ * timestamp on the error queue after sending
+ */
+int send_w_ts_kernel(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts) {
+	socklen_t slen;
+
+	*ts = 0;
+	/* do the send */
+	slen = (socklen_t)sizeof *addr;
+	if (sendto(sock, data, DATALEN, 0, (struct sockaddr*)addr, slen) < 0) {
+		log_msg(LOGT_SEND, LOG_INFO, "sendto: %s", strerror(errno));
 		return -1;
 	}
 	/* get kernel tx timestamp */
-	if (cfg.ts != USERLAND) { 
-		if (tstamp_fetch_tx(sock, ts) < 0) {
-			syslog(LOG_ERR, "send_w_ts: TX tstamp error");
-			return -1;
-		}
+	if (tstamp_fetch_tx(sock, ts) < 0) {
+		log_msg(LOGT_TSTAMP, LOG_ERR, "send_w_ts: TX tstamp error");
+		return -1;
 	}
 	return 0;
 }
 
+/**
+ * Send a train of 'n' PINGs to 'addr' back to back, with timestamps
+ *
+ * 'data' holds the 'n' payloads of DATALEN bytes after each other. On
+ * a socket, they go out in one sendmmsg(), so that the spacing of the
+ * train is that of the wire. In userland mode, every PING gets the
+ * timestamp taken before the batch; in kernel and hardware mode, the
+ * TX timestamps are read from the error queue afterwards, in order.
+ * With io_uring, each PING is queued with send_w_ts().
+ *
+ * \param[in]  sock The socket to send on
+ * \param[in]  addr Pointer to address where to send the train
+ * \param[in]  data Pointer to 'n' * DATALEN bytes of PING data
+ * \param[in]  n    Number of PINGs, at most TRAIN_MAX
+ * \param[out] ts   Array of 'n' TX timestamps, zero if missing
+ * \return          Number of PINGs sent, or -1 on error
+ *
+ * Like send_w_ts, send_train_w_ts points to the variant for the
+ * timestamp mode and I/O backend, chosen by tstamp_backend_select().
+ */
+int (*send_train_w_ts)(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts) = send_train_w_ts_userland;
+
+/**
+ * Send a train with send_w_ts(), one PING at a time; for io_uring
+ */
+int send_train_w_ts_each(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts) {
+	int i;
+
+	n = MIN(n, TRAIN_MAX);
+	memset(ts, 0, sizeof *ts * (size_t)n);
+	for (i = 0; i < n; i++)
+		if (send_w_ts(sock, addr, data + i * DATALEN, &ts[i]) < 0)
+			break;
+	return i;
+}
+
+int send_train_w_ts_userland(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts) {
+	return send_train_mmsg(sock, addr, data, n, ts, 1);
+}
+
+int send_train_w_ts_kernel(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts) {
+	return send_train_mmsg(sock, addr, data, n, ts, 0);
+}
+
+/**
+ * Send a train in one sendmmsg(); with a constant 'userland', inlined
+ * into one copy per mode
+ */
+static inline int send_train_mmsg(int sock, addr_t *addr, char *data,
+		int n, /*@out@*/ ts_t *ts, const int userland) {
+	struct mmsghdr msgs[TRAIN_MAX];
+	struct iovec iov[TRAIN_MAX];
+	ts_t t;
+	int i, sent;
+
+	n = MIN(n, TRAIN_MAX);
+	memset(ts, 0, sizeof *ts * (size_t)n);
+	memset(msgs, 0, sizeof *msgs * (size_t)n);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = data + i * DATALEN;
+		iov[i].iov_len = DATALEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = addr;
+		msgs[i].msg_hdr.msg_namelen = (socklen_t)sizeof *addr;
+	}
+	t = ts_now();
+	sent = sendmmsg(sock, msgs, (unsigned int)n, 0);
+	if (sent < 0) {
+		log_msg(LOGT_SEND, LOG_INFO, "sendmmsg: %s", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < sent; i++) {
+		if (userland)
+			ts[i] = t;
+		else if (tstamp_fetch_tx(sock, &ts[i]) < 0)
+			log_msg(LOGT_TSTAMP, LOG_ERR, "send_train_w_ts: TX tstamp error");
+	}
+	return sent;
+}
+
 /**
  * Bind two listening sockets, one UDP (ping/pong) and one TCP (timestamps)
  * 
- * \param[out] s_udp Pointer to UDP socket to create and bind
- * \param[out] s_tcp Pointer to TCP socket to create, bind and listen
- * \param[in]  port  The port number to use for binding
- * \warning          Should be run only once
+ * \param[out] s_udp     Pointer to UDP socket to create and bind
+ * \param[out] s_tcp     Pointer to TCP socket to create, bind and listen
+ * \param[in]  port      The port number to use for binding
+ * \param[in]  reuseport Set SO_REUSEPORT, to bind several socket pairs
+ * \warning              Should be run only once, unless 'reuseport'
  */
 
-void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port) {
+void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port,
+		int reuseport) {
 
 	int f = 0;
 	int ret = 0;
@@ -156,23 +276,7 @@ void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port) {
 		syslog(LOG_ERR, "socket: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	} 
-
-	/* Give us a dual-stack (ipv4/6) socket */
-	slen = (socklen_t)sizeof f;
-	if (setsockopt(*s_udp, IPPROTO_IPV6, IPV6_V6ONLY, &f, slen) < 0)
-		syslog(LOG_ERR, "setsockopt: IPV6_V6ONLY: %s", strerror(errno));
-
-	/* Enable reading of TOS & TTL on received packets */
-	f = 1;
-	if (setsockopt(*s_udp, IPPROTO_IP, IP_RECVTOS, &f, slen) < 0)
-		syslog(LOG_ERR, "setsockopt: IP_RECVTOS: %s", strerror(errno));
-	f = 60;
-	if (setsockopt(*s_udp, IPPROTO_IP, IP_RECVTTL, &f, slen) < 0)
-		syslog(LOG_ERR, "setsockopt: IP_RECVTTL: %s", strerror(errno));
-	f = 1;
-	if (setsockopt(*s_udp, IPPROTO_IPV6, IPV6_RECVTCLASS, &f, slen) < 0)
-		syslog(LOG_ERR, "setsockopt: IPV6_RECVTCLASS: %s",
-				strerror(errno));
+	udp_sockopts(*s_udp);
 
 	/* TCP socket */
 	*s_tcp = socket(PF_INET6, SOCK_STREAM, IPPROTO_TCP);
@@ -190,6 +294,14 @@ void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port) {
 	if (setsockopt(*s_tcp, SOL_SOCKET, SO_REUSEADDR, &f, slen) < 0)
 		syslog(LOG_ERR, "setsockopt: SO_REUSEADDR: %s",
 				strerror(errno));
+	if (reuseport == 1) {
+		if (setsockopt(*s_udp, SOL_SOCKET, SO_REUSEPORT, &f, slen) < 0 ||
+				setsockopt(*s_tcp, SOL_SOCKET, SO_REUSEPORT, &f, slen) < 0) {
+			syslog(LOG_ERR, "setsockopt: SO_REUSEPORT: %s",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	/* Prepare for binding ports */
 	syslog(LOG_INFO, "Binding port %s", port);
@@ -219,10 +331,100 @@ void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(*s_tcp, 10) == -1) {
+	if (listen(*s_tcp, cfg.backlog > 0 ? cfg.backlog : BACKLOG) == -1) {
 		syslog(LOG_ERR, "listen: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
+	/* Accept in batches, until EAGAIN */
+	if (fcntl(*s_tcp, F_SETFL, fcntl(*s_tcp, F_GETFL) | O_NONBLOCK) < 0)
+		syslog(LOG_ERR, "fcntl: O_NONBLOCK: %s", strerror(errno));
+}
+
+/**
+ * Dual-stack, and report the TOS, TTL and drops of received packets
+ */
+static void udp_sockopts(int s_udp) {
+	int f = 0;
+	socklen_t slen;
+
+	/* Give us a dual-stack (ipv4/6) socket */
+	slen = (socklen_t)sizeof f;
+	if (setsockopt(s_udp, IPPROTO_IPV6, IPV6_V6ONLY, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: IPV6_V6ONLY: %s", strerror(errno));
+
+	/* Enable reading of TOS & TTL on received packets */
+	f = 1;
+	if (setsockopt(s_udp, IPPROTO_IP, IP_RECVTOS, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: IP_RECVTOS: %s", strerror(errno));
+	f = 60;
+	if (setsockopt(s_udp, IPPROTO_IP, IP_RECVTTL, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: IP_RECVTTL: %s", strerror(errno));
+	f = 1;
+	if (setsockopt(s_udp, IPPROTO_IPV6, IPV6_RECVTCLASS, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: IPV6_RECVTCLASS: %s",
+				strerror(errno));
+	/* Tell us how many packets the receive buffer has dropped */
+	if (setsockopt(s_udp, SOL_SOCKET, SO_RXQ_OVFL, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: SO_RXQ_OVFL: %s", strerror(errno));
+	/* Interface sockets (bind_udp_iface) share the port with this one;
+	 * SO_REUSEPORT, unlike SO_REUSEADDR, only lets processes of the
+	 * same user bind it too */
+	if (setsockopt(s_udp, SOL_SOCKET, SO_REUSEPORT, &f, slen) < 0)
+		syslog(LOG_ERR, "setsockopt: SO_REUSEPORT: %s", strerror(errno));
+}
+
+/**
+ * Bind a UDP socket to 'port' on interface 'iface' only
+ *
+ * It has the same options as the UDP socket of bind_or_die(), and the
+ * same port. Packets that arrive on 'iface' are received on it, rather
+ * than on the socket of bind_or_die(), and packets sent on it leave
+ * through 'iface', whatever the routing table says. With 'src', it is
+ * bound to that address too, so that packets sent on it have it as
+ * their source, even if 'iface' has other addresses.
+ *
+ * \param[in] port  The port number to use for binding
+ * \param[in] iface The network interface
+ * \param[in] src   A local address of 'iface', or NULL for any
+ * \return          The socket, or -1 on error
+ */
+int bind_udp_iface(char *port, char *iface, struct in6_addr *src) {
+	struct addrinfo hints, *res;
+	int s, ret;
+
+	s = socket(PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (s < 0) {
+		syslog(LOG_ERR, "socket: %s", strerror(errno));
+		return -1;
+	}
+	udp_sockopts(s);
+	if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, iface,
+				(socklen_t)strlen(iface) + 1) < 0) {
+		syslog(LOG_ERR, "setsockopt: SO_BINDTODEVICE: %s: %s", iface,
+				strerror(errno));
+		(void)close(s);
+		return -1;
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_flags = (AI_V4MAPPED | AI_PASSIVE);
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(NULL, port, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "Unable to bind: %s", gai_strerror(ret));
+		(void)close(s);
+		return -1;
+	}
+	if (src != NULL)
+		memcpy(&((addr_t *)res->ai_addr)->sin6_addr, src, sizeof *src);
+	if (bind(s, res->ai_addr, res->ai_addrlen) < 0) {
+		syslog(LOG_ERR, "bind: %s: %s", iface, strerror(errno));
+		freeaddrinfo(res);
+		(void)close(s);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return s;
 }
 
 /**
@@ -236,6 +438,11 @@ int dscp_set(int sock, uint8_t dscp) {
 	socklen_t slen;
 	int tclass = 0;
 
+	/* io_uring sends DSCP as ancillary data instead */
+	if (cfg.uring >= 0) {
+		uring_dscp(dscp);
+		return 0;
+	}
 	/* Remove ECN */
 	dscp <<= 2;
 	/* IPv6 TCLASS */
@@ -263,7 +470,7 @@ int dscp_set(int sock, uint8_t dscp) {
  * \todo Find out if we need to check cmsg_len (as http://stackoverflow.com/questions/2881200/linux-can-recvmsg-be-used-to-receive-the-ip-tos-of-every-incoming-packet shows).
  * \todo Fix splint branchstate ignore
  */
-static int dscp_extract(struct msghdr *msg, /*@out@*/ uint8_t *dscp_out) {
+int dscp_extract(struct msghdr *msg, /*@out@*/ uint8_t *dscp_out) {
 
 	struct cmsghdr *cmsg;
 	int *ptr;
@@ -295,3 +502,97 @@ static int dscp_extract(struct msghdr *msg, /*@out@*/ uint8_t *dscp_out) {
 	/*@ +branchstate */
 	return -1;
 }
+
+/**
+ * Extracts the receive buffer drop counter from a packet.
+ *
+ * With SO_RXQ_OVFL, the kernel attaches the number of packets the socket
+ * has dropped so far, because its receive buffer was full, to packets
+ * received after the first drop.
+ *
+ * \param[in]  msg   Pointer to the message's header data.
+ * \param[out] drops Pointer to the counter, only written if present.
+ * \return Status; 0 if the counter was present, <0 if not.
+ */
+int drops_extract(struct msghdr *msg, /*@out@*/ uint32_t *drops) {
+	struct cmsghdr *cmsg;
+
+	/*@ -branchstate Don't care about cmsg storage */
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(drops, CMSG_DATA(cmsg), sizeof *drops);
+			return 0;
+		}
+	}
+	/*@ +branchstate */
+	return -1;
+}
+
+/**
+ * Add the receive buffer drops of socket 'sock' to count_sock_drops
+ *
+ * The counter of SO_RXQ_OVFL is cumulative, and per socket; only what
+ * it grew since the last packet of the same socket is added.
+ *
+ * \param[in] sock The socket 'msg' was read from
+ * \param[in] msg  Pointer to the message's header data.
+ */
+void drops_count(int sock, struct msghdr *msg) {
+	uint32_t drops, *last;
+
+	if (drops_extract(msg, &drops) < 0)
+		return;
+	last = iface_drops(sock);
+	count_sock_drops += drops - *last;
+	*last = drops;
+}
+
+/**
+ * Size the socket buffers for 'pps' packets per second.
+ *
+ * The buffers should hold SOCKBUF_MSEC worth of packets, so that a
+ * short stall of the main loop does not drop PONGs, or (in kernel and
+ * hardware mode) TX timestamps, which are queued in the receive buffer
+ * too. Buffers are only grown. SO_RCVBUFFORCE and SO_SNDBUFFORCE are
+ * tried first, since they may exceed net.core.rmem_max/wmem_max, but
+ * need CAP_NET_ADMIN.
+ *
+ * \param[in] sock Socket
+ * \param[in] pps  Expected packets per second, in each direction
+ */
+void sockbuf_size(int sock, long pps) {
+	int opt[2][2] = { { SO_RCVBUFFORCE, SO_RCVBUF },
+		{ SO_SNDBUFFORCE, SO_SNDBUF } };
+	const char *name[2] = { "SO_RCVBUF", "SO_SNDBUF" };
+	socklen_t slen;
+	long want;
+	int i, size, cur;
+
+	want = pps * SOCKBUF_MSEC / 1000 * SOCKBUF_PKT;
+	size = (int)MIN(want, 1 << 30);
+	for (i = 0; i < 2; i++) {
+		/* The kernel reports, and uses, twice the size we set */
+		slen = (socklen_t)sizeof cur;
+		if (getsockopt(sock, SOL_SOCKET, opt[i][1], &cur, &slen) < 0)
+			continue;
+		if (cur / 2 >= size)
+			continue;
+		slen = (socklen_t)sizeof size;
+		if (setsockopt(sock, SOL_SOCKET, opt[i][0], &size, slen) < 0 &&
+				setsockopt(sock, SOL_SOCKET, opt[i][1], &size, slen) < 0) {
+			syslog(LOG_ERR, "setsockopt: %s: %s", name[i], strerror(errno));
+			continue;
+		}
+		slen = (socklen_t)sizeof cur;
+		if (getsockopt(sock, SOL_SOCKET, opt[i][1], &cur, &slen) < 0)
+			continue;
+		if (cur / 2 < size)
+			syslog(LOG_INFO, "%s: %d bytes for %ld pps, wanted %d; "
+					"raise net.core.%s", name[i], cur / 2, pps, size,
+					i == 0 ? "rmem_max" : "wmem_max");
+		else
+			syslog(LOG_INFO, "%s: %d bytes for %ld pps", name[i], cur / 2,
+					pps);
+	}
+}
@@ -5,7 +5,24 @@
  * used and redistributed with our explicit permission.
  */ 
 
-void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port);
+void bind_or_die(/*@out@*/ int *s_udp, /*@out@*/ int *s_tcp, char *port,
+		int reuseport);
 int recv_w_ts(int sock, int flags, /*@out@*/ struct packet *pkt);
-int send_w_ts(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts);
+extern int (*send_w_ts)(int sock, addr_t *addr, char *data,
+		/*@out@*/ ts_t *ts);
+int send_w_ts_userland(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts);
+int send_w_ts_kernel(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts);
+extern int (*send_train_w_ts)(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts);
+int send_train_w_ts_each(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts);
+int send_train_w_ts_userland(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts);
+int send_train_w_ts_kernel(int sock, addr_t *addr, char *data, int n,
+		/*@out@*/ ts_t *ts);
 int dscp_set(int sock, uint8_t dscp);
+int dscp_extract(struct msghdr *msg, /*@out@*/ uint8_t *dscp_out);
+int drops_extract(struct msghdr *msg, /*@out@*/ uint32_t *drops);
+void drops_count(int sock, struct msghdr *msg);
+void sockbuf_size(int sock, long pps);
+int bind_udp_iface(char *port, char *iface, /*@null@*/ struct in6_addr *src);
@@ -10,14 +10,34 @@
 #include <signal.h>
 
 #define APP_AND_VERSION "SLA-NG probed 0.3"
-/* Measurement time out [seconds] */
+/* Default measurement time out [seconds] */
 #define TIMEOUT 10
-/* Tick interval [microseconds] */
-#define SEND_INTERVAL 1000
-/* Interval between aclculation of tick deviation [ticks] */
-#define SEND_INTERVAL_DEV_INTERVAL 100
-/* Interval between flush of timed out probes [nanoseconds] */
-#define TIMEOUT_INTERVAL 100000
+/* Interval between flush of timed out probes, timing wheel tick [nanoseconds] */
+#define TIMEOUT_INTERVAL 10000000
+/* Interval between statistics reports in DAEMON mode [nanoseconds] */
+#define STATS_INTERVAL 10000000000LL
+/* Interval between syncs of the session snapshot to disk [nanoseconds] */
+#define SNAP_SYNC_INTERVAL 1000000000
+/* Timestamp connection retries, doubled after each failure [milliseconds] */
+#define RECONNECT_MIN 1000
+#define RECONNECT_MAX 60000
+/* Default TCP listen backlog; the kernel caps it at net.core.somaxconn */
+#define BACKLOG 4096
+/* Timestamp connections accepted per wake-up, before serving PINGs again */
+#define ACCEPT_BATCH 64
+/* Quiet time that ends a burst of (re)connecting peers [nanoseconds] */
+#define CONVERGE_QUIET 10000000000LL
+/* Adaptive rate: a session that sees loss PINGs BURST_FACTOR times as
+ * often, but at most every BURST_MIN_INTERVAL, until BURST_HOLD after
+ * the last loss; then its rate halves every BURST_HOLD [nanoseconds] */
+#define BURST_FACTOR 10
+#define BURST_MIN_INTERVAL 10000000
+#define BURST_HOLD 5000000000LL
+/* Most PINGs in a packet train, see <train> */
+#define TRAIN_MAX 64
+/* Size of a result capture file [bytes], and rotated ones kept, see -C */
+#define CAPTURE_SIZE (64 * 1024 * 1024)
+#define CAPTURE_KEEP 4
 #define TMPLEN 512
 #define DATALEN 48
 /* Measurement status types */
@@ -26,17 +46,32 @@
 #define TYPE_TIME 3
 #define TYPE_HELO 4
 #define TYPE_SEND 5
+/* Throughput streams, see bulk.c */
+#define TYPE_BULK 6
+#define TYPE_BULK_END 7
+/* Throughput streams use the UDP port this far after the PING port */
+#define BULK_PORT_OFFSET 1
 
 int count_server_resp;
+int count_server_accept;
+int count_server_shed;
+/* PINGs dropped as the responder has too many peers, see resp.c */
+int count_server_nopeer;
 int count_client_sent;
+int count_client_skip;
 int count_client_done;
 int count_client_find;
 int count_client_fifoq;
 int count_client_fifoq_max;
+/* UDP receive buffer drops, SO_RXQ_OVFL; summed over the sockets */
+uint32_t count_sock_drops;
 int last_tx_id;
 int last_tx_seq;
 
-typedef struct timespec ts_t;
+/* Timestamps are nanoseconds since the epoch; RTT is plain subtraction */
+typedef int64_t ts_t;
+#define NSEC_PER_SEC 1000000000LL
+#define TS_FROM_TIMESPEC(t) ((ts_t)(t).tv_sec * NSEC_PER_SEC + (t).tv_nsec)
 typedef struct sockaddr_in6 addr_t;
 typedef uint32_t num_t;
 
@@ -44,7 +79,9 @@ enum opmode {
 	HELP,
 	SERVER,
 	CLIENT,
-	DAEMON
+	DAEMON,
+	REFLECT,
+	BULK
 };
 enum tsmode {
 	HARDWARE,
@@ -55,8 +92,14 @@ struct config {
 	enum tsmode ts; /* timestamping type */
 	enum opmode op; /* operation mode */
 	int fifo; /* file descriptor to named pipe for daemon mode */
+	int ring; /* file descriptor to PACKET_MMAP PING ring, or -1 */
+	int uring; /* eventfd of the io_uring backend, or -1 */
+	int handoff; /* unix socket listening for a successor, or -1 */
+	int bulk; /* UDP socket of the throughput sink, or -1 */
+	int backlog; /* TCP listen backlog */
 	volatile sig_atomic_t should_reload;
 	volatile sig_atomic_t should_clear_timeouts;
+	volatile sig_atomic_t should_summarize; /* CLIENT: Ctrl+C */
 };
 extern struct config cfg;
 
@@ -67,14 +110,34 @@ struct packet {
 	/*@dependent@*/ ts_t ts;
 };
 typedef struct packet pkt_t;
+/*
+ * Probe payload, always DATALEN bytes. 'version' used to be structure
+ * padding, followed by T2 and T3 as 16 byte timespecs (see packet_data_v0).
+ * Only DATA_VERSION means int64 nanoseconds; anything else is the old
+ * layout, as old responders did not clear the padding. Responders answer
+ * in the format of the PING, so old and new nodes can measure each other.
+ */
+#define DATA_VERSION 0x4e530001
 struct packet_data {
 	num_t type;
 	num_t seq;
 	num_t id;
+	num_t version;
 	/*@dependent@*/ ts_t t2;
 	/*@dependent@*/ ts_t t3;
+	int64_t reserved[2];
 };
 typedef struct packet_data data_t;
+struct packet_data_v0 {
+	num_t type;
+	num_t seq;
+	num_t id;
+	num_t pad;
+	int64_t t2_sec;
+	int64_t t2_nsec;
+	int64_t t3_sec;
+	int64_t t3_nsec;
+};
 struct packet_rpm {
 	int32_t t1_sec;
 	int32_t t1_usec;
@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   reflect.c
+ * \brief  Stateless multi-threaded reflector, a server mode for high fan-in
+ *
+ * The reflector does what the server half of loop_or_die() does, and
+ * nothing else: no measurement sessions, no FIFO, no transmit timer.
+ * Each thread owns one UDP and one TCP listening socket, all bound to
+ * the same port with SO_REUSEPORT. A BPF program on both reuseport
+ * groups selects the thread from the peer's source address, so the
+ * PINGs and the TCP timestamp connection of a peer always end up in
+ * the same thread, and each thread can keep a peer table of its own.
+ *
+ * PINGs are read with recvmmsg(), and PONGs sent with sendmmsg() with
+ * the DSCP as ancillary data, so a batch costs a few system calls in
+ * total, instead of a few per PING.
+ */
+
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <linux/filter.h>
+#include "probed.h"
+#include "reflect.h"
+#include "tstamp.h"
+#include "unix.h"
+#include "util.h"
+#include "net.h"
+#include "log.h"
+
+/* PINGs per recvmmsg()/sendmmsg() */
+#define REFLECT_BATCH 64
+/* Buckets in each thread's peer table */
+#define REFLECT_PEER_BUCKETS 256
+/* Interval between statistics reports [seconds] */
+#define REFLECT_STATS_INTERVAL 10
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+struct reflect_peer {
+	addr_t addr;
+	int fd;
+	LIST_ENTRY(reflect_peer) list;
+};
+LIST_HEAD(reflect_peer_listhead, reflect_peer);
+
+struct reflector {
+	int id;
+	int s_udp;
+	int s_tcp;
+	pthread_t thread;
+	uint32_t tx_id; /* OPT_ID of next PONG, see tstamp_opt_id() */
+	struct reflect_peer_listhead peers[REFLECT_PEER_BUCKETS];
+	/* Counters, read without locking by the statistics thread */
+	volatile unsigned long count_rx;
+	volatile unsigned long count_tx;
+	volatile unsigned long count_tserr;
+	volatile unsigned long count_notcp;
+	volatile unsigned long count_txdrop; /* PONGs sendmmsg() would not send */
+	volatile uint32_t count_drops; /* SO_RXQ_OVFL, cumulative */
+	volatile int count_peers;
+};
+
+static int reflect_steer(int s_udp, int s_tcp, int threads);
+static void *reflect_thread(void *arg);
+static void reflect_accept(struct reflector *r, fd_set *fs, int *fd_max);
+static void reflect_kill_peer(struct reflector *r, fd_set *fs, int fd);
+static int reflect_find_peer_fd(struct reflector *r, addr_t *addr);
+static unsigned int reflect_hash(addr_t *addr);
+
+/**
+ * Start 'threads' reflector threads on 'port', and report statistics
+ *
+ * Every thread gets its own socket pair from bind_or_die(), with
+ * timestamping enabled as for the normal server. The calling thread
+ * logs per-thread counters every REFLECT_STATS_INTERVAL seconds.
+ *
+ * \param[in] threads Number of threads (and socket pairs)
+ * \param[in] port    The UDP/TCP port to bind
+ * \param[in] tstamp  Timestamp mode to enable on each UDP socket
+ * \param[in] iface   Interface for hardware timestamps
+ */
+void reflect_or_die(int threads, char *port, enum tsmode tstamp, char *iface) {
+	struct reflector *r;
+	unsigned long rx, tx, last_rx = 0, last_tx = 0;
+	int i, j;
+
+	if (threads < 1) {
+		syslog(LOG_ERR, "Reflector needs at least one thread");
+		exit(EXIT_FAILURE);
+	}
+	r = calloc((size_t)threads, sizeof *r);
+	if (r == NULL) {
+		syslog(LOG_ERR, "calloc: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* Socket pairs must join their reuseport groups in thread order */
+	for (i = 0; i < threads; i++) {
+		r[i].id = i;
+		bind_or_die(&r[i].s_udp, &r[i].s_tcp, port, 1);
+		if (tstamp == HARDWARE) tstamp_mode_hardware(r[i].s_udp, iface);
+		if (tstamp == KERNEL) tstamp_mode_kernel(r[i].s_udp);
+		if (tstamp == USERLAND) tstamp_mode_userland(r[i].s_udp);
+		if (tstamp_opt_id(r[i].s_udp) < 0)
+			exit(EXIT_FAILURE);
+		if (fcntl(r[i].s_tcp, F_SETFL, O_NONBLOCK) < 0) {
+			syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < REFLECT_PEER_BUCKETS; j++)
+			LIST_INIT(&r[i].peers[j]);
+	}
+	tstamp_backend_select();
+	if (reflect_steer(r[0].s_udp, r[0].s_tcp, threads) < 0)
+		syslog(LOG_ERR, "reflect: peers may be split between threads");
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&r[i].thread, NULL, reflect_thread, &r[i]) != 0) {
+			syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	syslog(LOG_INFO, "Reflector mode: %d threads waiting for PINGs", threads);
+
+	while (1 == 1) {
+		(void)sleep(REFLECT_STATS_INTERVAL);
+		rx = 0;
+		tx = 0;
+		for (i = 0; i < threads; i++) {
+			syslog(LOG_INFO, "reflect %d: rx %lu tx %lu tserr %lu "
+					"notcp %lu drops %u txdrops %lu peers %d", i, r[i].count_rx,
+					r[i].count_tx, r[i].count_tserr, r[i].count_notcp,
+					(unsigned int)r[i].count_drops, r[i].count_txdrop,
+					r[i].count_peers);
+			rx += r[i].count_rx;
+			tx += r[i].count_tx;
+		}
+		syslog(LOG_INFO, "reflect: rx %lu pps, tx %lu pps",
+				(rx - last_rx) / REFLECT_STATS_INTERVAL,
+				(tx - last_tx) / REFLECT_STATS_INTERVAL);
+		last_rx = rx;
+		last_tx = tx;
+	}
+}
+
+/**
+ * Make the reuseport groups pick thread from the peer's source address
+ *
+ * The classic BPF program returns the index of the socket to use in
+ * the group, which is the order the sockets were bound in. It runs on
+ * both UDP datagrams and TCP SYNs, and hashes the last 32 bits of the
+ * source address only, so a peer maps to the same index in both.
+ *
+ * \param[in] s_udp   Any UDP socket of the group
+ * \param[in] s_tcp   Any TCP socket of the group
+ * \param[in] threads Number of sockets in each group
+ * \return            0 on success, -1 on error
+ */
+static int reflect_steer(int s_udp, int s_tcp, int threads) {
+	struct sock_fprog prog;
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 4),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 2, 0),
+		/* IPv4 source address */
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12),
+		BPF_JUMP(BPF_JMP|BPF_JA, 1, 0, 0),
+		/* Last 32 bits of IPv6 source address */
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 20),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, (uint32_t)threads),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+
+	prog.len = (unsigned short)(sizeof code / sizeof code[0]);
+	prog.filter = code;
+	if (setsockopt(s_udp, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+				sizeof prog) < 0 ||
+			setsockopt(s_tcp, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+				sizeof prog) < 0) {
+		syslog(LOG_ERR, "setsockopt: SO_ATTACH_REUSEPORT_CBPF: %s",
+				strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * The reflector thread; answer PINGs in batches, forever
+ *
+ * \param[in] arg Pointer to this thread's struct reflector
+ */
+static void *reflect_thread(void *arg) {
+	struct reflector *r = arg;
+	struct mmsghdr rx[REFLECT_BATCH], tx[REFLECT_BATCH];
+	struct iovec rx_iov[REFLECT_BATCH], tx_iov[REFLECT_BATCH];
+	char rx_data[REFLECT_BATCH][DATALEN];
+	char rx_ctrl[REFLECT_BATCH][512];
+	char tx_ctrl[REFLECT_BATCH][CMSG_SPACE(sizeof (int))];
+	addr_t rx_addr[REFLECT_BATCH];
+	data_t pong[REFLECT_BATCH];
+	num_t version[REFLECT_BATCH];
+	ts_t t2[REFLECT_BATCH], t3[REFLECT_BATCH];
+	struct cmsghdr *cmsg;
+	data_t *d;
+	uint8_t dscp;
+	uint32_t drops;
+	fd_set fs, fs_tmp;
+	int i, n, m, k, sent, fd, fd_max;
+
+	memset(rx, 0, sizeof rx);
+	memset(tx, 0, sizeof tx);
+	for (i = 0; i < REFLECT_BATCH; i++) {
+		rx_iov[i].iov_base = rx_data[i];
+		rx_iov[i].iov_len = DATALEN;
+		rx[i].msg_hdr.msg_iov = &rx_iov[i];
+		rx[i].msg_hdr.msg_iovlen = 1;
+		rx[i].msg_hdr.msg_name = &rx_addr[i];
+		rx[i].msg_hdr.msg_control = rx_ctrl[i];
+		tx_iov[i].iov_base = &pong[i];
+		tx_iov[i].iov_len = DATALEN;
+		tx[i].msg_hdr.msg_iov = &tx_iov[i];
+		tx[i].msg_hdr.msg_iovlen = 1;
+		tx[i].msg_hdr.msg_namelen = (socklen_t)sizeof (addr_t);
+		tx[i].msg_hdr.msg_control = tx_ctrl[i];
+		tx[i].msg_hdr.msg_controllen = sizeof tx_ctrl[i];
+	}
+	unix_fd_zero(&fs);
+	unix_fd_set(r->s_udp, &fs);
+	unix_fd_set(r->s_tcp, &fs);
+	fd_max = MAX(r->s_udp, r->s_tcp);
+
+	while (1 == 1) {
+		fs_tmp = fs;
+		if (select(fd_max + 1, &fs_tmp, NULL, NULL, NULL) < 0) {
+			log_msg(LOGT_SOCK, LOG_ERR, "reflect %d: select: %s", r->id, strerror(errno));
+			continue;
+		}
+		if (unix_fd_isset(r->s_tcp, &fs_tmp) == 1) {
+			unix_fd_clr(r->s_tcp, &fs_tmp);
+			reflect_accept(r, &fs, &fd_max);
+		}
+		/* Anything readable but UDP is a peer disconnecting */
+		for (fd = 0; fd <= fd_max; fd++)
+			if (fd != r->s_udp && unix_fd_isset(fd, &fs_tmp) == 1)
+				reflect_kill_peer(r, &fs, fd);
+		if (unix_fd_isset(r->s_udp, &fs_tmp) == 0)
+			continue;
+
+		for (i = 0; i < REFLECT_BATCH; i++) {
+			rx[i].msg_hdr.msg_namelen = (socklen_t)sizeof (addr_t);
+			rx[i].msg_hdr.msg_controllen = sizeof rx_ctrl[i];
+		}
+		n = recvmmsg(r->s_udp, rx, REFLECT_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 1)
+			continue;
+		/* The drop counter of the last PING is the latest */
+		if (drops_extract(&rx[n - 1].msg_hdr, &drops) == 0)
+			r->count_drops = drops;
+
+		/* Build one PONG per PING, RX timestamp taken per packet */
+		m = 0;
+		for (i = 0; i < n; i++) {
+			d = (data_t *)rx_data[i];
+			if (rx[i].msg_len != DATALEN || d->type != TYPE_PING)
+				continue;
+			r->count_rx++;
+			memset(&pong[m], 0, sizeof pong[m]);
+			pong[m].type = TYPE_PONG;
+			pong[m].id = d->id;
+			pong[m].seq = d->seq;
+			if (tstamp_extract_rx(&rx[i].msg_hdr, &t2[m]) < 0)
+				r->count_tserr++;
+			pong[m].t2 = t2[m];
+			version[m] = d->version;
+			data_encode(&pong[m], version[m]);
+			(void)dscp_extract(&rx[i].msg_hdr, &dscp);
+			tx[m].msg_hdr.msg_name = &rx_addr[i];
+			cmsg = CMSG_FIRSTHDR(&tx[m].msg_hdr);
+			cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+			if (IN6_IS_ADDR_V4MAPPED(&rx_addr[i].sin6_addr)) {
+				cmsg->cmsg_level = IPPROTO_IP;
+				cmsg->cmsg_type = IP_TOS;
+			} else {
+				cmsg->cmsg_level = IPPROTO_IPV6;
+				cmsg->cmsg_type = IPV6_TCLASS;
+			}
+			*(int *)CMSG_DATA(cmsg) = (int)dscp << 2;
+			m++;
+		}
+		if (m == 0)
+			continue;
+
+		if (cfg.ts == USERLAND)
+			t3[0] = ts_now();
+		/* Send the rest of a partly sent batch again, until sendmmsg()
+		 * fails; the PONGs left then are dropped, and counted */
+		sent = 0;
+		while (sent < m) {
+			k = sendmmsg(r->s_udp, tx + sent, (unsigned int)(m - sent), 0);
+			if (k < 1) {
+				log_msg(LOGT_SEND, LOG_INFO, "reflect %d: sendmmsg: %s", r->id,
+						strerror(errno));
+				r->count_txdrop += (unsigned long)(m - sent);
+				break;
+			}
+			sent += k;
+		}
+		if (sent < 1)
+			continue;
+		r->count_tx += (unsigned long)sent;
+		if (cfg.ts == USERLAND) {
+			for (i = 1; i < sent; i++)
+				t3[i] = t3[0];
+		} else {
+			if (tstamp_fetch_tx_batch(r->s_udp, t3, sent, r->tx_id) < sent)
+				r->count_tserr++;
+			r->tx_id += (uint32_t)sent;
+		}
+
+		/* Send T2 and T3 over the peer's TCP timestamp connection */
+		for (i = 0; i < sent; i++) {
+			pong[i].type = TYPE_TIME;
+			pong[i].t2 = t2[i];
+			pong[i].t3 = t3[i];
+			data_encode(&pong[i], version[i]);
+			fd = reflect_find_peer_fd(r, tx[i].msg_hdr.msg_name);
+			if (fd < 0) {
+				r->count_notcp++;
+				continue;
+			}
+			if (send(fd, (char *)&pong[i], DATALEN, MSG_DONTWAIT) != DATALEN)
+				reflect_kill_peer(r, &fs, fd);
+		}
+	}
+	/*@ -unreachable @*/
+	return NULL;
+	/*@ +unreachable @*/
+}
+
+/**
+ * Accept all pending timestamp connections, and greet them with HELO
+ *
+ * \param[in]  r      Pointer to this thread's reflector
+ * \param[out] fs     Pointer to the thread's file descriptor set
+ * \param[out] fd_max Pointer to the thread's highest file descriptor
+ */
+static void reflect_accept(struct reflector *r, fd_set *fs, int *fd_max) {
+	struct reflect_peer *p;
+	char addrstr[INET6_ADDRSTRLEN];
+	addr_t addr;
+	socklen_t slen;
+	data_t tx;
+	int fd;
+
+	while (1 == 1) {
+		slen = (socklen_t)sizeof addr;
+		memset(&addr, 0, sizeof addr);
+		fd = accept(r->s_tcp, (struct sockaddr *)&addr, &slen);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_msg(LOGT_SOCK, LOG_ERR, "reflect %d: accept: %s", r->id,
+						strerror(errno));
+			return;
+		}
+		if (fd >= FD_SETSIZE) {
+			log_msg(LOGT_SOCK, LOG_ERR, "reflect %d: too many peers", r->id);
+			(void)close(fd);
+			continue;
+		}
+		memset(&tx, 0, sizeof tx);
+		tx.type = TYPE_HELO;
+		if (send(fd, (char *)&tx, DATALEN, 0) != DATALEN) {
+			(void)close(fd);
+			continue;
+		}
+		p = malloc(sizeof *p);
+		if (p == NULL) {
+			(void)close(fd);
+			continue;
+		}
+		p->fd = fd;
+		memcpy(&p->addr, &addr, sizeof p->addr);
+		LIST_INSERT_HEAD(&r->peers[reflect_hash(&addr)], p, list);
+		r->count_peers++;
+		unix_fd_set(fd, fs);
+		*fd_max = MAX(*fd_max, fd);
+		if (addr2str(&addr, addrstr) == 0)
+			syslog(LOG_INFO, "reflect %d: %s: %d: Connected", r->id,
+					addrstr, fd);
+	}
+}
+
+/**
+ * Close a peer's timestamp connection, and forget about the peer
+ *
+ * \param[in]  r  Pointer to this thread's reflector
+ * \param[out] fs Pointer to the thread's file descriptor set
+ * \param[in]  fd The peer's TCP socket
+ */
+static void reflect_kill_peer(struct reflector *r, fd_set *fs, int fd) {
+	struct reflect_peer *p;
+	int i;
+
+	for (i = 0; i < REFLECT_PEER_BUCKETS; i++) {
+		for (p = r->peers[i].lh_first; p != NULL; p = p->list.le_next) {
+			if (p->fd == fd) {
+				LIST_REMOVE(p, list);
+				free(p);
+				r->count_peers--;
+				i = REFLECT_PEER_BUCKETS;
+				break; /* Otherwise for() crashes! */
+			}
+		}
+	}
+	syslog(LOG_INFO, "reflect %d: %d: Disconnected", r->id, fd);
+	(void)close(fd);
+	unix_fd_clr(fd, fs);
+}
+
+/**
+ * Map the address of a PINGing peer to its TCP timestamp socket
+ *
+ * \param[in] r    Pointer to this thread's reflector
+ * \param[in] addr Pointer to the peer's address
+ * \return         File descriptor, or -1 if the peer is not connected
+ */
+static int reflect_find_peer_fd(struct reflector *r, addr_t *addr) {
+	struct reflect_peer *p;
+	struct reflect_peer_listhead *h;
+
+	h = &r->peers[reflect_hash(addr)];
+	for (p = h->lh_first; p != NULL; p = p->list.le_next)
+		if (memcmp(&p->addr.sin6_addr, &addr->sin6_addr,
+					sizeof addr->sin6_addr) == 0)
+			return p->fd;
+	return -1;
+}
+
+/**
+ * Peer table bucket of an address; the address bytes most likely to vary
+ */
+static unsigned int reflect_hash(addr_t *addr) {
+	uint8_t *a = addr->sin6_addr.s6_addr;
+
+	return (unsigned int)(a[15] ^ a[14] ^ a[13] ^ a[7]) %
+		REFLECT_PEER_BUCKETS;
+}
@@ -0,0 +1,8 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+void reflect_or_die(int threads, char *port, enum tsmode tstamp, char *iface);
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   resp.c
+ * \brief  Per-peer rate limits and fair queueing of PINGs, for the responder
+ *
+ * Reading a PING is cheap; answering it, with a PONG, a TX timestamp
+ * and a TCP timestamp message, is not. If PINGs are answered as they
+ * are read, a peer that sends too many fills the UDP receive buffer,
+ * and the kernel drops the PINGs of every peer alike. Instead, the
+ * server half of loop_step() reads all PINGs that are waiting into a
+ * queue per peer (source address), and answers them round-robin, one
+ * per peer at a time. A peer that sends more than its share fills its
+ * own queue, and only its own PINGs are dropped ("shed").
+ *
+ * Optionally, each peer also has a token bucket of resp_limit() PINGs
+ * per second, kept as the time it is full again (GCRA), and PINGs
+ * beyond it are shed before they are queued. Shed PINGs are timeouts
+ * for the peer, and are counted per peer and logged by resp_stats().
+ *
+ * Source addresses of PINGs are easily spoofed, so the table keeps at
+ * most RESP_PEERS peers; PINGs of new peers beyond that are dropped,
+ * and counted in count_server_nopeer, until idle ones are forgotten. A
+ * peer has room for one queued PING; its queue of RESP_QLEN is only
+ * allocated once it has a backlog, and freed by resp_stats() when
+ * that is gone.
+ *
+ * The RTT is not affected by the time a PING waits in its queue, as
+ * the PONG carries T2, taken when the PING was received, and the TCP
+ * timestamp T3, taken when the PONG is sent. Each queued PING keeps
+ * the socket it was read from, which the PONG is sent on (see iface.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/queue.h>
+#include "probed.h"
+#include "util.h"
+#include "resp.h"
+
+/* Buckets of the peer table; a power of two */
+#define RESP_BUCKETS 1024
+/* Peers in the table at most */
+#define RESP_PEERS (4 * RESP_BUCKETS)
+/* PINGs queued per peer; more are shed */
+#define RESP_QLEN 64
+/* Depth of the token buckets, as time [nanoseconds] */
+#define RESP_BURST 100000000
+/* Peers idle this long are forgotten [nanoseconds] */
+#define RESP_IDLE 60000000000LL
+
+/* A queued PING, and the socket it came in on */
+struct resp_pkt {
+	pkt_t pkt;
+	int sock;
+};
+
+struct resp_peer {
+	struct in6_addr addr;
+	ts_t tat; /* Token bucket; the time it is full again, monotonic */
+	ts_t last; /* Last PING, monotonic */
+	unsigned long served, shed; /* Since the last resp_stats() */
+	/*@null@*/ struct resp_pkt *q; /* Queue, a ring of RESP_QLEN */
+	struct resp_pkt one; /* The queue, of one, while 'q' is NULL */
+	int head, len;
+	LIST_ENTRY(resp_peer) hash;
+	TAILQ_ENTRY(resp_peer) active;
+};
+static LIST_HEAD(resp_peer_listhead, resp_peer) peers[RESP_BUCKETS];
+/* Peers with queued PINGs, in round-robin order */
+static TAILQ_HEAD(resp_active_head, resp_peer) active =
+	TAILQ_HEAD_INITIALIZER(active);
+static int peers_init = 0;
+static ts_t gap = 0; /* Time per token, 0 is no limit */
+static int pending = 0;
+static int n_peers = 0;
+static unsigned long nopeer = 0; /* Since the last resp_stats() */
+
+static /*@null@*/ struct resp_peer *resp_find(struct in6_addr *addr);
+static unsigned int resp_hash(struct in6_addr *addr);
+static struct resp_pkt *resp_slot(struct resp_peer *p, int i);
+
+/**
+ * Limit the PINGs answered for each peer to 'pps'
+ *
+ * \param[in] pps PINGs per second and peer, or 0 for no limit
+ */
+void resp_limit(int pps) {
+	gap = pps > 0 ? NSEC_PER_SEC / pps : 0;
+}
+
+/**
+ * Queue a received PING for its answer, unless its peer is over its
+ * rate or has a full queue
+ *
+ * \param[in] sock The socket it was read from, -1 for the main one
+ * \param[in] addr Address of the PINGing peer
+ * \param[in] dscp DSCP of the PING
+ * \param[in] data The PING data, DATALEN bytes
+ * \param[in] t2   The RX timestamp of the PING
+ * \return         0 if queued, -1 if shed
+ */
+int resp_enqueue(int sock, addr_t *addr, uint8_t dscp, data_t *data,
+		ts_t *t2) {
+	struct resp_peer *p;
+	struct resp_pkt *q;
+	pkt_t *pkt;
+	ts_t now;
+
+	p = resp_find(&addr->sin6_addr);
+	if (p == NULL) {
+		count_server_nopeer++;
+		nopeer++;
+		return -1;
+	}
+	now = ts_monotonic();
+	p->last = now;
+	if (gap > 0) {
+		if (p->tat > now + MAX(RESP_BURST, gap)) {
+			p->shed++;
+			count_server_shed++;
+			return -1;
+		}
+		p->tat = MAX(p->tat, now) + gap;
+	}
+	if (p->len == RESP_QLEN) {
+		p->shed++;
+		count_server_shed++;
+		return -1;
+	}
+	/* A backlog; the queue of one is not enough */
+	if (p->q == NULL && p->len == 1) {
+		p->q = malloc(RESP_QLEN * sizeof *p->q);
+		if (p->q == NULL) {
+			syslog(LOG_ERR, "resp: malloc: %s", strerror(errno));
+			p->shed++;
+			count_server_shed++;
+			return -1;
+		}
+		memcpy(&p->q[0], &p->one, sizeof p->one);
+		p->head = 0;
+	}
+	q = resp_slot(p, p->head + p->len);
+	q->sock = sock;
+	pkt = &q->pkt;
+	memcpy(&pkt->addr, addr, sizeof pkt->addr);
+	pkt->dscp = dscp;
+	memcpy(pkt->data, data, DATALEN);
+	pkt->ts = *t2;
+	if (p->len++ == 0)
+		TAILQ_INSERT_TAIL(&active, p, active);
+	pending++;
+	return 0;
+}
+
+/**
+ * Take the next PING to answer, one from each peer in turn
+ *
+ * \param[out] pkt  The PING, with its address, DSCP and RX timestamp
+ * \param[out] sock The socket it was read from, -1 for the main one
+ * \return          0 on success, -1 if no PINGs are queued
+ */
+int resp_dequeue(pkt_t *pkt, int *sock) {
+	struct resp_peer *p;
+
+	p = active.tqh_first;
+	if (p == NULL)
+		return -1;
+	memcpy(pkt, &resp_slot(p, p->head)->pkt, sizeof *pkt);
+	*sock = resp_slot(p, p->head)->sock;
+	p->head = p->q != NULL ? (p->head + 1) % RESP_QLEN : 0;
+	p->len--;
+	p->served++;
+	pending--;
+	/* To the back of the line, if it has more */
+	TAILQ_REMOVE(&active, p, active);
+	if (p->len > 0)
+		TAILQ_INSERT_TAIL(&active, p, active);
+	return 0;
+}
+
+/**
+ * Number of PINGs queued, waiting for their answer
+ */
+int resp_pending(void) {
+	return pending;
+}
+
+/**
+ * Log the peers that had PINGs shed since the last call, and the PINGs
+ * of peers that did not fit in the table, reset the counters, free the
+ * queues of peers without a backlog, and forget peers that have been
+ * idle for RESP_IDLE
+ */
+void resp_stats(void) {
+	struct resp_peer *p, *p_tmp;
+	char addrstr[INET6_ADDRSTRLEN];
+	addr_t a;
+	ts_t now;
+	int i;
+
+	if (peers_init == 0)
+		return;
+	if (nopeer > 0)
+		syslog(LOG_INFO, "server: %d peers, the most; %lu PINGs of new ones "
+				"dropped", n_peers, nopeer);
+	nopeer = 0;
+	now = ts_monotonic();
+	memset(&a, 0, sizeof a);
+	for (i = 0; i < RESP_BUCKETS; i++) {
+		for (p = peers[i].lh_first; p != NULL; p = p_tmp) {
+			p_tmp = p->hash.le_next;
+			if (p->shed > 0) {
+				memcpy(&a.sin6_addr, &p->addr, sizeof a.sin6_addr);
+				if (addr2str(&a, addrstr) == 0)
+					syslog(LOG_INFO, "server: %s: %lu served, %lu shed",
+							addrstr, p->served, p->shed);
+			}
+			p->served = 0;
+			p->shed = 0;
+			if (p->len > 0)
+				continue;
+			free(p->q);
+			p->q = NULL;
+			p->head = 0;
+			if (now - p->last > RESP_IDLE) {
+				LIST_REMOVE(p, hash);
+				free(p);
+				n_peers--;
+			}
+		}
+	}
+}
+
+/**
+ * Find the peer with address 'addr', or add it, if there is room
+ */
+static struct resp_peer *resp_find(struct in6_addr *addr) {
+	struct resp_peer *p;
+	unsigned int h;
+	int i;
+
+	if (peers_init == 0) {
+		for (i = 0; i < RESP_BUCKETS; i++)
+			LIST_INIT(&peers[i]);
+		peers_init = 1;
+	}
+	h = resp_hash(addr);
+	for (p = peers[h].lh_first; p != NULL; p = p->hash.le_next)
+		if (memcmp(&p->addr, addr, sizeof p->addr) == 0)
+			return p;
+	if (n_peers >= RESP_PEERS)
+		return NULL;
+	p = malloc(sizeof *p);
+	if (p == NULL) {
+		syslog(LOG_ERR, "resp: malloc: %s", strerror(errno));
+		return NULL;
+	}
+	memset(p, 0, sizeof *p);
+	memcpy(&p->addr, addr, sizeof p->addr);
+	LIST_INSERT_HEAD(&peers[h], p, hash);
+	n_peers++;
+	return p;
+}
+
+/**
+ * Bucket of 'addr' in the peer table; FNV-1a of the address
+ */
+static unsigned int resp_hash(struct in6_addr *addr) {
+	unsigned char *b = (unsigned char *)addr;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof *addr; i++)
+		h = (h ^ b[i]) * 16777619U;
+	return h & (RESP_BUCKETS - 1);
+}
+
+/**
+ * Slot 'i' of the queue of peer 'p'; the queue of one, if it has no ring
+ */
+static struct resp_pkt *resp_slot(struct resp_peer *p, int i) {
+	return p->q != NULL ? &p->q[i % RESP_QLEN] : &p->one;
+}
@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+void resp_limit(int pps);
+int resp_enqueue(int sock, addr_t *addr, uint8_t dscp, data_t *data,
+		ts_t *t2);
+int resp_dequeue(/*@out@*/ pkt_t *pkt, /*@out@*/ int *sock);
+int resp_pending(void);
+void resp_stats(void);
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   ring.c
+ * \brief  PACKET_MMAP (TPACKET_V3) receive ring for the responder
+ *
+ * The responder normally pays one recvmsg() and one copy into pkt_t for
+ * every PING. With a ring, the kernel writes PINGs (and their RX
+ * timestamps) into memory shared with us, and we parse them in place.
+ * A BPF filter on the packet socket lets through incoming UDP PINGs to
+ * our port only, and a second filter on the UDP socket drops those
+ * PINGs there, so each PING is seen exactly once. PONGs, TX timestamps
+ * and everything else still goes through the normal UDP socket.
+ *
+ * The filter cannot tell PINGs to us from PINGs that are only routed
+ * through us, as it does not know our addresses. ring_parse() passes
+ * over those whose destination is not one of ours, as listed by
+ * getifaddrs() and reloaded at most every RING_ADDRS_RELOAD when an
+ * unknown one shows up; the kernel forwards them as usual.
+ */
+
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include "external/net_tstamp.h"
+#include "probed.h"
+#include "util.h"
+#include "ring.h"
+
+/* Ring geometry; RING_BLOCKS * RING_BLOCK_SIZE bytes are mmap'd */
+#define RING_BLOCKS 64
+#define RING_BLOCK_SIZE (1 << 18)
+#define RING_FRAME_SIZE 2048
+/* Retire a partly filled block after this long [milliseconds] */
+#define RING_BLOCK_TOV 1
+/* Local addresses, at most, and how often they are reloaded at most */
+#define RING_ADDRS_MAX 256
+#define RING_ADDRS_RELOAD NSEC_PER_SEC
+
+static struct {
+	/*@null@*/ uint8_t *map;
+	unsigned int cur; /* Block we are reading, or will read next */
+	/*@null@*/ struct tpacket_block_desc *bd; /* Block held by us */
+	/*@null@*/ uint8_t *frame; /* Next frame in bd */
+	uint32_t left; /* Frames left in bd */
+	struct in6_addr addrs[RING_ADDRS_MAX]; /* Ours, IPv4 as v4-mapped */
+	int n_addrs;
+	ts_t addrs_at; /* Last reload, monotonic */
+} ring;
+
+static int ring_parse(struct tpacket3_hdr *h, /*@out@*/ struct ring_pkt *rp);
+static int ring_local(struct in6_addr *addr);
+static void ring_addrs_load(void);
+
+/**
+ * Open a TPACKET_V3 receive ring for incoming PINGs to 'port'
+ *
+ * The ring listens on all interfaces, so that every PING dropped from
+ * the UDP socket by ring_filter_udp() is guaranteed to show up here.
+ * In hardware timestamp mode, the ring is asked for raw hardware
+ * timestamps, otherwise the kernel stamps the frames in software.
+ *
+ * \param[in] port The UDP port of the probe socket
+ * \return         File descriptor to select() on, or -1 on failure
+ */
+int ring_open(char *port) {
+	int fd, v;
+	uint32_t p = (uint32_t)atoi(port);
+	uint32_t ping = ntohl((uint32_t)TYPE_PING);
+	struct tpacket_req3 req;
+	struct sock_fprog prog;
+	struct sockaddr_ll sll;
+	struct sock_filter code[] = {
+		/* Unicast to this host; not our own outgoing packets, nor
+		 * those of others seen in promiscuous mode */
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_HOST, 0, 19),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETHERTYPE_IP, 1, 0),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETHERTYPE_IPV6, 9, 16),
+		/* IPv4: UDP, first fragment, destination port, PING */
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_UDP, 0, 14),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 12, 0),
+		BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),
+		BPF_STMT(BPF_LD|BPF_H|BPF_IND, 2),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, p, 0, 9),
+		BPF_STMT(BPF_LD|BPF_W|BPF_IND, 8),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ping, 6, 7),
+		/* IPv6: UDP without extension headers, port, PING */
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_UDP, 0, 5),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 42),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, p, 0, 3),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 48),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ping, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0x40000),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+
+	/* Network layer (SOCK_DGRAM) packet socket, all protocols */
+	fd = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+	if (fd < 0) {
+		syslog(LOG_ERR, "ring: socket: %s", strerror(errno));
+		return -1;
+	}
+	prog.len = (unsigned short)(sizeof code / sizeof code[0]);
+	prog.filter = code;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+				sizeof prog) < 0) {
+		syslog(LOG_ERR, "ring: SO_ATTACH_FILTER: %s", strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+	v = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof v) < 0) {
+		syslog(LOG_ERR, "ring: PACKET_VERSION: %s", strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+	if (cfg.ts == HARDWARE) {
+		v = SOF_TIMESTAMPING_RAW_HARDWARE;
+		if (setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &v, sizeof v) < 0)
+			syslog(LOG_ERR, "ring: PACKET_TIMESTAMP: %s", strerror(errno));
+	}
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCKS;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_BLOCKS * (RING_BLOCK_SIZE / RING_FRAME_SIZE);
+	req.tp_retire_blk_tov = RING_BLOCK_TOV;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+		syslog(LOG_ERR, "ring: PACKET_RX_RING: %s", strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+	ring.map = mmap(NULL, (size_t)RING_BLOCKS * RING_BLOCK_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (ring.map == MAP_FAILED) {
+		/* MAP_LOCKED needs RLIMIT_MEMLOCK; try once more without */
+		ring.map = mmap(NULL, (size_t)RING_BLOCKS * RING_BLOCK_SIZE,
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (ring.map == MAP_FAILED) {
+		syslog(LOG_ERR, "ring: mmap: %s", strerror(errno));
+		ring.map = NULL;
+		(void)close(fd);
+		return -1;
+	}
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = 0; /* All interfaces */
+	if (bind(fd, (struct sockaddr *)&sll, sizeof sll) < 0) {
+		syslog(LOG_ERR, "ring: bind: %s", strerror(errno));
+		(void)munmap(ring.map, (size_t)RING_BLOCKS * RING_BLOCK_SIZE);
+		ring.map = NULL;
+		(void)close(fd);
+		return -1;
+	}
+	ring.cur = 0;
+	ring.bd = NULL;
+	ring.frame = NULL;
+	ring.left = 0;
+	ring_addrs_load();
+	syslog(LOG_INFO, "Receiving PINGs on %d kB mmap'd ring",
+			RING_BLOCKS * RING_BLOCK_SIZE / 1024);
+	return fd;
+}
+
+/**
+ * Drop PINGs on the UDP socket, as they are read from the ring instead
+ *
+ * Socket filters on UDP sockets see the packet from the UDP header, so
+ * the PING type is at offset 8. Must only be used after ring_open()
+ * succeeded, otherwise PINGs are lost.
+ *
+ * \param[in] s_udp The UDP probe socket
+ * \return          0 on success, -1 on error
+ */
+int ring_filter_udp(int s_udp) {
+	struct sock_fprog prog;
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 8),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+		BPF_STMT(BPF_RET|BPF_K, 0x40000),
+	};
+
+	code[1].k = ntohl((uint32_t)TYPE_PING);
+	prog.len = (unsigned short)(sizeof code / sizeof code[0]);
+	prog.filter = code;
+	if (setsockopt(s_udp, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+				sizeof prog) < 0) {
+		syslog(LOG_ERR, "ring: UDP SO_ATTACH_FILTER: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Fetch the next PING from the ring, without copying its data
+ *
+ * Walks the frames of the block owned by us, and hands the block back
+ * to the kernel when it is exhausted. The data pointer in 'rp' points
+ * into the ring and is only valid until the next call. Call until it
+ * returns -1 whenever the ring file descriptor is readable.
+ *
+ * \param[out] rp Pointer to a ring_pkt, where addr, data and tstamp is placed
+ * \return        0 if a PING was found, -1 if the ring is empty
+ */
+int ring_next(/*@out@*/ struct ring_pkt *rp) {
+	struct tpacket3_hdr *h;
+
+	if (ring.map == NULL)
+		return -1;
+	while (1 == 1) {
+		if (ring.left == 0) {
+			/* Return exhausted block to the kernel, go to next */
+			if (ring.bd != NULL) {
+				__sync_synchronize();
+				ring.bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+				ring.bd = NULL;
+				ring.cur = (ring.cur + 1) % RING_BLOCKS;
+			}
+			ring.bd = (struct tpacket_block_desc *)(ring.map +
+					(size_t)ring.cur * RING_BLOCK_SIZE);
+			if ((ring.bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+				ring.bd = NULL;
+				return -1;
+			}
+			__sync_synchronize();
+			ring.left = ring.bd->hdr.bh1.num_pkts;
+			ring.frame = (uint8_t *)ring.bd +
+				ring.bd->hdr.bh1.offset_to_first_pkt;
+			continue;
+		}
+		h = (struct tpacket3_hdr *)ring.frame;
+		ring.frame += h->tp_next_offset;
+		ring.left--;
+		if (ring_parse(h, rp) == 0)
+			return 0;
+	}
+}
+
+/**
+ * Parse one ring frame, which the BPF filter says is a UDP PING
+ *
+ * \param[in]  h  Pointer to the frame header
+ * \param[out] rp Pointer to ring_pkt to fill in
+ * \return        0 on success, -1 if the frame is too short or not
+ *                to one of our addresses
+ */
+static int ring_parse(struct tpacket3_hdr *h, /*@out@*/ struct ring_pkt *rp) {
+	struct in6_addr dst;
+	uint8_t *net;
+	uint32_t hlen, w;
+
+	net = (uint8_t *)h + h->tp_net;
+	memset(&rp->addr, 0, sizeof rp->addr);
+	rp->addr.sin6_family = AF_INET6;
+	if (net[0] >> 4 == 4) {
+		hlen = (uint32_t)(net[0] & 0x0f) * 4;
+		if (h->tp_snaplen < hlen + 8 + DATALEN)
+			return -1;
+		/* IPv4-mapped IPv6 address, like the dual-stack socket */
+		rp->addr.sin6_addr.s6_addr[10] = 0xff;
+		rp->addr.sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&rp->addr.sin6_addr.s6_addr[12], net + 12, 4);
+		memcpy(&dst, &rp->addr.sin6_addr, sizeof dst);
+		memcpy(&dst.s6_addr[12], net + 16, 4);
+		rp->dscp = net[1] >> 2;
+	} else {
+		hlen = 40;
+		if (h->tp_snaplen < hlen + 8 + DATALEN)
+			return -1;
+		memcpy(&rp->addr.sin6_addr, net + 8, sizeof rp->addr.sin6_addr);
+		memcpy(&dst, net + 24, sizeof dst);
+		memcpy(&w, net, sizeof w);
+		rp->dscp = (uint8_t)((ntohl(w) >> 20) & 0xff) >> 2;
+	}
+	/* Routed through us; the socket did not drop it, and the kernel
+	 * forwards it */
+	if (ring_local(&dst) == 0)
+		return -1;
+	memcpy(&rp->addr.sin6_port, net + hlen, sizeof rp->addr.sin6_port);
+	rp->data = (data_t *)(net + hlen + 8);
+	rp->ts = (ts_t)h->tp_sec * NSEC_PER_SEC + h->tp_nsec;
+	return 0;
+}
+
+/**
+ * Whether 'addr' is one of our addresses; reloads them, at most every
+ * RING_ADDRS_RELOAD, if it is not
+ *
+ * \param[in] addr The destination of a PING, IPv4 as v4-mapped
+ * \return         1 if it is ours, 0 if not
+ */
+static int ring_local(struct in6_addr *addr) {
+	int i, reloaded;
+	ts_t now;
+
+	for (reloaded = 0; reloaded < 2; reloaded++) {
+		for (i = 0; i < ring.n_addrs; i++)
+			if (memcmp(&ring.addrs[i], addr, sizeof *addr) == 0)
+				return 1;
+		now = ts_monotonic();
+		if (reloaded == 1 || now - ring.addrs_at < RING_ADDRS_RELOAD)
+			break;
+		ring_addrs_load();
+	}
+	return 0;
+}
+
+/**
+ * Load our addresses, for ring_local()
+ */
+static void ring_addrs_load(void) {
+	struct ifaddrs *ifa, *i;
+	struct in6_addr *a;
+
+	ring.addrs_at = ts_monotonic();
+	if (getifaddrs(&ifa) < 0) {
+		syslog(LOG_ERR, "ring: getifaddrs: %s", strerror(errno));
+		return;
+	}
+	ring.n_addrs = 0;
+	for (i = ifa; i != NULL && ring.n_addrs < RING_ADDRS_MAX;
+			i = i->ifa_next) {
+		if (i->ifa_addr == NULL)
+			continue;
+		a = &ring.addrs[ring.n_addrs];
+		memset(a, 0, sizeof *a);
+		if (i->ifa_addr->sa_family == AF_INET) {
+			a->s6_addr[10] = 0xff;
+			a->s6_addr[11] = 0xff;
+			memcpy(&a->s6_addr[12],
+					&((struct sockaddr_in *)i->ifa_addr)->sin_addr, 4);
+		} else if (i->ifa_addr->sa_family == AF_INET6)
+			memcpy(a, &((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr,
+					sizeof *a);
+		else
+			continue;
+		ring.n_addrs++;
+	}
+	freeifaddrs(ifa);
+}
+
+/**
+ * Number of PINGs dropped because the ring was full, since the last call
+ *
+ * \return The number of dropped packets
+ */
+unsigned int ring_drops(void) {
+	struct tpacket_stats_v3 st;
+	socklen_t slen;
+
+	slen = (socklen_t)sizeof st;
+	if (cfg.ring < 0 ||
+			getsockopt(cfg.ring, SOL_PACKET, PACKET_STATISTICS, &st, &slen) < 0)
+		return 0;
+	return st.tp_drops;
+}
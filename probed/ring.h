@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/* A PING read straight out of a ring frame; 'data' points into the ring */
+struct ring_pkt {
+	addr_t addr;
+	uint8_t dscp;
+	/*@dependent@*/ data_t *data;
+	/*@dependent@*/ ts_t ts;
+};
+
+int ring_open(char *port);
+int ring_filter_udp(int s_udp);
+int ring_next(/*@out@*/ struct ring_pkt *rp);
+unsigned int ring_drops(void);
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   snap.c
+ * \brief  mmap'd snapshot of measurement session state, for restarts
+ *
+ * Each measurement session writes its last sequence number and next
+ * deadline straight into a shared file mapping as it sends, so the
+ * snapshot is never more than one PING behind. If probed dies, the
+ * pages stay in the page cache, and snap_sync() flushes them to disk
+ * every SNAP_SYNC_INTERVAL for the case of the whole node going down.
+ * When probed (re)loads its configuration, sessions that are found in
+ * the snapshot continue their sequence numbers and phase, instead of
+ * starting over from sequence number 1.
+ *
+ * Deadlines are on CLOCK_MONOTONIC, so the header keeps the difference
+ * to CLOCK_REALTIME at the last sync, to translate them after a reboot.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "probed.h"
+#include "util.h"
+#include "snap.h"
+
+#define SNAP_MAGIC 0x534c4e47534e4150ULL /* "SLNGSNAP" */
+#define SNAP_VERSION 1
+
+struct snap_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t count; /* Number of records that follow */
+	int64_t clock_diff; /* CLOCK_REALTIME - CLOCK_MONOTONIC at sync */
+};
+
+static struct {
+	int fd;
+	/*@null@*/ struct snap_hdr *map;
+	size_t len;
+	/* Records of the previous configuration, sorted on ID */
+	/*@null@*/ struct snap_rec *saved;
+	int nsaved;
+	ts_t saved_diff;
+} snap = { -1, NULL, 0, NULL, 0, 0 };
+
+static int snap_cmp(const void *a, const void *b);
+
+/**
+ * Open (or create) the snapshot file at 'path'
+ *
+ * A valid snapshot is kept for snap_find(); anything else is ignored,
+ * and overwritten by the next snap_resize().
+ *
+ * \param[in] path Path to the snapshot file
+ * \return         0 on success, -1 on error
+ */
+int snap_open(char *path) {
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		syslog(LOG_ERR, "snap: open: %s: %s", path, strerror(errno));
+		return -1;
+	}
+	return snap_open_fd(fd);
+}
+
+/**
+ * Use the already open snapshot 'fd', such as one handed over by the
+ * probed we took over from (see handoff.c)
+ *
+ * \param[in] fd File descriptor of the snapshot, or -1 for a new one
+ *               that is only kept in memory
+ * \return       0 on success, -1 on error
+ */
+int snap_open_fd(int fd) {
+	struct stat st;
+	struct snap_hdr *h;
+
+	if (fd < 0)
+		fd = memfd_create("probed-snap", 0);
+	if (fd < 0) {
+		syslog(LOG_ERR, "snap: memfd_create: %s", strerror(errno));
+		return -1;
+	}
+	snap.fd = fd;
+	if (fstat(snap.fd, &st) < 0 || st.st_size < (off_t)sizeof *h)
+		return 0;
+	h = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			snap.fd, 0);
+	if (h == MAP_FAILED) {
+		syslog(LOG_ERR, "snap: mmap: %s", strerror(errno));
+		return 0;
+	}
+	snap.map = h;
+	snap.len = (size_t)st.st_size;
+	if (h->magic != SNAP_MAGIC || h->version != SNAP_VERSION ||
+			sizeof *h + h->count * sizeof (struct snap_rec) > snap.len) {
+		syslog(LOG_INFO, "snap: Not a valid snapshot; ignoring");
+		h->count = 0;
+	} else
+		syslog(LOG_INFO, "snap: Resuming %d sessions", (int)h->count);
+	return 0;
+}
+
+/**
+ * Make room for 'n' sessions in the snapshot
+ *
+ * The current records are first saved, for snap_find() to look up
+ * while the sessions of the new configuration are filled in.
+ *
+ * \param[in] n Number of measurement sessions
+ * \return      Pointer to 'n' zeroed records, or NULL if not enabled
+ */
+struct snap_rec *snap_resize(int n) {
+	struct snap_rec *recs;
+	size_t len;
+
+	if (snap.fd < 0)
+		return NULL;
+	/* Save the previous configuration */
+	free(snap.saved);
+	snap.saved = NULL;
+	snap.nsaved = 0;
+	if (snap.map != NULL && snap.map->magic == SNAP_MAGIC &&
+			snap.map->count > 0) {
+		recs = (struct snap_rec *)(snap.map + 1);
+		snap.saved = malloc(snap.map->count * sizeof *recs);
+		if (snap.saved != NULL) {
+			memcpy(snap.saved, recs, snap.map->count * sizeof *recs);
+			snap.nsaved = (int)snap.map->count;
+			snap.saved_diff = snap.map->clock_diff;
+			qsort(snap.saved, (size_t)snap.nsaved, sizeof *snap.saved,
+					snap_cmp);
+		}
+	}
+	if (snap.map != NULL)
+		(void)munmap(snap.map, snap.len);
+	snap.map = NULL;
+	/* Map the new one */
+	len = sizeof (struct snap_hdr) + (size_t)n * sizeof *recs;
+	if (ftruncate(snap.fd, (off_t)len) < 0) {
+		syslog(LOG_ERR, "snap: ftruncate: %s", strerror(errno));
+		return NULL;
+	}
+	snap.map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			snap.fd, 0);
+	if (snap.map == MAP_FAILED) {
+		syslog(LOG_ERR, "snap: mmap: %s", strerror(errno));
+		snap.map = NULL;
+		return NULL;
+	}
+	snap.len = len;
+	memset(snap.map, 0, len);
+	snap.map->magic = SNAP_MAGIC;
+	snap.map->version = SNAP_VERSION;
+	snap.map->count = (uint32_t)n;
+	snap.map->clock_diff = ts_now() - ts_monotonic();
+	return (struct snap_rec *)(snap.map + 1);
+}
+
+/**
+ * Look up session 'id' in the previous configuration
+ *
+ * \param[in]  id  Measurement session ID
+ * \param[out] rec The record found, with 'next' on today's monotonic clock
+ * \return         0 if found, -1 if not
+ */
+int snap_find(num_t id, struct snap_rec *rec) {
+	struct snap_rec key, *r;
+
+	memset(rec, 0, sizeof *rec);
+	if (snap.saved == NULL)
+		return -1;
+	key.id = (uint32_t)id;
+	r = bsearch(&key, snap.saved, (size_t)snap.nsaved, sizeof key, snap_cmp);
+	if (r == NULL)
+		return -1;
+	*rec = *r;
+	rec->next += snap.saved_diff - (ts_now() - ts_monotonic());
+	return 0;
+}
+
+/**
+ * The snapshot file descriptor, to hand over to a successor
+ *
+ * \return File descriptor, or -1 if not enabled
+ */
+int snap_fd(void) {
+	return snap.fd;
+}
+
+/**
+ * Flush the snapshot to disk, without waiting for it
+ */
+void snap_sync(void) {
+	if (snap.map == NULL)
+		return;
+	snap.map->clock_diff = ts_now() - ts_monotonic();
+	(void)msync(snap.map, snap.len, MS_ASYNC);
+}
+
+/**
+ * qsort() and bsearch() comparison of records, on ID
+ */
+static int snap_cmp(const void *a, const void *b) {
+	const struct snap_rec *x = a;
+	const struct snap_rec *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/* State of one measurement session, as kept in the snapshot file */
+struct snap_rec {
+	uint32_t id;
+	uint32_t last_seq; /* Last sequence number sent */
+	int64_t interval; /* nanoseconds */
+	int64_t next; /* Deadline of next PING, CLOCK_MONOTONIC */
+};
+
+int snap_open(char *path);
+int snap_open_fd(int fd);
+/*@null@*/ struct snap_rec *snap_resize(int n);
+int snap_find(num_t id, /*@out@*/ struct snap_rec *rec);
+void snap_sync(void);
+int snap_fd(void);
@@ -33,18 +33,25 @@
 #include "tstamp.h"
 #include "unix.h"
 #include "net.h"
+#include "uring.h"
 
 #ifndef SO_TIMESTAMPING
 #define SO_TIMESTAMPING 37
 #define SCM_TIMESTAMPING SO_TIMESTAMPING
 #endif
 
+/* Newer SO_TIMESTAMPING flags, missing from external/net_tstamp.h */
+#define TSTAMP_OPT_ID (1<<7)
+#define TSTAMP_OPT_TSONLY (1<<11)
+
 struct scm_timestamping {
         struct timespec systime;
         struct timespec hwtimesys;
         struct timespec hwtimeraw;
 };
 
+static int tstamp_hw_ioctl(int sock, char *iface);
+
 /**
  * Try to enable hardware timestamping, otherwise fall back to kernel.
  *
@@ -58,13 +65,43 @@ struct scm_timestamping {
  * \bug             Intel 82580 has bugs such as IPv4 only, and RX issues
  */
 void tstamp_mode_hardware(int sock, char *iface) {
-	struct ifreq dev; /* request to ioctl */
-	struct hwtstamp_config hwcfg; /* hw tstamp cfg to ioctl req */
 	int f = 0; /* flags to setsockopt for socket request */
 	socklen_t slen;
 	
 	slen = (socklen_t)sizeof f;
 	/* STEP 1: ENABLE HW TIMESTAMP ON IFACE IN IOCTL */
+	if (tstamp_hw_ioctl(sock, iface) < 0) {
+		/* otherwise, try kernel timestamps (socket only) */ 
+		syslog(LOG_INFO, "Falling back to kernel timestamps");
+		tstamp_mode_kernel(sock);
+		return;
+	}
+	/* STEP 2: ENABLE NANOSEC TIMESTAMPING ON SOCKET */
+	f |= SOF_TIMESTAMPING_TX_HARDWARE;
+	f |= SOF_TIMESTAMPING_RX_HARDWARE;
+	f |= SOF_TIMESTAMPING_RAW_HARDWARE;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &f, slen) < 0) {
+		/* bail to userland timestamps (socket only) */ 
+		syslog(LOG_ERR, "SO_TIMESTAMPING: %s", strerror(errno));
+		syslog(LOG_INFO, "Falling back to userland timestamps");
+		tstamp_mode_userland(sock);
+		return;
+	}
+	syslog(LOG_INFO, "Using hardware timestamps");
+	cfg.ts = HARDWARE;
+}
+
+/**
+ * Enable hardware timestamps in the NIC of 'iface', with SIOCSHWTSTAMP
+ *
+ * \param[in] sock  Any socket, to run the ioctl on
+ * \param[in] iface The interface name
+ * \return          0 on success, -1 on error
+ */
+static int tstamp_hw_ioctl(int sock, char *iface) {
+	struct ifreq dev; /* request to ioctl */
+	struct hwtstamp_config hwcfg; /* hw tstamp cfg to ioctl req */
+
 	memset(&dev, 0, sizeof dev);
 	/*@ -mayaliasunique Trust me, iface and dev doesn't share storage */
 	strncpy(dev.ifr_name, iface, sizeof dev.ifr_name);
@@ -85,24 +122,45 @@ void tstamp_mode_hardware(int sock, char *iface) {
 		syslog(LOG_ERR, "ioctl: SIOCSHWTSTAMP: %s", strerror(errno));
 		syslog(LOG_ERR, "Verify that %s supports hardware timestamp\n",
 			       iface);
-		/* otherwise, try kernel timestamps (socket only) */ 
-		syslog(LOG_INFO, "Falling back to kernel timestamps");
-		tstamp_mode_kernel(sock);
-		return;
+		return -1;
 	}
-	/* STEP 2: ENABLE NANOSEC TIMESTAMPING ON SOCKET */
-	f |= SOF_TIMESTAMPING_TX_HARDWARE;
-	f |= SOF_TIMESTAMPING_RX_HARDWARE;
-	f |= SOF_TIMESTAMPING_RAW_HARDWARE;
-	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &f, slen) < 0) {
-		/* bail to userland timestamps (socket only) */ 
+	return 0;
+}
+
+/**
+ * Give socket 'sock' on interface 'iface' the timestamping of 'from'
+ *
+ * The timestamp mode, and so the parsers of tstamp_backend_select(),
+ * is the same for all sockets; this does not fall back to another mode,
+ * but fails if 'sock' cannot have the one of 'from'. In hardware mode,
+ * the NIC of 'iface' also has its timestamping enabled.
+ *
+ * \param[in] from  A socket set up by one of the tstamp_mode_*()
+ * \param[in] sock  The socket to set up the same way
+ * \param[in] iface The interface 'sock' is bound to
+ * \return          0 on success, -1 on error
+ */
+int tstamp_mode_copy(int from, int sock, char *iface) {
+	int f = 0;
+	socklen_t slen;
+
+	slen = (socklen_t)sizeof f;
+	if (cfg.ts == USERLAND) {
+		f = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &f, slen) < 0) {
+			syslog(LOG_ERR, "SO_TIMESTAMP: %s", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	if (cfg.ts == HARDWARE && tstamp_hw_ioctl(sock, iface) < 0)
+		return -1;
+	if (getsockopt(from, SOL_SOCKET, SO_TIMESTAMPING, &f, &slen) < 0 ||
+			setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &f, slen) < 0) {
 		syslog(LOG_ERR, "SO_TIMESTAMPING: %s", strerror(errno));
-		syslog(LOG_INFO, "Falling back to userland timestamps");
-		tstamp_mode_userland(sock);
-		return;
+		return -1;
 	}
-	syslog(LOG_INFO, "Using hardware timestamps");
-	cfg.ts = HARDWARE;
+	return 0;
 }
 
 /**
@@ -151,66 +209,198 @@ void tstamp_mode_userland(sock) {
 	cfg.ts = USERLAND;
 }
 
+/*
+ * Timestamp parsers, one per mode, so that the per-packet path only looks
+ * for the control messages its mode can produce. The kernel and hardware
+ * variants share an inline body with a constant 'hw', which the compiler
+ * turns into two branch-free copies. The active ones are picked once by
+ * tstamp_backend_select(); until then the userland ones are used.
+ */
+static int tstamp_rx_userland(struct msghdr *msg, /*@out@*/ ts_t *ts);
+static int tstamp_tx_userland(struct msghdr *msg, /*@out@*/ ts_t *ts);
+int (*tstamp_extract_rx)(struct msghdr *msg, /*@out@*/ ts_t *ts) =
+	tstamp_rx_userland;
+int (*tstamp_extract_tx)(struct msghdr *msg, /*@out@*/ ts_t *ts) =
+	tstamp_tx_userland;
+/* The same, with the OPT_ID of the datagram, for tstamp_fetch_tx_batch() */
+static int tstamp_tx_id_userland(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		/*@out@*/ uint32_t *id);
+static int (*tstamp_extract_tx_id)(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		/*@out@*/ uint32_t *id) = tstamp_tx_id_userland;
+
 /**
- * Extracts the timestamp from a packet 'msg's CMSG data
+ * Extract the RX timestamp of a packet in userland mode (SO_TIMESTAMPNS)
+ *
+ * \param[in]  msg Pointer to the message's header data
+ * \param[out] ts  Pointer to location where timestamp is saved
+ * \return         0 on success, -1 if there was no timestamp
+ */
+static int tstamp_rx_userland(struct msghdr *msg, /*@out@*/ ts_t *ts) {
+	struct cmsghdr *cmsg;
+	struct timespec *t;
+
+	*ts = 0;
+	/*@ -branchstate Don't care about cmsg storage */
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SO_TIMESTAMPNS) {
+			t = (struct timespec *)CMSG_DATA(cmsg);
+			*ts = TS_FROM_TIMESPEC(*t);
+			return 0;
+		}
+	}
+	/*@ +branchstate */
+	return -1;
+}
+
+/**
+ * There are no TX timestamps on the error queue in userland mode
+ */
+static int tstamp_tx_userland(/*@unused@*/ struct msghdr *msg,
+		/*@out@*/ ts_t *ts) {
+	*ts = 0;
+	return -1;
+}
+
+/**
+ * Extract the RX timestamp of a packet from SO_TIMESTAMPING
  *
- * Normally invoked only by recv_w_ts(), and indirectly by send_w_ts() via
- * the function tstamp_fetch_tx(). Depending on timestamp method (defined
- * in the global variable cfg's 'ts' field) fetch the correct CMSG field
- * and store it's timestamp.
- * 
  * \param[in]  msg Pointer to the message's header data
  * \param[out] ts  Pointer to location where timestamp is saved
+ * \param[in]  hw  1 for the raw hardware timestamp, 0 for the kernel's
+ * \return         0 on success, -1 if there was no timestamp
  */
-int tstamp_extract(struct msghdr *msg, /*@out@*/ ts_t *ts, int tx) {
+static inline int tstamp_rx_so(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		const int hw) {
 	struct cmsghdr *cmsg;
 	struct scm_timestamping *t;
-	ts_t *ts_p;
-	int ok = 0;
-	struct sock_extended_err *err;
 
-	/* Check message headers */
-	memset(ts, 0, sizeof *ts);
+	*ts = 0;
 	/*@ -branchstate Don't care about cmsg storage */
 	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-		if (cmsg->cmsg_level == SOL_SOCKET) {
-			/* if hw/kernel timestamps, check SO_TIMESTAMPING */
-			if (cfg.ts != USERLAND &&
-					cmsg->cmsg_type == SO_TIMESTAMPING) {
-				t = (struct scm_timestamping *)CMSG_DATA(cmsg);
-				/*@ -onlytrans Let me copy the timestamp */
-				if (cfg.ts == HARDWARE) *ts = t->hwtimeraw;
-				if (cfg.ts == KERNEL) *ts = t->systime;
-				/*@ +onlytrans */
-				if (!tx) return 0;
-				else ok |= 1;
-				if (ok == 3) return 0;
-			}
-			/* if RX software timestamps, check SO_TIMESTAMPNS */
-			if (cfg.ts == USERLAND
-					&& cmsg->cmsg_type == SO_TIMESTAMPNS) {
-				ts_p = (struct timespec *)CMSG_DATA(cmsg);
-				*ts = *ts_p;
-				return 0;
-			}
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SO_TIMESTAMPING) {
+			t = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			if (hw)
+				*ts = TS_FROM_TIMESPEC(t->hwtimeraw);
+			else
+				*ts = TS_FROM_TIMESPEC(t->systime);
+			return 0;
 		}
-		/* Check that this is the right packet */
-		if (tx && cmsg->cmsg_level == IPPROTO_IPV6) {
-			if (cmsg->cmsg_type == IPV6_RECVERR) {
-				err = (struct sock_extended_err
-					 *)CMSG_DATA(cmsg);
-				if (err->ee_origin ==
-						SO_EE_ORIGIN_TIMESTAMPING) {
-					ok |= 2;
-					if (ok == 3) return 0;
-				}
+	}
+	/*@ +branchstate */
+	return -1;
+}
+
+/**
+ * Extract the TX timestamp of an error queue message from SO_TIMESTAMPING
+ *
+ * Both the timestamp and the extended error saying that it is a
+ * timestamp (and not, for example, an ICMP error) have to be present.
+ *
+ * \param[in]  msg Pointer to the message's header data
+ * \param[out] ts  Pointer to location where timestamp is saved
+ * \param[out] id  Pointer to the OPT_ID of the datagram, or NULL
+ * \param[in]  hw  1 for the raw hardware timestamp, 0 for the kernel's
+ * \return         0 on success, -1 if it was not a TX timestamp
+ */
+static inline int tstamp_tx_so(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		/*@null@*/ uint32_t *id, const int hw) {
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *t;
+	struct sock_extended_err *err;
+	int ok = 0;
+
+	*ts = 0;
+	/*@ -branchstate Don't care about cmsg storage */
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SO_TIMESTAMPING) {
+			t = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			if (hw)
+				*ts = TS_FROM_TIMESPEC(t->hwtimeraw);
+			else
+				*ts = TS_FROM_TIMESPEC(t->systime);
+			ok |= 1;
+		} else if ((cmsg->cmsg_level == IPPROTO_IPV6 &&
+					cmsg->cmsg_type == IPV6_RECVERR) ||
+				(cmsg->cmsg_level == IPPROTO_IP &&
+				 cmsg->cmsg_type == IP_RECVERR)) {
+			/* Check that this is the right packet */
+			err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+				if (id != NULL)
+					*id = err->ee_data;
+				ok |= 2;
 			}
 		}
+		if (ok == 3)
+			return 0;
 	}
 	/*@ +branchstate */
 	return -1;
 }
 
+static int tstamp_rx_kernel(struct msghdr *msg, /*@out@*/ ts_t *ts) {
+	return tstamp_rx_so(msg, ts, 0);
+}
+static int tstamp_rx_hardware(struct msghdr *msg, /*@out@*/ ts_t *ts) {
+	return tstamp_rx_so(msg, ts, 1);
+}
+static int tstamp_tx_kernel(struct msghdr *msg, /*@out@*/ ts_t *ts) {
+	return tstamp_tx_so(msg, ts, NULL, 0);
+}
+static int tstamp_tx_hardware(struct msghdr *msg, /*@out@*/ ts_t *ts) {
+	return tstamp_tx_so(msg, ts, NULL, 1);
+}
+static int tstamp_tx_id_kernel(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		/*@out@*/ uint32_t *id) {
+	return tstamp_tx_so(msg, ts, id, 0);
+}
+static int tstamp_tx_id_hardware(struct msghdr *msg, /*@out@*/ ts_t *ts,
+		/*@out@*/ uint32_t *id) {
+	return tstamp_tx_so(msg, ts, id, 1);
+}
+static int tstamp_tx_id_userland(/*@unused@*/ struct msghdr *msg,
+		/*@out@*/ ts_t *ts, /*@out@*/ uint32_t *id) {
+	*ts = 0;
+	*id = 0;
+	return -1;
+}
+
+/**
+ * Pick the timestamp parsers and the send routines for the final mode
+ *
+ * Run once at startup, after the timestamp mode (with its fallbacks) and
+ * the I/O backend are settled, so the per-packet path never looks at
+ * cfg.ts or cfg.uring again.
+ */
+void tstamp_backend_select(void) {
+	if (cfg.ts == HARDWARE) {
+		tstamp_extract_rx = tstamp_rx_hardware;
+		tstamp_extract_tx = tstamp_tx_hardware;
+		tstamp_extract_tx_id = tstamp_tx_id_hardware;
+	} else if (cfg.ts == KERNEL) {
+		tstamp_extract_rx = tstamp_rx_kernel;
+		tstamp_extract_tx = tstamp_tx_kernel;
+		tstamp_extract_tx_id = tstamp_tx_id_kernel;
+	} else {
+		tstamp_extract_rx = tstamp_rx_userland;
+		tstamp_extract_tx = tstamp_tx_userland;
+		tstamp_extract_tx_id = tstamp_tx_id_userland;
+	}
+	if (cfg.uring >= 0) {
+		send_w_ts = uring_send_w_ts;
+		send_train_w_ts = send_train_w_ts_each;
+	} else if (cfg.ts == USERLAND) {
+		send_w_ts = send_w_ts_userland;
+		send_train_w_ts = send_train_w_ts_userland;
+	} else {
+		send_w_ts = send_w_ts_kernel;
+		send_train_w_ts = send_train_w_ts_kernel;
+	}
+}
+
 /**
  * Fetch a TX timestamp, should be executed right after send()
  *
@@ -256,3 +446,95 @@ int tstamp_fetch_tx(int sock, /*@out@*/ ts_t *ts) {
 	}
 	return -1;
 }
+
+/**
+ * Tag TX timestamps on the error queue with a per-socket packet counter
+ *
+ * Adds SOF_TIMESTAMPING_OPT_ID to the timestamping flags already set on
+ * 'sock', so that timestamps of batched sends can be told apart by
+ * tstamp_fetch_tx_batch(). The counter starts at 0 when this is called,
+ * and increases with one for each datagram sent. In userland mode,
+ * there are no TX timestamps to tag, and nothing is done.
+ *
+ * \param[in] sock The socket with SO_TIMESTAMPING active
+ * \return         0 on success, -1 on error
+ */
+int tstamp_opt_id(int sock) {
+	int f = 0;
+	socklen_t slen;
+
+	if (cfg.ts == USERLAND)
+		return 0;
+	slen = (socklen_t)sizeof f;
+	if (getsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &f, &slen) < 0) {
+		syslog(LOG_ERR, "SO_TIMESTAMPING: %s", strerror(errno));
+		return -1;
+	}
+	f |= TSTAMP_OPT_ID | TSTAMP_OPT_TSONLY;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &f, slen) < 0) {
+		syslog(LOG_ERR, "SO_TIMESTAMPING: OPT_ID: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Fetch the TX timestamps of 'n' datagrams sent in one batch
+ *
+ * Like tstamp_fetch_tx(), but for sockets prepared with tstamp_opt_id().
+ * The error queue is read until timestamps with the IDs 'first' to
+ * 'first' + 'n' - 1 have been seen, or approx 10 ms have passed. Those
+ * with older IDs are left-overs from earlier batches, and are dropped.
+ *
+ * \param[in]  sock  Socket to read timestamps from
+ * \param[out] ts    Array of 'n' timestamps, zero if missing
+ * \param[in]  n     Number of datagrams in the batch
+ * \param[in]  first The OPT_ID counter value of the first datagram
+ * \return           Number of timestamps found
+ */
+int tstamp_fetch_tx_batch(int sock, /*@out@*/ ts_t *ts, int n, uint32_t first) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[512];
+	char data[DATALEN];
+	fd_set fs;
+	struct timeval tv, now, last, tmp;
+	ts_t got_ts;
+	uint32_t key;
+	int got = 0;
+
+	memset(ts, 0, sizeof *ts * (size_t)n);
+	(void)gettimeofday(&last, 0);
+	tmp.tv_sec = 0;
+	tmp.tv_usec = 0;
+	while (got < n && tmp.tv_sec == 0 && tmp.tv_usec < 10000) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000 - tmp.tv_usec;
+		unix_fd_zero(&fs);
+		unix_fd_set(sock, &fs);
+		if (select(sock + 1, &fs, NULL, NULL, &tv) < 1)
+			break;
+		while (got < n) {
+			memset(&msg, 0, sizeof msg);
+			iov.iov_base = data;
+			iov.iov_len = sizeof data;
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof control;
+			if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+				break;
+			if (tstamp_extract_tx_id(&msg, &got_ts, &key) < 0)
+				continue;
+			/* Unsigned math; older IDs wrap to huge values */
+			if (key - first >= (uint32_t)n)
+				continue;
+			if (ts[key - first] == 0)
+				got++;
+			ts[key - first] = got_ts;
+		}
+		(void)gettimeofday(&now, 0);
+		timersub(&now, &last, &tmp);
+	}
+	return got;
+}
@@ -8,5 +8,10 @@
 void tstamp_mode_hardware(int sock, char *iface);
 void tstamp_mode_kernel(int sock);
 void tstamp_mode_userland(int sock);
-int tstamp_extract(struct msghdr *msg, /*@out@*/ ts_t *ts, int tx);
+int tstamp_mode_copy(int from, int sock, char *iface);
+extern int (*tstamp_extract_rx)(struct msghdr *msg, /*@out@*/ ts_t *ts);
+extern int (*tstamp_extract_tx)(struct msghdr *msg, /*@out@*/ ts_t *ts);
+void tstamp_backend_select(void);
 int tstamp_fetch_tx(int sock, /*@out@*/ ts_t *ts);
+int tstamp_opt_id(int sock);
+int tstamp_fetch_tx_batch(int sock, /*@out@*/ ts_t *ts, int n, uint32_t first);
@@ -0,0 +1,737 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+/**
+ * \file   uring.c
+ * \brief  io_uring backend for the UDP socket and TCP timestamp sends
+ *
+ * The select() based loop costs one system call for select, recvmsg,
+ * sendto, setsockopt (DSCP), the MSG_ERRQUEUE read and every TCP send.
+ * With this backend, the UDP socket is read by one multishot recvmsg
+ * into a ring of provided buffers, DSCP travels as ancillary data, and
+ * sends are submitted as linked operations:
+ *
+ * - PONG/PING with TX timestamp: sendmsg > poll(POLLERR) > recvmsg
+ *   (MSG_ERRQUEUE), with a 10 ms link timeout, like tstamp_fetch_tx()
+ * - PONG in userland mode: sendmsg > TCP send of T2/T3, fire and forget
+ *
+ * The receive buffers are a provided buffer ring (IORING_REGISTER_PBUF_RING),
+ * not fixed buffers (IORING_REGISTER_BUFFERS): multishot recvmsg takes
+ * its buffers from a provided ring only, and the sends are a few small
+ * packets each, for which registering saves next to nothing.
+ *
+ * Completions signal an eventfd, which the main loop select()s on
+ * instead of the UDP socket. The ring is driven with raw system calls,
+ * so no liburing is needed; just Linux 6.0 or newer. Without it, or
+ * when the kernel refuses, uring_open() fails and the normal socket
+ * path is used. Linux 5.19 has provided buffer rings, but not multishot
+ * recvmsg, which it fails with EINVAL; uring_open() sees that at once,
+ * as the failure is posted when the recvmsg is submitted. Should it
+ * come later, before any packet, uring_usable() tells the main loop to
+ * uring_close() the ring and go back to the socket.
+ */
+
+#include <stdlib.h>
+#ifndef S_SPLINT_S /* SPlint 3.1.2 bug */
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include "probed.h"
+#include "uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "tstamp.h"
+#include "util.h"
+#include "net.h"
+#include "log.h"
+
+/* Submission queue size */
+#define URING_ENTRIES 256
+/* Completion queue size */
+#define URING_CQ_ENTRIES 4096
+/* Provided receive buffers, power of two, and their size */
+#define URING_BUFS 256
+#define URING_BUF_SIZE 1024
+#define URING_CTRL_LEN 512
+/* Asynchronous sends in flight */
+#define URING_SLOTS 256
+/* Wait for TX timestamp [nanoseconds], as tstamp_fetch_tx() */
+#define URING_TX_TIMEOUT 10000000
+
+/* user_data is tag << 32 | slot */
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_POLL 3
+#define TAG_ERRQ 4
+#define TAG_TIMEOUT 5
+#define TAG_ASYNC_UDP 6
+#define TAG_ASYNC_TCP 7
+#define URING_TAG(t, s) (((uint64_t)(t) << 32) | (uint64_t)(s))
+
+/* An asynchronous send; its buffers live until all completions are in */
+struct uring_slot {
+	int pending;
+	int fd;
+	struct msghdr msg;
+	struct iovec iov;
+	addr_t addr;
+	char ctrl[CMSG_SPACE(sizeof (int))];
+	char udp[DATALEN];
+	char tcp[DATALEN];
+};
+
+static struct {
+	int fd;
+	int efd;
+	int s_udp;
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_local; /* Our SQ tail, published in uring_flush() */
+	unsigned int to_submit;
+	/* Provided buffers for the multishot recvmsg */
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	uint16_t br_tail;
+	struct msghdr rx_msg;
+	int rearm;
+	int got_buf; /* A packet was received; multishot works */
+	int no_multishot; /* EINVAL before that; it does not */
+	/* Receive completions waiting for uring_recv() */
+	struct io_uring_cqe backlog[URING_BUFS + 1];
+	unsigned int bl_head, bl_tail;
+	/* Synchronous send state */
+	uint8_t dscp;
+	struct msghdr tx_msg;
+	struct iovec tx_iov;
+	char tx_ctrl[CMSG_SPACE(sizeof (int))];
+	struct msghdr errq_msg;
+	struct iovec errq_iov;
+	char errq_data[DATALEN];
+	char errq_ctrl[URING_CTRL_LEN];
+	struct __kernel_timespec tx_timeout;
+	int sync_pending;
+	int send_res;
+	int errq_res;
+	/* Asynchronous sends */
+	struct uring_slot slots[URING_SLOTS];
+	unsigned int slot_next;
+	int dead[URING_SLOTS];
+	int dead_n;
+} ur;
+
+static int uring_enter(unsigned int submit, unsigned int wait);
+static /*@null@*/ struct io_uring_sqe *uring_sqe(void);
+static void uring_reap(void);
+static void uring_arm_recv(void);
+static void uring_buf_put(uint16_t bid);
+static /*@null@*/ struct uring_slot *uring_slot(void);
+static void uring_msg(struct msghdr *msg, struct iovec *iov, char *ctrl,
+		addr_t *addr, char *data, uint8_t dscp);
+
+/**
+ * Set up an io_uring for the UDP socket 's_udp', start receiving on it
+ *
+ * \param[in] s_udp The UDP socket, timestamping already enabled
+ * \return          An eventfd to select() on for completions, or -1
+ */
+int uring_open(int s_udp) {
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg;
+	uint8_t ops[] = { IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_SEND,
+		IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT };
+	size_t sq_len, cq_len, i;
+	uint8_t *sq, *cq;
+	int efd;
+
+	memset(&ur, 0, sizeof ur);
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	ur.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ur.fd < 0) {
+		syslog(LOG_ERR, "io_uring_setup: %s", strerror(errno));
+		return -1;
+	}
+	/* Check that the kernel knows all operations we use */
+	probe = calloc(1, sizeof *probe + 256 * sizeof probe->ops[0]);
+	if (probe == NULL ||
+			syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PROBE,
+				probe, 256) < 0) {
+		syslog(LOG_ERR, "io_uring: probe: %s", strerror(errno));
+		free(probe);
+		(void)close(ur.fd);
+		return -1;
+	}
+	for (i = 0; i < sizeof ops; i++) {
+		if (ops[i] > probe->last_op ||
+				(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+			syslog(LOG_ERR, "io_uring: operation %d not supported", ops[i]);
+			free(probe);
+			(void)close(ur.fd);
+			return -1;
+		}
+	}
+	free(probe);
+
+	/* Map submission and completion rings, and the SQE array */
+	sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		sq_len = cq_len = MAX(sq_len, cq_len);
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		syslog(LOG_ERR, "io_uring: mmap: %s", strerror(errno));
+		(void)close(ur.fd);
+		return -1;
+	}
+	cq = sq;
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_CQ_RING);
+	ur.sqes = mmap(NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd,
+			IORING_OFF_SQES);
+	if (cq == MAP_FAILED || ur.sqes == MAP_FAILED) {
+		syslog(LOG_ERR, "io_uring: mmap: %s", strerror(errno));
+		(void)close(ur.fd);
+		return -1;
+	}
+	ur.sq_entries = p.sq_entries;
+	ur.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ur.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ur.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ur.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ur.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ur.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ur.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ur.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ur.sq_local = *ur.sq_tail;
+
+	/* Register the provided buffer ring, group 0, and fill it */
+	ur.br = mmap(NULL, URING_BUFS * sizeof (struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ur.bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	if (ur.br == MAP_FAILED || ur.bufs == NULL) {
+		syslog(LOG_ERR, "io_uring: buffers: %s", strerror(errno));
+		(void)close(ur.fd);
+		return -1;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t)(uintptr_t)ur.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) {
+		syslog(LOG_ERR, "io_uring: PBUF_RING: %s", strerror(errno));
+		(void)close(ur.fd);
+		return -1;
+	}
+	ur.br_tail = 0;
+	for (i = 0; i < URING_BUFS; i++)
+		uring_buf_put((uint16_t)i);
+
+	/* Completions are signalled on an eventfd */
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0 || syscall(__NR_io_uring_register, ur.fd,
+				IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+		syslog(LOG_ERR, "io_uring: eventfd: %s", strerror(errno));
+		if (efd >= 0)
+			(void)close(efd);
+		(void)close(ur.fd);
+		return -1;
+	}
+	ur.efd = efd;
+
+	ur.s_udp = s_udp;
+	ur.rx_msg.msg_namelen = (socklen_t)sizeof (addr_t);
+	ur.rx_msg.msg_controllen = URING_CTRL_LEN;
+	ur.errq_iov.iov_base = ur.errq_data;
+	ur.errq_iov.iov_len = sizeof ur.errq_data;
+	ur.tx_timeout.tv_sec = 0;
+	ur.tx_timeout.tv_nsec = URING_TX_TIMEOUT;
+	uring_arm_recv();
+	uring_flush();
+	uring_reap();
+	if (uring_usable() == 0) {
+		uring_close();
+		return -1;
+	}
+	syslog(LOG_INFO, "Using io_uring for UDP and timestamp I/O");
+	return efd;
+}
+
+/**
+ * Fetch the next received packet, with RX timestamp and DSCP
+ *
+ * The io_uring counterpart of recv_w_ts(), for normal packets.
+ *
+ * \param[out] pkt Pointer to pkt, where addr, data and tstamp is placed
+ * \return         0 if a packet was received, -1 if there are none
+ */
+int uring_recv(/*@out@*/ pkt_t *pkt) {
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msg;
+	uint8_t *buf, *name, *ctrl;
+	uint16_t bid;
+	int ok;
+
+	while (1 == 1) {
+		if (ur.bl_head == ur.bl_tail)
+			uring_reap();
+		if (ur.bl_head == ur.bl_tail) {
+			/* Nothing more; make sure a re-arm is submitted */
+			uring_flush();
+			return -1;
+		}
+		bid = (uint16_t)(ur.backlog[ur.bl_head].flags >>
+				IORING_CQE_BUFFER_SHIFT);
+		ur.bl_head = (ur.bl_head + 1) % (URING_BUFS + 1);
+		buf = ur.bufs + (size_t)bid * URING_BUF_SIZE;
+		out = (struct io_uring_recvmsg_out *)buf;
+		name = buf + sizeof *out;
+		ctrl = name + ur.rx_msg.msg_namelen;
+		ok = (out->payloadlen == DATALEN && (out->flags & MSG_TRUNC) == 0);
+		if (ok == 1) {
+			memset(pkt, 0, sizeof *pkt);
+			memcpy(&pkt->addr, name, MIN(out->namelen, sizeof pkt->addr));
+			memcpy(pkt->data, ctrl + ur.rx_msg.msg_controllen, DATALEN);
+			memset(&msg, 0, sizeof msg);
+			msg.msg_control = ctrl;
+			msg.msg_controllen = out->controllen;
+			if (tstamp_extract_rx(&msg, &pkt->ts) < 0)
+				log_msg(LOGT_TSTAMP, LOG_ERR, "uring_recv: RX tstamp error");
+			if (dscp_extract(&msg, &pkt->dscp) < 0)
+				log_msg(LOGT_DSCP, LOG_ERR, "uring_recv: DSCP error");
+			drops_count(ur.s_udp, &msg);
+		}
+		uring_buf_put(bid);
+		if (ok == 1)
+			return 0;
+	}
+}
+
+/**
+ * Set the DSCP of following sends, instead of setsockopt() in dscp_set()
+ */
+void uring_dscp(uint8_t dscp) {
+	ur.dscp = dscp;
+}
+
+/**
+ * Send 'data' to 'addr' with timestamp, and wait for it
+ *
+ * The io_uring counterpart of send_w_ts(). In kernel and hardware mode,
+ * the send, the wait for POLLERR and the MSG_ERRQUEUE read are linked,
+ * and submitted in one system call.
+ *
+ * \param[in]  sock Unused; the ring sends on the socket it was opened with
+ * \param[in]  addr Pointer to address where to send the data
+ * \param[in]  data Pointer to the DATALEN bytes to send
+ * \param[out] ts   Pointer to ts, where to put the TX timestamp
+ * \return          0 on success, -1 on send or timestamp error
+ */
+int uring_send_w_ts(/*@unused@*/ int sock, addr_t *addr, char *data,
+		/*@out@*/ ts_t *ts) {
+	struct io_uring_sqe *sqe;
+
+	memset(ts, 0, sizeof *ts);
+	if (cfg.ts == USERLAND)
+		*ts = ts_now();
+	uring_msg(&ur.tx_msg, &ur.tx_iov, ur.tx_ctrl, addr, data, ur.dscp);
+	ur.send_res = 0;
+	ur.errq_res = -1;
+	ur.sync_pending = 1;
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = ur.s_udp;
+	sqe->addr = (uint64_t)(uintptr_t)&ur.tx_msg;
+	sqe->len = 1;
+	sqe->user_data = URING_TAG(TAG_SEND, 0);
+	if (cfg.ts != USERLAND) {
+		ur.sync_pending = 3;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = ur.s_udp;
+		sqe->poll32_events = POLLERR;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = URING_TAG(TAG_POLL, 0);
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (uint64_t)(uintptr_t)&ur.tx_timeout;
+		sqe->len = 1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = URING_TAG(TAG_TIMEOUT, 0);
+		memset(&ur.errq_msg, 0, sizeof ur.errq_msg);
+		ur.errq_msg.msg_iov = &ur.errq_iov;
+		ur.errq_msg.msg_iovlen = 1;
+		ur.errq_msg.msg_control = ur.errq_ctrl;
+		ur.errq_msg.msg_controllen = sizeof ur.errq_ctrl;
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = ur.s_udp;
+		sqe->addr = (uint64_t)(uintptr_t)&ur.errq_msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_ERRQUEUE;
+		sqe->user_data = URING_TAG(TAG_ERRQ, 0);
+	}
+	while (ur.sync_pending > 0) {
+		if (uring_enter(ur.to_submit, 1) < 0 && errno != EINTR)
+			break;
+		uring_reap();
+	}
+	if (ur.send_res < 0) {
+		log_msg(LOGT_SEND, LOG_INFO, "sendmsg: %s", strerror(-ur.send_res));
+		return -1;
+	}
+	if (cfg.ts != USERLAND) {
+		if (ur.errq_res < 0 || tstamp_extract_tx(&ur.errq_msg, ts) < 0) {
+			log_msg(LOGT_TSTAMP, LOG_ERR, "uring_send_w_ts: TX tstamp error");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Queue a UDP send to 'addr', and a linked TCP send on 'fd'
+ *
+ * Used for PONGs in userland mode, where T3 is known before sending.
+ * The TCP send only happens if the UDP send succeeded. Nothing is
+ * submitted until uring_flush(). With 'fd' < 0, only the UDP is sent.
+ *
+ * \param[in] addr Pointer to address where to send 'udp'
+ * \param[in] udp  Pointer to the DATALEN bytes of UDP data
+ * \param[in] fd   TCP socket, or -1
+ * \param[in] tcp  Pointer to the DATALEN bytes of TCP data
+ * \return         0 on success, -1 on error
+ */
+int uring_send_linked(addr_t *addr, char *udp, int fd, char *tcp) {
+	struct uring_slot *s;
+	struct io_uring_sqe *sqe;
+
+	s = uring_slot();
+	if (s == NULL)
+		return -1;
+	memcpy(&s->addr, addr, sizeof s->addr);
+	memcpy(s->udp, udp, DATALEN);
+	uring_msg(&s->msg, &s->iov, s->ctrl, &s->addr, s->udp, ur.dscp);
+	s->fd = fd;
+	s->pending = 1;
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = ur.s_udp;
+	sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+	sqe->len = 1;
+	sqe->user_data = URING_TAG(TAG_ASYNC_UDP, s - ur.slots);
+	if (fd >= 0) {
+		s->pending = 2;
+		sqe->flags = IOSQE_IO_LINK;
+		memcpy(s->tcp, tcp, DATALEN);
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)s->tcp;
+		sqe->len = DATALEN;
+		sqe->user_data = URING_TAG(TAG_ASYNC_TCP, s - ur.slots);
+	}
+	return 0;
+}
+
+/**
+ * Queue a TCP timestamp send on 'fd', submitted by uring_flush()
+ *
+ * A failed send shows up in uring_dead_fd() later on.
+ *
+ * \param[in] fd   TCP socket
+ * \param[in] data Pointer to the DATALEN bytes to send
+ * \return         0 on success, -1 on error
+ */
+int uring_send_tcp(int fd, char *data) {
+	struct uring_slot *s;
+	struct io_uring_sqe *sqe;
+
+	s = uring_slot();
+	if (s == NULL)
+		return -1;
+	memcpy(s->tcp, data, DATALEN);
+	s->fd = fd;
+	s->pending = 1;
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)s->tcp;
+	sqe->len = DATALEN;
+	sqe->user_data = URING_TAG(TAG_ASYNC_TCP, s - ur.slots);
+	return 0;
+}
+
+/**
+ * Submit everything queued, in one system call
+ */
+void uring_flush(void) {
+	if (ur.to_submit > 0)
+		(void)uring_enter(ur.to_submit, 0);
+}
+
+/**
+ * Whether the ring still receives; not if the kernel has no multishot
+ * recvmsg
+ *
+ * \return 1 if it does, 0 if it has to be closed with uring_close()
+ */
+int uring_usable(void) {
+	return ur.no_multishot == 0 ? 1 : 0;
+}
+
+/**
+ * Close the ring and its eventfd, to go back to socket I/O
+ *
+ * The receive buffers are not freed, as the kernel cancels what is in
+ * flight after the ring is closed.
+ */
+void uring_close(void) {
+	(void)close(ur.efd);
+	(void)close(ur.fd);
+	ur.efd = -1;
+	ur.fd = -1;
+}
+
+/**
+ * Return a TCP socket whose timestamp send failed, one at a time
+ *
+ * \return File descriptor, or -1 if there are no more
+ */
+int uring_dead_fd(void) {
+	uring_reap();
+	if (ur.dead_n == 0)
+		return -1;
+	return ur.dead[--ur.dead_n];
+}
+
+/**
+ * Publish queued SQEs, and enter the kernel to submit and/or wait
+ */
+static int uring_enter(unsigned int submit, unsigned int wait) {
+	int ret;
+
+	__atomic_store_n(ur.sq_tail, ur.sq_local, __ATOMIC_RELEASE);
+	ret = (int)syscall(__NR_io_uring_enter, ur.fd, submit, wait,
+			wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret > 0)
+		ur.to_submit -= (unsigned int)ret;
+	return ret;
+}
+
+/**
+ * Get a zeroed SQE, submitting what is queued if the ring is full
+ */
+static struct io_uring_sqe *uring_sqe(void) {
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while (ur.sq_local - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE) >=
+			ur.sq_entries) {
+		if (uring_enter(ur.to_submit, 0) < 0 && errno != EINTR &&
+				errno != EAGAIN && errno != EBUSY)
+			syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+		uring_reap();
+	}
+	idx = ur.sq_local & *ur.sq_mask;
+	sqe = &ur.sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	ur.sq_array[idx] = idx;
+	ur.sq_local++;
+	ur.to_submit++;
+	return sqe;
+}
+
+/**
+ * Walk all completions; queue receives, account for sends
+ */
+static void uring_reap(void) {
+	struct io_uring_cqe *cqe;
+	struct uring_slot *s;
+	unsigned int head;
+	uint32_t tag, slot;
+
+	head = *ur.cq_head;
+	while (head != __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ur.cqes[head & *ur.cq_mask];
+		tag = (uint32_t)(cqe->user_data >> 32);
+		slot = (uint32_t)(cqe->user_data & 0xffffffff);
+		s = &ur.slots[slot % URING_SLOTS];
+		switch (tag) {
+			case TAG_RECV:
+				if (cqe->res >= 0 &&
+						(cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+					ur.backlog[ur.bl_tail] = *cqe;
+					ur.bl_tail = (ur.bl_tail + 1) % (URING_BUFS + 1);
+					ur.got_buf = 1;
+				} else if (cqe->res == -EINVAL && ur.got_buf == 0) {
+					/* No multishot recvmsg; re-arming would spin */
+					if (ur.no_multishot == 0)
+						syslog(LOG_ERR, "io_uring: multishot recvmsg not "
+								"supported (Linux 6.0)");
+					ur.no_multishot = 1;
+				} else if (cqe->res != -ENOBUFS) {
+					log_msg(LOGT_SOCK, LOG_ERR, "io_uring: recvmsg: %s",
+							strerror(-cqe->res));
+				}
+				if ((cqe->flags & IORING_CQE_F_MORE) == 0 &&
+						ur.no_multishot == 0)
+					ur.rearm = 1;
+				break;
+			case TAG_SEND:
+				ur.send_res = cqe->res;
+				ur.sync_pending--;
+				break;
+			case TAG_POLL:
+				ur.sync_pending--;
+				break;
+			case TAG_ERRQ:
+				ur.errq_res = cqe->res;
+				ur.sync_pending--;
+				break;
+			case TAG_ASYNC_UDP:
+				if (cqe->res < 0 && cqe->res != -ECANCELED)
+					log_msg(LOGT_SEND, LOG_INFO, "sendmsg: %s", strerror(-cqe->res));
+				s->pending--;
+				break;
+			case TAG_ASYNC_TCP:
+				if (cqe->res != DATALEN && cqe->res != -ECANCELED &&
+						ur.dead_n < URING_SLOTS)
+					ur.dead[ur.dead_n++] = s->fd;
+				s->pending--;
+				break;
+			default: /* TAG_TIMEOUT */
+				break;
+		}
+		head++;
+	}
+	__atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+	if (ur.rearm == 1) {
+		ur.rearm = 0;
+		uring_arm_recv();
+	}
+}
+
+/**
+ * Queue the multishot recvmsg, which picks buffers from group 0
+ */
+static void uring_arm_recv(void) {
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ur.s_udp;
+	sqe->addr = (uint64_t)(uintptr_t)&ur.rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = URING_TAG(TAG_RECV, 0);
+}
+
+/**
+ * Hand receive buffer 'bid' (back) to the kernel
+ */
+static void uring_buf_put(uint16_t bid) {
+	struct io_uring_buf *b;
+
+	b = &ur.br->bufs[ur.br_tail & (URING_BUFS - 1)];
+	b->addr = (uint64_t)(uintptr_t)(ur.bufs + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	ur.br_tail++;
+	__atomic_store_n(&ur.br->tail, ur.br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find a free asynchronous send slot, waiting for one if needed
+ */
+static struct uring_slot *uring_slot(void) {
+	unsigned int i, n;
+
+	for (n = 0; n < 1000; n++) {
+		for (i = 0; i < URING_SLOTS; i++) {
+			ur.slot_next = (ur.slot_next + 1) % URING_SLOTS;
+			if (ur.slots[ur.slot_next].pending <= 0)
+				return &ur.slots[ur.slot_next];
+		}
+		if (uring_enter(ur.to_submit, 1) < 0 && errno != EINTR)
+			break;
+		uring_reap();
+	}
+	log_msg(LOGT_SEND, LOG_ERR, "io_uring: no free send slots");
+	return NULL;
+}
+
+/**
+ * Fill in a msghdr sending DATALEN bytes of 'data' with DSCP 'dscp'
+ */
+static void uring_msg(struct msghdr *msg, struct iovec *iov, char *ctrl,
+		addr_t *addr, char *data, uint8_t dscp) {
+	struct cmsghdr *cmsg;
+
+	memset(msg, 0, sizeof *msg);
+	iov->iov_base = data;
+	iov->iov_len = DATALEN;
+	msg->msg_name = addr;
+	msg->msg_namelen = (socklen_t)sizeof *addr;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = ctrl;
+	msg->msg_controllen = CMSG_SPACE(sizeof (int));
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+	if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr)) {
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_TOS;
+	} else {
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_TCLASS;
+	}
+	*(int *)CMSG_DATA(cmsg) = (int)dscp << 2;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+int uring_open(int s_udp) {
+	syslog(LOG_ERR, "io_uring: not supported by this build");
+	return -1;
+}
+int uring_recv(/*@out@*/ pkt_t *pkt) { return -1; }
+void uring_dscp(uint8_t dscp) { }
+int uring_send_w_ts(/*@unused@*/ int sock, addr_t *addr, char *data,
+		/*@out@*/ ts_t *ts) {
+	return -1;
+}
+int uring_send_linked(addr_t *addr, char *udp, int fd, char *tcp) {
+	return -1;
+}
+int uring_send_tcp(int fd, char *data) { return -1; }
+void uring_flush(void) { }
+int uring_usable(void) { return 0; }
+void uring_close(void) { }
+int uring_dead_fd(void) { return -1; }
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2011 Anders Berggren, Lukas Garberg, Tele2
+ *
+ * We have not yet decided upon a license, and so far it may only be
+ * used and redistributed with our explicit permission.
+ */
+
+int uring_open(int s_udp);
+int uring_recv(/*@out@*/ pkt_t *pkt);
+void uring_dscp(uint8_t dscp);
+int uring_send_w_ts(int sock, addr_t *addr, char *data, /*@out@*/ ts_t *ts);
+int uring_send_linked(addr_t *addr, char *udp, int fd, char *tcp);
+int uring_send_tcp(int fd, char *data);
+void uring_flush(void);
+int uring_usable(void);
+void uring_close(void);
+int uring_dead_fd(void);
@@ -18,6 +18,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include "probed.h"
 
@@ -66,123 +67,74 @@ void debug(int enabled) {
 	return;
 }
 
-/*@ -type Disable fucked up 'Arrow access field of non-struct...' */
 /**
- * Calculates the difference between two timespec.
+ * Current time.
  *
- * Calculates the value \p a - \p b.
- * 
- * \param[out] r Pointer to timespec where result will be written.
- * \param[in] a Time #1.
- * \param[in] b Time #2.
- * \return sign; 0 on positive, 1 on negative.
+ * \return CLOCK_REALTIME in nanoseconds since the epoch.
  */
-int diff_ts (/*@out@*/ ts_t *r, ts_t *a, ts_t *b) {
-
-	int neg = 0;
-
-	memset(r, 0, sizeof *r);
-
-	/*
-	 * This is a very long and straight-forward implementation.
-	 * Can (should? :)) be optimized!
-	 */
-
-	/* seconds larger? */
-	if (a->tv_sec > b->tv_sec) {
-
-		r->tv_sec = a->tv_sec - b->tv_sec;
-
-		/* nanoseconds larger? */
-		if (a->tv_nsec > b->tv_nsec) {
-
-			r->tv_nsec = a->tv_nsec - b->tv_nsec;
-
-		/* nanoseconds smaller? */
-		} else if (a->tv_nsec < b->tv_nsec) {
-
-			r->tv_sec -= 1;
-			r->tv_nsec = 1000000000 + a->tv_nsec - b->tv_nsec;
-
-		/* nanoseconds equal */
-		} else {
-
-			r->tv_nsec = 0;
-
-		}
-
-	/* seconds smaller? */
-	} else if (a->tv_sec < b->tv_sec) {
-
-		neg = 1;
-		r->tv_sec = b->tv_sec - a->tv_sec;
-
-		/* nanoseconds larger? */
-		if (a->tv_nsec > b->tv_nsec) {
-
-			r->tv_sec -= 1;
-			r->tv_nsec = b->tv_nsec + 1000000000 - a->tv_nsec;
-
-		/* nanoseconds smaller? */
-		} else if (a->tv_nsec < b->tv_nsec) {
-
-			r->tv_nsec = b->tv_nsec - a->tv_nsec;
-
-		/* nanoseconds equal */
-		} else {
-
-			r->tv_nsec = 0;
-
-		}
-
-	/* seconds equal */
-	} else {
+ts_t ts_now(void) {
+	struct timespec t;
 
-		r->tv_sec = 0;
-
-		/* nanoseconds larger? */
-		if (a->tv_nsec > b->tv_nsec) {
-
-			r->tv_nsec = a->tv_nsec - b->tv_nsec;
-
-		} else if (a->tv_nsec < b->tv_nsec) {
-
-			neg = 1;
-			r->tv_nsec = b->tv_nsec - a->tv_nsec;
-
-		} else {
-
-			r->tv_nsec = 0;
-
-		}
-
-	}
+	(void)clock_gettime(CLOCK_REALTIME, &t);
+	return TS_FROM_TIMESPEC(t);
+}
 
-	return neg;
+/**
+ * Current time, for scheduling.
+ *
+ * \return CLOCK_MONOTONIC in nanoseconds, unaffected by clock steps.
+ */
+ts_t ts_monotonic(void) {
+	struct timespec t;
 
+	(void)clock_gettime(CLOCK_MONOTONIC, &t);
+	return TS_FROM_TIMESPEC(t);
 }
 
-/** 
- * Compare two timespec.
+/**
+ * Convert received probe data to the current format.
  *
- * Returns -1 if \p t1 < \p t2, 1 if \p t1 > \p t2 and 0 if \p t1 == \p t2
+ * Packets not tagged with DATA_VERSION carry T2 and T3 as timespecs;
+ * they are converted to nanoseconds in place.
  *
- * \param[in] t1 Time #1.
- * \param[in] t2 Time #2.
- * \return Comparison result.
+ * \param[in,out] d Probe data, as received.
  */
-int cmp_ts(struct timespec *t1, struct timespec *t2) {
+void data_decode(data_t *d) {
+	struct packet_data_v0 *v0;
+	ts_t t2, t3;
+
+	if (d->version == DATA_VERSION)
+		return;
+	v0 = (struct packet_data_v0 *)d;
+	t2 = v0->t2_sec * NSEC_PER_SEC + v0->t2_nsec;
+	t3 = v0->t3_sec * NSEC_PER_SEC + v0->t3_nsec;
+	memset(d->reserved, 0, sizeof d->reserved);
+	d->t2 = t2;
+	d->t3 = t3;
+	d->version = DATA_VERSION;
+}
 
-	if (t1->tv_sec < t2->tv_sec) {
-		return -1;
-	} else if (t1->tv_sec > t2->tv_sec) {
-		return 1;
-	} else if (t1->tv_nsec < t2->tv_nsec) {
-		return -1;
-	} else if (t1->tv_nsec > t2->tv_nsec) {
-		return 1;
-	} else { /* equal */
-		return 0;
+/**
+ * Convert probe data to the format of a peer before sending.
+ *
+ * \param[in,out] d       Probe data, with nanosecond timestamps.
+ * \param[in]     version The version of the PING we are answering.
+ */
+void data_encode(data_t *d, num_t version) {
+	struct packet_data_v0 *v0;
+	ts_t t2, t3;
+
+	memset(d->reserved, 0, sizeof d->reserved);
+	if (version == DATA_VERSION) {
+		d->version = DATA_VERSION;
+		return;
 	}
-
+	t2 = d->t2;
+	t3 = d->t3;
+	v0 = (struct packet_data_v0 *)d;
+	v0->pad = 0;
+	v0->t2_sec = t2 / NSEC_PER_SEC;
+	v0->t2_nsec = t2 % NSEC_PER_SEC;
+	v0->t3_sec = t3 / NSEC_PER_SEC;
+	v0->t3_nsec = t3 % NSEC_PER_SEC;
 }
@@ -6,10 +6,13 @@
  */ 
 
 #define MAX(x, y) ((x)>(y)?(x):(y))
+#define MIN(x, y) ((x)<(y)?(x):(y))
 
 void debug(int enabled);
 void p(char *str);
-int diff_ts(/*@out@*/ ts_t *r, ts_t *a, ts_t *b);
-int cmp_ts(struct timespec *t1, struct timespec *t2);
+ts_t ts_now(void);
+ts_t ts_monotonic(void);
+void data_decode(data_t *d);
+void data_encode(data_t *d, num_t version);
 int cmp_tv(struct timeval *t1, struct timeval *t2);
 int addr2str(addr_t *a, /*@out@*/ char *s);